@@ -0,0 +1,52 @@
+#ifndef _ALTERNATIVE_H
+#define _ALTERNATIVE_H
+
+#include <types.h>
+
+/*
+ * Alternative instructions
+ *    - The kernel is built for the i486, code which can
+ *      be faster on newer cpus records a replacement with
+ *      the required cpu feature
+ *    - alternatives_apply() patches the replacements in
+ *      after cpu_detect(), before paging makes .text
+ *      read-only, so there's no runtime check
+ *    - The replacement must not be longer than the original,
+ *      the rest is filled with nops
+ *    - A replacement which is a single call or jmp (rel32)
+ *      is relocated
+ *    - Records and replacements are init data
+ */
+typedef struct alt_instr_s
+{
+    uint32_t orig;     // Original instructions
+    uint32_t repl;     // Replacement
+    uint16_t feature;  // CPU_FEATURE_*
+    uint8_t  orig_len;
+    uint8_t  repl_len;
+} alt_instr_t __packed;
+
+/*
+ * Inline assembly with alternative
+ *
+ * The feature is an asm operand, e.g.:
+ *
+ *    __asm__ __volatile__ (ALTERNATIVE("old", "new", "%c[feature]")
+ *                          : : [feature] "i" (CPU_FEATURE_XXX));
+ */
+#define ALTERNATIVE(oldinstr, newinstr, feature) \
+    "661:\n\t" oldinstr "\n662:\n" \
+    ".section .altinstructions, \"a\"\n" \
+    "  .long 661b\n" \
+    "  .long 663f\n" \
+    "  .word " feature "\n" \
+    "  .byte 662b-661b\n" \
+    "  .byte 664f-663f\n" \
+    ".previous\n" \
+    ".section .altinstr_replacement, \"ax\"\n" \
+    "663:\n\t" newinstr "\n664:\n" \
+    ".previous"
+
+void alternatives_apply() __init;
+
+#endif // _ALTERNATIVE_H
@@ -2,6 +2,8 @@
 #define _ASM_H
 
 #include <types.h>
+#include <alternative.h>
+#include <cpu.h>
 
 enum
 {
@@ -24,6 +26,20 @@ enum
     EFLAGS_ID   = (1<<21), // CPUID detection flag
 };
 
+enum
+{
+    CR0_EM      = (1<< 2), // Emulate FPU (set for lazy FPU switching)
+    CR0_WP      = (1<<16), // Write protect read-only pages in kernel mode
+
+    CR4_PAE     = (1<< 5), // Physical Address Extension
+    CR4_OSFXSR  = (1<< 9), // SSE instructions enabled
+
+    EFER_NXE    = (1<<11), // No-Execute Enable
+};
+
+// Extended Feature Enable Register (out of the range of an enum)
+#define MSR_EFER 0xC0000080
+
 static inline uint32_t eflags_get()
 {
     uint32_t eflags;
@@ -62,6 +78,29 @@ __asm__ __volatile__ ("movw %0, %%" #name : : "a" ((uint16_t)val))
 #define set_cs(val) \
 __asm__ __volatile__ ("ljmp %0, $1f\n1:" : : "i" (val));
 
+// Read model specific register
+static inline uint64_t rdmsr(uint32_t msr)
+{
+    uint64_t val;
+    __asm__ __volatile__ ("rdmsr" : "=A" (val) : "c" (msr));
+    return val;
+}
+
+// Write model specific register
+static inline void wrmsr(uint32_t msr, uint64_t val)
+{
+    __asm__ __volatile__ ("wrmsr" : : "c" (msr), "A" (val));
+}
+
+// Read time stamp counter (0 if the cpu has no TSC)
+static inline uint64_t rdtsc()
+{
+    uint64_t val;
+    __asm__ __volatile__ (ALTERNATIVE("xorl %%eax, %%eax; xorl %%edx, %%edx", "rdtsc", "%c[feature]")
+                          : "=A" (val) : [feature] "i" (CPU_FEATURE_TSC));
+    return val;
+}
+
 // Set IDTR (interrupt descriptor table register)
 static inline void set_idtr(uint32_t base, uint16_t limit)
 {
@@ -109,6 +148,12 @@ static inline void invalidate_tlb(uint32_t addr)
 #endif
 }
 
+// Flush complete TLB by reloading cr3
+static inline void flush_tlb()
+{
+    set_reg(cr3, get_reg(cr3));
+}
+
 // Are interrupts enabled
 static inline bool irqs_enabled()
 {
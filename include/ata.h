@@ -0,0 +1,8 @@
+#ifndef _ATA_H
+#define _ATA_H
+
+// Detect drives at the primary controller
+// and register them as block devices (hda, hdb)
+void ata_init() __init;
+
+#endif // _ATA_H
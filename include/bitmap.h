@@ -33,6 +33,14 @@ static inline void bitmap_clearbit(ulong* map, int bit)
     *(map + (bit >> BITS_SHIFT)) &= ~(1 << (bit & BITS_MASK));
 }
 
+// Lowest set bit of a word (must not be 0)
+static inline int bitmap_ffs(ulong word)
+{
+    int bit;
+    __asm__ ("bsfl %1, %0" : "=r" (bit) : "rm" (word));
+    return bit;
+}
+
 /*
  * Set/clear bit range
  */
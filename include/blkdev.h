@@ -0,0 +1,40 @@
+#ifndef _BLKDEV_H
+#define _BLKDEV_H
+
+#include <types.h>
+
+enum
+{
+    BLKDEV_SECTOR_SIZE = 512,
+    BLKDEV_MAX         = 8,
+};
+
+/*
+ * Block device
+ *    - Transfers whole sectors
+ *    - read and write return false on I/O errors
+ */
+typedef struct blkdev_s
+{
+    char     name[8];
+    uint32_t sectors;
+    bool   (*read)(struct blkdev_s*, uint32_t sector, int count, void* buf);
+    bool   (*write)(struct blkdev_s*, uint32_t sector, int count, const void* buf);
+    void*    data;
+} blkdev_t;
+
+void blkdev_register(blkdev_t*);
+blkdev_t* blkdev_get(int);
+blkdev_t* blkdev_find(const char* name);
+
+static inline bool blkdev_read(blkdev_t* dev, uint32_t sector, int count, void* buf)
+{
+    return dev->read(dev, sector, count, buf);
+}
+
+static inline bool blkdev_write(blkdev_t* dev, uint32_t sector, int count, const void* buf)
+{
+    return dev->write(dev, sector, count, buf);
+}
+
+#endif // _BLKDEV_H
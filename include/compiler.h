@@ -4,6 +4,9 @@
 // Non-returning
 #define __noreturn __attribute__ ((noreturn))
 
+// May be unused (demo threads)
+#define __unused __attribute__ ((unused))
+
 // Packed structure
 #define __packed //__attribute__ ((packed))
 
@@ -11,6 +14,10 @@
 #define __printf(a, b)          __attribute__ ((format (printf, a, b)))
 #define __printf_noreturn(a, b) __attribute__ ((format (printf, a, b), noreturn))
 
+// Alignment (own cache line)
+#define __aligned(x)        __attribute__ ((aligned (x)))
+#define __cacheline_aligned __aligned(64)
+
 // Init sections
 #define __init     __attribute__ ((__section__ (".init.text")))
 #define __initdata __attribute__ ((__section__ (".init.data")))
@@ -19,4 +26,7 @@
 #define likely(x)   __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
+// Compiler memory barrier
+#define barrier() __asm__ __volatile__ ("" : : : "memory")
+
 #endif // _COMPILER_H
@@ -1,14 +1,40 @@
 #ifndef _CONSOLE_H
 #define _CONSOLE_H
 
+#include <types.h>
+
 /*
  * Console interface
  * Everything is done with ANSI-Escape sequences!
  */
 
-void con_init() __init;
-int  con_putchar(int vc, int ch);
-void con_setvc(int vc);
-int  con_getvc();
+enum
+{
+    NUM_CONSOLES = 8,
+};
+
+void   con_init() __init;
+int    con_putchar(int vc, int ch);
+size_t con_write(int vc, const char* buf, size_t len);
+void   con_setvc(int vc);
+int    con_getvc();
+
+/*
+ * Sink which gets everything written to a console
+ * (serial mirror), NULL removes it
+ */
+
+typedef void (*con_sink_t)(const char*, size_t);
+void   con_set_sink(int vc, con_sink_t);
+
+/*
+ * Consoles are written to shadow buffers, con_flush_thread()
+ * copies changes to the screen. con_sync() flushes and makes
+ * all further output synchronous (panic).
+ */
+
+void   con_flush();
+void   con_sync();
+void   con_flush_thread() __noreturn;
 
 #endif // _CONSOLE_H
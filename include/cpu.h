@@ -49,6 +49,7 @@ enum
     
     // AMD cpu features (cpuid level 0x80000001, second dword)
     CPU_FEATURE_SYSCALL  = 43, // SYSCALL and SYSRET Instructions
+    CPU_FEATURE_NX       = 52, // No-Execute Page Protection
     CPU_FEATURE_MMXEXT   = 54, // AMD MMX extensions
     CPU_FEATURE_LM       = 61, // Long Mode (x86-64)
     CPU_FEATURE_3DNOWEXT = 62, // AMD 3DNow! extensions
@@ -76,11 +77,11 @@ void cpu_dump_info(const cpu_info_t*);
 
 static inline bool cpu_has_feature(const cpu_info_t* cpu, int f)
 {
-    return (cpu->feature[f >> 5] & f & 15);
+    return ((cpu->feature[f >> 5] >> (f & 31)) & 1);
 }
 
 // Check CPU feature
 #define CPU_HAS_FEATURE(f) \
-cpu_has_feature(get_cpu_info(), CPU_FEATURE_##f)
+cpu_has_feature(cpu_get_info(), CPU_FEATURE_##f)
 
 #endif // _CPU_H
@@ -3,15 +3,17 @@
 
 #include <regs.h>
 #include <stdio.h>
+#include <klog.h>
 
 void panic(const char *, ...) __printf_noreturn(1, 2);
 void dump_regs(const regs_t*);
 void stack_trace(int);
 
-#ifndef NDEBUG
+// Debug message of a category (see KLOG())
+#define TRACE(cat, fmt, args...) \
+    KLOG(cat, KLOG_DEBUG, fmt, ##args)
 
-#define TRACE(fmt, args...) \
-    printf(fmt, ##args)
+#ifndef NDEBUG
 
 #define DUMP(mem, size) \
     _dump(mem, size)
@@ -29,7 +31,6 @@ void _dump(const void*, size_t);
 
 #else
 
-#define TRACE(fmt, args...)
 #define DUMP(mem, size)
 #define ASSERT(expr)
 #define XASSERT(expr, fmt, ...)
@@ -37,4 +37,15 @@ DEFINE_FUNCS(l, uint32_t)
 
 #undef DEFINE_FUNCS
 
+// Transfer count words from/to port
+static inline void insw(uint16_t p, void* buf, int count)
+{
+    __asm__ __volatile__ ("rep; insw" : "+D" (buf), "+c" (count) : "d" (p) : "memory");
+}
+
+static inline void outsw(uint16_t p, const void* buf, int count)
+{
+    __asm__ __volatile__ ("rep; outsw" : "+S" (buf), "+c" (count) : "d" (p));
+}
+
 #endif // _IO_H
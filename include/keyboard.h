@@ -1,6 +1,8 @@
 #ifndef _KEYBOARD_H
 #define _KEYBOARD_H
 
+#include <types.h>
+
 void kbd_init() __init;
 
 // Delay 0 = 250 msec ... 3 = 1000msec
@@ -9,5 +11,14 @@ void kbd_setrate(int delay, int repeat);
 
 void kbd_reboot();
 
+/*
+ * The irq handler only queues scancodes, kbd_thread() translates
+ * them and queues the characters for the visible console (echoed).
+ * kbd_read() waits for input of a console (one reader per console).
+ */
+
+void   kbd_thread() __noreturn;
+size_t kbd_read(int vc, char* buf, size_t len);
+
 #endif // _KEYBOARD_H
 
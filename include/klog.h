@@ -0,0 +1,126 @@
+#ifndef _KLOG_H
+#define _KLOG_H
+
+#include <types.h>
+#include <stdarg.h>
+
+/*
+ * Kernel log
+ *    - printk() appends a record to a ring of fixed-size slots
+ *      without locks: the slot is reserved by an atomic increment
+ *      of the sequence number and published by writing this
+ *      number into the slot after the text
+ *    - Old records are overwritten, readers notice this by the
+ *      sequence number and skip ahead
+ *    - klog_thread() renders new records to KLOG_CONSOLE, until
+ *      it runs (and after klog_sync()) printk() renders directly
+ *    - Messages longer than a slot are continued in the next
+ *      slots (KLOG_CONT)
+ *
+ * Filtering of KLOG()
+ *    - Levels above KLOG_LEVEL (build option, -DKLOG_LEVEL=n)
+ *      are compiled out
+ *    - At runtime klog_enable() selects the levels per category,
+ *      a disabled message costs one test of klog_enabled[level]
+ */
+
+enum
+{
+    // Levels
+    KLOG_ERR   = 0,
+    KLOG_WARN  = 1,
+    KLOG_INFO  = 2,
+    KLOG_DEBUG = 3,
+
+    // Categories (bits)
+    KLOG_CAT_CORE   = 0x01,
+    KLOG_CAT_MALLOC = 0x02,
+    KLOG_CAT_MEM    = 0x04, // Physical and virtual memory
+    KLOG_CAT_IRQ    = 0x08,
+    KLOG_CAT_THREAD = 0x10,
+    KLOG_CAT_DEV    = 0x20, // Drivers
+    KLOG_CAT_ALL    = 0x3F,
+    KLOG_CATEGORIES = 6,
+
+    // Record flags
+    KLOG_CONT  = 0x01, // Continues the previous record
+
+    KLOG_TEXT     = 112, // Text per slot
+    KLOG_RECORDS  = 512, // Slots (power of two)
+    KLOG_CONSOLE  = 0,
+};
+
+typedef struct klog_record_s
+{
+    uint32_t seq;
+    uint8_t  cat;
+    uint8_t  level;
+    uint8_t  flags;
+    uint8_t  len;
+    uint64_t tsc;
+    char     text[KLOG_TEXT];
+} klog_record_t;
+
+typedef struct klog_stats_s
+{
+    uint32_t records; // Written
+    uint32_t dropped; // Overwritten before rendered
+} klog_stats_t;
+
+#ifndef KLOG_LEVEL
+#  ifdef NDEBUG
+#    define KLOG_LEVEL KLOG_INFO
+#  else
+#    define KLOG_LEVEL KLOG_DEBUG
+#  endif
+#endif
+
+// Enabled categories per level
+extern uint32_t klog_enabled[KLOG_DEBUG + 1];
+
+#define KLOG(cat, level, fmt, args...) \
+    ((level) <= KLOG_LEVEL && (klog_enabled[level] & (cat)) ? \
+     klog(cat, level, fmt, ##args) : 0)
+
+/*
+ * Append a message
+ *
+ * printk() logs in KLOG_CAT_CORE, both don't filter
+ * (use KLOG() for this)
+ */
+
+int klog(int cat, int level, const char* format, ...) __printf(3, 4);
+int vklog(int cat, int level, const char* format, va_list);
+int printk(int level, const char* format, ...) __printf(2, 3);
+
+/*
+ * Enable levels up to level for the categories (and disable
+ * the levels above), e.g. klog_enable(KLOG_CAT_MALLOC, KLOG_DEBUG)
+ * turns on malloc tracing. All categories start at KLOG_INFO.
+ */
+
+void klog_enable(int cats, int level);
+
+/*
+ * Read the next record with a sequence number >= *seq
+ * (0: oldest), *seq is set behind it. Returns false if
+ * there's no such record (yet).
+ */
+
+bool klog_read(uint32_t* seq, klog_record_t*);
+
+// Records up to this level are rendered (all by default)
+void klog_set_console_level(int);
+
+// Render pending records and render directly from now on (panic)
+void klog_sync();
+
+void klog_thread() __noreturn;
+
+// All records with timestamps (dmesg)
+void klog_dump();
+
+const klog_stats_t* klog_get_stats();
+void klog_dump_stats(const klog_stats_t*);
+
+#endif // _KLOG_H
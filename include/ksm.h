@@ -0,0 +1,47 @@
+#ifndef _KSM_H
+#define _KSM_H
+
+#include <types.h>
+#include <pmem.h>
+
+/*
+ * Same-page merging statistics
+ */
+typedef struct ksm_stats_s
+{
+    int shared;     // Merged pages
+    int sharing;    // Mappings of merged pages (saved: sharing - shared)
+    int scanned;
+    int full_scans;
+} ksm_stats_t;
+
+/*
+ * General functions
+ */
+
+void ksm_init() __init;
+const ksm_stats_t* ksm_get_stats();
+void ksm_dump_stats(const ksm_stats_t*);
+
+/*
+ * Register range of anonymous memory for merging.
+ * Only writable pageable pages (PAGE_RW | PAGE_ANON) are merged.
+ */
+
+void ksm_register(uint32_t start, uint32_t end);
+
+/*
+ * Used by vmem if the last mapping of a merged page
+ * is dropped or gets write access
+ */
+
+void ksm_remove_page(pmem_page_t*);
+
+/*
+ * Low priority thread which scans the registered
+ * ranges for identical pages
+ */
+
+void ksm_thread() __noreturn;
+
+#endif // _KSM_H
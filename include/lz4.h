@@ -0,0 +1,33 @@
+#ifndef _LZ4_H
+#define _LZ4_H
+
+#include <types.h>
+
+/*
+ * LZ4 block format compression
+ *    - Compatible with the LZ4 block format (no frame header)
+ *    - Blocks are limited to 64K, so match positions
+ *      fit into 16 bit
+ */
+
+enum
+{
+    LZ4_MAX_INPUT    = 0x10000,
+
+    // Size of the hash table which must be passed to lz4_compress()
+    LZ4_HASH_BITS    = 12,
+    LZ4_WORKMEM_SIZE = (1 << LZ4_HASH_BITS) * sizeof (uint16_t),
+};
+
+/*
+ * lz4_compress() returns the compressed size or 0 if the
+ * result doesn't fit into max bytes.
+ *
+ * lz4_decompress() returns the decompressed size or -1 if
+ * the input is malformed or doesn't fit into max bytes.
+ */
+
+int lz4_compress(const void* src, int size, void* dst, int max, void* workmem);
+int lz4_decompress(const void* src, int size, void* dst, int max);
+
+#endif // _LZ4_H
@@ -0,0 +1,57 @@
+#ifndef _MEMBLOCK_H
+#define _MEMBLOCK_H
+
+#include <types.h>
+#include <page.h>
+
+/*
+ * Boot memory allocator
+ *    - Keeps usable memory and reserved ranges (kernel,
+ *      modules, firmware, allocations) as sorted range lists
+ *    - Used before the page allocator works, e.g. for the
+ *      frame metadata and the initial page tables
+ *    - Allocations are cleared and accessible by PHYS_TO_VIRT,
+ *      before paging by the segmentation and afterwards by
+ *      the kernel mapping (see vmem_init)
+ *    - memblock_release() hands the free ranges to the
+ *      page allocator, no allocations are possible afterwards
+ */
+
+enum
+{
+    MEMBLOCK_MAX   = 32,         // Max. ranges in each list
+    MEMBLOCK_LIMIT = 0x30000000, // Allocations below (mapped at PHYS_TO_VIRT)
+};
+
+typedef struct memblock_range_s
+{
+    paddr_t start;
+    paddr_t end;
+} memblock_range_t;
+
+typedef void (*memblock_func_t)(paddr_t start, paddr_t end);
+
+/*
+ * memblock_init() adds the usable memory from the boot
+ * manager and reserves everything which is in use already.
+ */
+
+void memblock_init() __init;
+void memblock_add(uint64_t start, uint64_t end) __init;
+void memblock_reserve(uint64_t start, uint64_t end) __init;
+paddr_t memblock_alloc(size_t size, size_t align) __init;
+void memblock_release(memblock_func_t) __init;
+void memblock_dump() __init;
+
+/*
+ * Range lists (sorted, not overlapping and page aligned)
+ *
+ * Allocations are in order and are also part of the
+ * reserved ranges.
+ */
+
+const memblock_range_t* memblock_get_memory(int* count) __init;
+const memblock_range_t* memblock_get_reserved(int* count) __init;
+const memblock_range_t* memblock_get_alloc(int i) __init;
+
+#endif // _MEMBLOCK_H
@@ -0,0 +1,94 @@
+#ifndef _MEMGROUP_H
+#define _MEMGROUP_H
+
+#include <types.h>
+#include <list.h>
+#include <thread.h>
+
+/*
+ * Memory accounting groups
+ *    - Every thread belongs to a group, new threads
+ *      inherit the group of their creator
+ *    - Physical pages are charged to the group of the
+ *      allocating thread (kept in the page descriptor)
+ *      and uncharged when they are freed
+ *    - Heap objects are charged in bytes (kept in the
+ *      block header), the heap pages themselves are
+ *      charged like all other pages
+ *    - Limits are in pages (0: no limit)
+ *        soft: global reclaim takes pages of groups over
+ *              their soft limit first
+ *        hard: charges over the limit reclaim pages of the
+ *              group and fail if this doesn't help
+ */
+typedef struct memgroup_s
+{
+    list_t list_entry;
+    char   name[16];
+
+    // Usage
+    int pages;
+    int max_pages;
+    int heap;       // Bytes
+    int threads;
+
+    // Limits
+    int soft_limit;
+    int hard_limit;
+
+    // Events
+    int reclaimed;  // Pages reclaimed because of the hard limit
+    int failed;     // Charges over the hard limit
+} memgroup_t;
+
+/*
+ * General functions
+ *
+ * memgroup_init() puts the current (idle) thread into
+ * memgroup_root, pages allocated before aren't charged.
+ */
+
+extern memgroup_t memgroup_root;
+
+void memgroup_init() __init;
+memgroup_t* memgroup_create(const char* name);
+void memgroup_set_limits(memgroup_t*, int soft, int hard);
+
+// Iterate over all groups (first group for NULL)
+memgroup_t* memgroup_next(const memgroup_t*);
+
+/*
+ * Group of the current thread (NULL during boot and in
+ * softirqs, which don't run on behalf of the thread)
+ *
+ * memgroup_attach() moves a thread to another group,
+ * charges made before stay with the old group
+ */
+
+memgroup_t* memgroup_current();
+void memgroup_attach(thread_t*, memgroup_t*);
+
+/*
+ * Charges (group may be NULL)
+ *
+ * memgroup_charge() returns false if the group stays over its
+ * hard limit even after reclaim. Charges made during reclaim
+ * are never refused because they help to free memory.
+ * The group is only reclaimed in thread context with irqs
+ * enabled (see reclaim_allowed()), charges from irq handlers
+ * or irqs-disabled sections may exceed the hard limit.
+ * Heap charges are negative if objects are freed.
+ */
+
+bool memgroup_charge(memgroup_t*, int pages);
+void memgroup_uncharge(memgroup_t*, int pages);
+void memgroup_charge_heap(memgroup_t*, int bytes);
+
+/*
+ * Group with the largest excess over its soft limit
+ * (NULL if there is none), used by the page reclaim
+ */
+
+memgroup_t* memgroup_soft_excess(int* excess);
+
+#endif // _MEMGROUP_H
@@ -0,0 +1,32 @@
+#ifndef _MEMOPS_H
+#define _MEMOPS_H
+
+#include <types.h>
+
+/*
+ * Block memory routines
+ *    - memcpy(), memset(), memmove() and memcmp() use
+ *      rep movs/stos for small blocks and head/tail bytes
+ *    - Bigger blocks are handled by MMX or SSE2 variants,
+ *      very big ones with non-temporal stores which don't
+ *      pollute the cache
+ *    - The variant is selected by memops_init() from the
+ *      cpu features, until then only rep movs/stos is used
+ *    - The FPU registers are used between kernel_fpu_begin()
+ *      and kernel_fpu_end() in chunks, so irqs aren't
+ *      disabled for long
+ */
+
+void memops_init() __init;
+
+/*
+ * Variants: "rep", "mmx" and "sse2"
+ *
+ * memops_select() returns false if the variant is unknown
+ * or not supported by the cpu (used by benchmarks)
+ */
+
+bool memops_select(const char* name);
+const char* memops_current();
+
+#endif // _MEMOPS_H
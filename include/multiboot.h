@@ -19,6 +19,17 @@ enum
     MULTIBOOT_DRIVES           = 0x080,
     MULTIBOOT_CONFIG_TABLE     = 0x100,
     MULTIBOOT_BOOT_LOADER_NAME = 0x200,
+
+    // Memory map types
+    MULTIBOOT_MEMORY_AVAILABLE = 1,
+    MULTIBOOT_MEMORY_RESERVED  = 2,
+    MULTIBOOT_MEMORY_ACPI      = 3,
+    MULTIBOOT_MEMORY_NVS       = 4,
+    MULTIBOOT_MEMORY_BAD       = 5,
+
+    // Max. entries copied to kernel space
+    MULTIBOOT_MAX_MMAP = 32,
+    MULTIBOOT_MAX_MODS = 16,
 };
 
 /*
@@ -42,8 +53,33 @@ typedef struct multiboot_info_s
     char*     boot_loader_name;
 } multiboot_info_t __packed;
 
+/*
+ * Memory map entry (BIOS E820)
+ * size is the size of the entry without the size field
+ */
+typedef struct multiboot_mmap_s
+{
+    uint32_t  size;
+    uint64_t  base;
+    uint64_t  length;
+    uint32_t  type;
+} multiboot_mmap_t __packed;
+
+/*
+ * Boot module
+ */
+typedef struct multiboot_module_s
+{
+    uint32_t  start;
+    uint32_t  end;
+    char*     cmdline;
+    uint32_t  reserved;
+} multiboot_module_t __packed;
+
 // Load multiboot information
 void multiboot_init(uint32_t eax, uint32_t ebx, int* argc, char** argv);
 const multiboot_info_t* multiboot_get();
+const multiboot_mmap_t* multiboot_get_mmap(int* count);
+const multiboot_module_t* multiboot_get_mods(int* count);
 
 #endif // _MULTIBOOT_H
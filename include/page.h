@@ -1,6 +1,8 @@
 #ifndef _PAGE_H
 #define _PAGE_H
 
+#include <types.h>
+
 enum
 {
     // Page flags
@@ -11,6 +13,11 @@ enum
     PAGE_PCD          = 0x010,  // Page Cache Disable (all entries)
     PAGE_ACCESSED     = 0x020,  // Accessed (all entries)
     PAGE_DIRTY        = 0x040,  // Dirty Page (PTE only)
+    PAGE_LOCKED       = 0x100,  // Swapped entry in transfer (software, not present only)
+    PAGE_ANON         = 0x200,  // Pageable anonymous memory (software)
+    PAGE_SWAPPED      = 0x400,  // Not present, address is a swap slot (software)
+    PAGE_KSM          = 0x800,  // Merged page, mapped read-only (software)
+    PAGE_NX           = 0x1000, // No Execute (bit 63 of PAE entries)
 
     // Page size
     PAGE_SIZE         = 0x1000, // Page size
@@ -22,27 +29,42 @@ enum
 #define SIZE_TO_PAGES(size) \
     (((size) + PAGE_SIZE - 1) / PAGE_SIZE)
 
-typedef uint32_t page_t;
+/*
+ * Physical addresses and page table entries are 64 bit
+ * because of PAE. Without PAE the upper half is always zero.
+ */
+typedef uint64_t paddr_t;
+typedef uint64_t page_t;
+
+enum
+{
+    _PAGE_FLAG_MASK = 0xFFF,
+};
+
+#define _PAGE_NX_BIT (1ULL << 63)
 
-static inline page_t page_init(uint32_t address, int flags)
+static inline page_t page_init(paddr_t address, int flags)
 {
-    return ((address & 0xFFFFF000) | (flags & 0x1FF));
+    page_t page = (address & ~(paddr_t)_PAGE_FLAG_MASK) | (flags & _PAGE_FLAG_MASK);
+    if (flags & PAGE_NX)
+        page |= _PAGE_NX_BIT;
+    return page;
 }
     
-static inline uint32_t page_get_address(page_t page)
+static inline paddr_t page_get_address(page_t page)
 {
-    return (page & 0xFFFFF000);
+    return (page & ~(_PAGE_NX_BIT | _PAGE_FLAG_MASK));
 }
  
 static inline int page_get_flags(page_t page)
 {
-    return (page & 0x1FF);
+    return ((page & _PAGE_FLAG_MASK) | (page & _PAGE_NX_BIT ? PAGE_NX : 0));
 }
 
 // Utility to check if address is page aligned
-static inline bool is_page_aligned(uint32_t addr)
+static inline bool is_page_aligned(paddr_t addr)
 {
-    return ((addr & 0xFFFFF000) == addr);
+    return ((addr & _PAGE_FLAG_MASK) == 0);
 }
 
 #endif // _PAGE_H
@@ -2,6 +2,9 @@
 #define _PMEM_H
 
 #include <types.h>
+#include <list.h>
+#include <page.h>
+#include <debug.h>
 
 /*
  * Memory statistics
@@ -14,36 +17,116 @@ typedef struct pmem_stats_s
     int used;
     int upper;
     int lower;
+    int high;   // Above 4G (PAE only)
     int kernel;
+    // Pre-zeroed page pool
+    int zeroed;
+    int zero_hits;
+    int zero_misses;
 } pmem_stats_t;
 
+/*
+ * Page descriptor
+ *    - One for each managed physical page
+ *    - Kept small (32 bytes) because there are many of them
+ *    - Pages of the compressed page allocator (zsmalloc) use
+ *      owner for the size class, mapcount for the number of
+ *      objects and vaddr for the first free object
+ */
+
+enum
+{
+    // Page descriptor flags
+    PMEM_KERNEL  = 0x01, // Kernel image or boot data
+    PMEM_PGTABLE = 0x02, // Page table
+    PMEM_ZEROED  = 0x04, // Page is cleared (in the zero pool)
+    PMEM_DIRTY   = 0x08, // Contents must be written back before reuse
+    PMEM_LOCKED  = 0x10, // Page must not be reclaimed
+    PMEM_LRU     = 0x20, // Page is on a reclaim list
+    PMEM_ACTIVE  = 0x40, // Page is on the active list
+    PMEM_KSM     = 0x80, // Merged page (owner is the stable node)
+};
+
+typedef struct pmem_page_s
+{
+    int      count;    // Usage counter (page tables: used entries)
+    int      mapcount; // Number of page table entries mapping the page
+    uint32_t flags;
+    void*    owner;    // Owner or mapping of the page
+    uint32_t vaddr;    // Virtual address (pageable pages)
+    list_t   lru;      // LRU list or zero pool entry
+    struct memgroup_s* memgroup; // Charged group (NULL if not charged)
+} pmem_page_t;
+
 /*
  * General functions 
  */
 
 void pmem_init() __init;
+void pmem_handoff() __init;
 const pmem_stats_t* pmem_get_stats();
 void pmem_dump_stats(const pmem_stats_t*);
+void pmem_dump_regions();
 void pmem_dump_map();
 
 /*
  * Manage physical memory
  */
 
-uint32_t pmem_alloc_page();
-void     pmem_free_page(uint32_t);
-void     pmem_alloc_region(uint32_t, uint32_t);
-void     pmem_free_region(uint32_t, uint32_t);
+paddr_t pmem_alloc_page();
+paddr_t pmem_alloc_zeroed_page();
+void    pmem_free_page(paddr_t);
+void    pmem_alloc_region(paddr_t, paddr_t);
+void    pmem_free_region(paddr_t, paddr_t);
+
+/*
+ * Page descriptors
+ *
+ * pmem_get_page() returns the descriptor of a physical page
+ * or NULL if the page isn't managed (e.g. VGA memory)
+ */
+
+pmem_page_t* pmem_get_page(paddr_t);
+paddr_t      pmem_page_address(const pmem_page_t*);
 
 /*
  * Usage counters for physical pages which must be
- * allocated
+ * allocated (panics if the page isn't managed)
  * 
  * pmem_inc() increments usage counter
  * pmem_dec() decrements usage counter
+ * pmem_add() adds n to the usage counter (n can be negative)
+ */
+
+static inline pmem_page_t* pmem_get_managed_page(paddr_t page)
+{
+    pmem_page_t* desc = pmem_get_page(page);
+
+    if (!desc)
+        panic("Physical frame 0x%X isn't managed", (uint32_t)(page / PAGE_SIZE));
+    return desc;
+}
+
+static inline int pmem_inc(paddr_t page)
+{
+    return ++pmem_get_managed_page(page)->count;
+}
+
+static inline int pmem_dec(paddr_t page)
+{
+    return --pmem_get_managed_page(page)->count;
+}
+
+static inline int pmem_add(paddr_t page, int n)
+{
+    return (pmem_get_managed_page(page)->count += n);
+}
+
+/*
+ * Background thread which fills the pool of
+ * pre-zeroed pages from the free pages
  */
 
-int pmem_inc(uint32_t);
-int pmem_dec(uint32_t);
+void pmem_zero_thread() __noreturn;
 
 #endif // _PMEM_H
@@ -0,0 +1,7 @@
+#ifndef _RAMDISK_H
+#define _RAMDISK_H
+
+// Register boot modules as block devices (rd0, rd1, ...)
+void ramdisk_init() __init;
+
+#endif // _RAMDISK_H
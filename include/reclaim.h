@@ -0,0 +1,105 @@
+#ifndef _RECLAIM_H
+#define _RECLAIM_H
+
+#include <types.h>
+#include <pmem.h>
+
+/*
+ * Reclaim statistics
+ */
+typedef struct reclaim_stats_s
+{
+    // All values in pages
+    int active;
+    int inactive;
+    int scanned;
+    int reclaimed;
+    // Number of runs
+    int direct;
+    int wakeups;
+    // Watermarks of free pages
+    int wmark_min;  // Below: direct reclaim by the allocator
+    int wmark_low;  // Below: reclaim thread is woken up
+    int wmark_high; // Above: reclaim thread stops
+} reclaim_stats_t;
+
+/*
+ * Pageout function
+ *    - Writes the page to a backing store and unmaps it
+ *    - The page is isolated (see below), the function
+ *      must put it back with reclaim_putback()
+ *    - May evict other inactive pages along with it
+ *    - Called with irqs enabled (unless the caller of the
+ *      reclaim had them disabled), so the page may be
+ *      unmapped or written during the I/O
+ *    - Returns the number of freed pages (0 if the
+ *      page can't be evicted)
+ */
+typedef int (*reclaim_pageout_t)(pmem_page_t*);
+
+/*
+ * General functions
+ */
+
+void reclaim_init() __init;
+const reclaim_stats_t* reclaim_get_stats();
+void reclaim_dump_stats(const reclaim_stats_t*);
+void reclaim_set_pageout(reclaim_pageout_t);
+
+/*
+ * Pageable pages (mapped by vmem with PAGE_ANON)
+ */
+
+void reclaim_add_page(pmem_page_t*);
+void reclaim_remove_page(pmem_page_t*);
+
+/*
+ * Used by the pageout function (irqs disabled)
+ *
+ * reclaim_isolate() takes an inactive page off the lists,
+ * locks it (PMEM_LOCKED) and holds a reference, so it isn't
+ * freed during the I/O. reclaim_putback() drops the reference
+ * and frees the page if it was unmapped meanwhile (or by the
+ * pageout), otherwise the page goes back to the inactive list.
+ * It returns the number of freed pages (0 or 1).
+ */
+
+void reclaim_isolate(pmem_page_t*);
+int  reclaim_putback(pmem_page_t*);
+
+/*
+ * Used by the page allocator
+ *
+ * reclaim_check() wakes up the reclaim thread or
+ * reclaims directly depending on the watermarks.
+ * Direct reclaim does block I/O, so it's done only if
+ * reclaim_allowed(): a thread with irqs enabled, not an
+ * irq handler, softirq or irqs-disabled section. Otherwise
+ * only the reclaim thread is woken up.
+ */
+
+bool reclaim_allowed();
+void reclaim_check(int free);
+int  reclaim_direct(int count);
+
+/*
+ * Used by the memory accounting
+ *
+ * reclaim_group() only evicts pages charged to the group.
+ * Global reclaim takes pages from groups over their soft
+ * limit first.
+ */
+
+struct memgroup_s;
+
+int  reclaim_group(struct memgroup_s*, int count);
+bool reclaim_running();
+
+/*
+ * Background thread which keeps free pages
+ * between the low and the high watermark
+ */
+
+void reclaim_thread() __noreturn;
+
+#endif // _RECLAIM_H
@@ -1,16 +1,64 @@
 #ifndef _RINGBUF_H
 #define _RINGBUF_H
 
-typedef struct ringbuf_s {
-    size_t available;
-    size_t size;
-    size_t __head;
-    size_t __tail;
-    char*  __data;
-} ringbuf_t:
-
-void ringbuf_init(ringbuf_t* buf, size_t size);
-bool ringbuf_write(ringbuf_t* buf, int ch);
-int  ringbuf_read(ringbuf_t* buf);
-
-#endif
+#include <types.h>
+
+/*
+ * Lock-free byte ring
+ *    - Capacity is a power of two, head and tail run freely
+ *      (modulo RINGBUF_POS_MASK) and live in separate cache lines
+ *    - Single producer/single consumer: ringbuf_write() and
+ *      ringbuf_read() need no locks or disabled irqs as long as
+ *      only one context writes and one context reads
+ *    - Multiple producers: ringbuf_mp_write() reserves space with
+ *      an atomic compare-exchange, writes are all or nothing.
+ *      The data becomes visible when the last producer which is
+ *      inside the ring has finished (no waiting, so producers in
+ *      irq handlers can't deadlock). Don't mix with ringbuf_write().
+ *    - Zero-copy: *_reserve() returns the contiguous part of the
+ *      free space (data), *_commit() publishes (releases) it
+ */
+
+enum
+{
+    RINGBUF_POS_BITS = 24,
+    RINGBUF_POS_MASK = (1 << RINGBUF_POS_BITS) - 1,
+    RINGBUF_MAX_SIZE = 1 << (RINGBUF_POS_BITS - 1),
+};
+
+typedef struct ringbuf_s
+{
+    char*    data;
+    uint32_t size;
+
+    // Producers: published position and (multi-producer)
+    // reservations: position << 8 | producers in the ring
+    volatile uint32_t head __cacheline_aligned;
+    volatile uint32_t state;
+
+    // Consumer
+    volatile uint32_t tail __cacheline_aligned;
+} ringbuf_t;
+
+// size must be a power of two (up to RINGBUF_MAX_SIZE)
+void ringbuf_setup(ringbuf_t*, void* data, size_t size);
+
+// Allocated ring, size is rounded up to a power of two
+bool ringbuf_init(ringbuf_t*, size_t size);
+void ringbuf_free(ringbuf_t*);
+
+size_t ringbuf_used(const ringbuf_t*);
+size_t ringbuf_space(const ringbuf_t*);
+
+// Bulk operations, return the number of bytes transferred
+size_t ringbuf_write(ringbuf_t*, const void*, size_t);
+size_t ringbuf_read(ringbuf_t*, void*, size_t);
+size_t ringbuf_mp_write(ringbuf_t*, const void*, size_t);
+
+// Zero-copy (single producer/consumer)
+size_t ringbuf_write_reserve(ringbuf_t*, void**);
+void   ringbuf_write_commit(ringbuf_t*, size_t);
+size_t ringbuf_read_reserve(ringbuf_t*, const void**);
+void   ringbuf_read_commit(ringbuf_t*, size_t);
+
+#endif // _RINGBUF_H
@@ -52,4 +52,13 @@ extern char _INIT_SIZE[];
 extern char _CTORS_START[];
 #define CTORS_START ((uint32_t)_CTORS_START)
 
+/*
+ * Alternative instructions (see alternative.h)
+ */
+
+extern char _ALTINSTR_START[];
+extern char _ALTINSTR_SIZE[];
+#define ALTINSTR_START ((uint32_t)_ALTINSTR_START)
+#define ALTINSTR_SIZE  ((uint32_t)_ALTINSTR_SIZE)
+
 #endif // _SECTION_H
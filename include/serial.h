@@ -0,0 +1,52 @@
+#ifndef _SERIAL_H
+#define _SERIAL_H
+
+#include <types.h>
+
+/*
+ * 16550 UART driver
+ *    - FIFOs are enabled (16 bytes on a 16550A)
+ *    - serial_write() queues into a transmit ring which is
+ *      drained by THRE interrupts, if the ring is full (or
+ *      after serial_sync()) it waits for the transmitter
+ *    - Received bytes are queued by the irq handler until
+ *      serial_read() takes them (dropped if the ring is full),
+ *      there must be only one reader per port
+ */
+
+enum
+{
+    SERIAL_COM1  = 0,
+    SERIAL_COM2  = 1,
+    SERIAL_PORTS = 2,
+
+    SERIAL_BAUD  = 115200, // Default
+};
+
+typedef struct serial_stats_s
+{
+    uint32_t tx, rx;     // Bytes
+    uint32_t tx_waits;   // Writes which waited for the transmitter
+    uint32_t rx_dropped; // Ring full
+    uint32_t overruns;   // FIFO overruns
+} serial_stats_t;
+
+// Detect and initialize the ports
+void serial_init() __init;
+
+bool serial_present(int port);
+bool serial_set_baud(int port, int baud);
+
+size_t serial_write(int port, const char* buf, size_t len);
+size_t serial_read(int port, char* buf, size_t len);
+
+// Mirror console output (LF as CR LF)
+void serial_console(int port, int vc);
+
+// Drain the transmit rings and transmit synchronously from now on (panic)
+void serial_sync();
+
+const serial_stats_t* serial_get_stats(int port);
+void serial_dump_stats(const serial_stats_t*);
+
+#endif // _SERIAL_H
@@ -0,0 +1,89 @@
+#ifndef _SOFTIRQ_H
+#define _SOFTIRQ_H
+
+#include <types.h>
+#include <list.h>
+#include <regs.h>
+
+/*
+ * Deferred irq work
+ *    - Irq handlers do only the work which needs the hardware
+ *      and raise a softirq for the rest
+ *    - Raised softirqs run in irq_exit() at the end of the
+ *      outermost interrupt with irqs enabled, on the stack of
+ *      the interrupted thread. They don't nest and the thread
+ *      isn't switched until they are done.
+ *    - Softirqs raised outside of irqs wait for the next irq
+ *      exit (at the latest the next tick)
+ *    - Tasklets are driver callbacks which run in the tasklet
+ *      softirq, a tasklet is queued only once at a time
+ *    - Softirqs and tasklets must not sleep, work which sleeps
+ *      is queued for the worker thread (workqueue_thread())
+ *
+ * There's only one cpu, so the pending softirqs are global.
+ */
+
+enum
+{
+    SOFTIRQ_TIMER   = 0, // Expired timers
+    SOFTIRQ_TASKLET = 1,
+    SOFTIRQS        = 2,
+
+    SOFTIRQ_RESTARTS = 8, // Rounds per irq exit, the rest waits for the next irq
+};
+
+typedef void (*softirq_func_t)();
+
+typedef struct tasklet_s
+{
+    list_t     list_entry;
+    callback_t func;
+    void*      arg;
+    bool       queued;
+} tasklet_t;
+
+typedef struct work_s
+{
+    list_t     list_entry;
+    callback_t func;
+    void*      arg;
+    bool       queued;
+} work_t;
+
+#define TASKLET_INIT(f, a) { { NULL, NULL }, (f), (a), false }
+#define WORK_INIT(f, a)    { { NULL, NULL }, (f), (a), false }
+
+typedef struct softirq_stats_s
+{
+    uint32_t runs[SOFTIRQS];
+    uint32_t tasklets;
+    uint32_t works;
+    uint32_t deferred; // Irq exits which left softirqs pending
+} softirq_stats_t;
+
+void softirq_register(int nr, softirq_func_t);
+void softirq_raise(int nr);
+
+// Called by interrupt_stub after the handler (irqs disabled)
+void irq_exit(const regs_t regs);
+
+// True while softirqs (and tasklets) are running
+bool softirq_running();
+
+// Queues the tasklet unless it's queued already (may be called from irqs)
+void tasklet_schedule(tasklet_t*);
+
+/*
+ * Work for the worker thread, work may sleep
+ *
+ * queue_work() returns false if the work is queued already,
+ * it may be called from irqs.
+ */
+
+bool queue_work(work_t*);
+void workqueue_thread() __noreturn;
+
+const softirq_stats_t* softirq_get_stats();
+void softirq_dump_stats(const softirq_stats_t*);
+
+#endif // _SOFTIRQ_H
@@ -5,6 +5,8 @@
 
 /*
  * POSIX buffer routines
+ *
+ * memcpy(), memset(), memmove() and memcmp() are in memops.c
  */
 
 void *memccpy(void *, const void *, int, size_t);
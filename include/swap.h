@@ -0,0 +1,45 @@
+#ifndef _SWAP_H
+#define _SWAP_H
+
+#include <types.h>
+
+/*
+ * Swap statistics
+ */
+typedef struct swap_stats_s
+{
+    // Slots (pages)
+    int total;
+    int used;
+    // Transferred pages
+    int pageouts;
+    int pageins;
+    int readahead;
+    int errors;
+} swap_stats_t;
+
+/*
+ * General functions
+ *
+ * swap_init() uses the first block device with a swap
+ * signature ("SWAPSPACE2" at the end of the first page,
+ * e.g. created by mkswap).
+ */
+
+void swap_init() __init;
+const swap_stats_t* swap_get_stats();
+void swap_dump_stats(const swap_stats_t*);
+
+/*
+ * Used by vmem
+ *
+ * swap_in() is called on a page fault and reads the page
+ * (and following ones) back, the fault handler enables irqs
+ * for it if the faulting code had them enabled. swap_free()
+ * releases the slot of a swapped page which is unmapped.
+ */
+
+bool swap_in(uint32_t addr);
+void swap_free(uint32_t slot);
+
+#endif // _SWAP_H
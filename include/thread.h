@@ -12,6 +12,8 @@ enum
     THREAD_PRIO_MIN = 1,
     THREAD_PRIO_DEF = 10,
 
+    THREAD_STACK_SIZE = 4096,
+
     THREAD_STATE_RUNNING = 0,
     THREAD_STATE_SLEEP   = 1,
 };
@@ -89,6 +91,16 @@ typedef struct thread_s
     list_t prio_entry;
     list_t child_entry;
     list_t hash_entry;
+    list_t wait_entry;
+
+    // Timeout of thread_wait()
+    struct timer_s* wait_timer;
+
+    // Kernel stack (vmalloc with guard page)
+    void* stack;
+
+    // Memory accounting
+    struct memgroup_s* memgroup;
 
     char name[256];
     int  pid;
@@ -104,14 +116,41 @@ typedef struct runqueue_s
     int    num_running;
 } runqueue_t;
 
+/*
+ * Wait queue
+ *    - Threads sleep in the queue until
+ *      thread_wakeup() is called
+ */
+typedef struct waitqueue_s
+{
+    list_t list;
+} waitqueue_t;
+
+#define WAITQUEUE_INIT(q) { LIST_INIT((q).list) }
+
 void thread_init() __init;
 void thread_create(func_t, const char* name);
 void thread_sleep(int);
+void thread_exit() __noreturn;
+void thread_wait(waitqueue_t*, int);
+void thread_wakeup(waitqueue_t*);
 void thread_setpriority(int);
 thread_t* thread_by_pid(int);
 void thread_tick();
+void thread_preempt();
 void thread_dump();
 
+/*
+ * FPU, MMX and SSE registers in kernel code
+ *    - The registers of the last thread which used the FPU
+ *      are saved, it gets them back by the next FPU trap
+ *    - Irqs are disabled in between, so the sections must
+ *      be short and can't be nested
+ */
+
+void kernel_fpu_begin(bool* irq_status);
+void kernel_fpu_end(bool irq_status);
+
 extern thread_t* curr_thread;
 
 static inline void critical_enter() { irqs_disable(); }
@@ -13,6 +13,7 @@ typedef struct timer_s
 } timer_t;
 
 void timer_init() __init;
-void timer_add(callback_t, void*, int);
+timer_t* timer_add(callback_t, void*, int);
+void timer_remove(timer_t*);
 
 #endif
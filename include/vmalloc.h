@@ -0,0 +1,49 @@
+#ifndef _VMALLOC_H
+#define _VMALLOC_H
+
+#include <types.h>
+
+/*
+ * Kernel virtual areas
+ *    - Allocated from the vmalloc window above the small-object
+ *      heap of malloc()
+ *    - Free ranges are kept sorted by address and merged with
+ *      their neighbours, allocations take the smallest fitting
+ *      range (best-fit)
+ *    - Guard pages behind an area are never mapped, so overflows
+ *      (and stack overflows of the following area) fault
+ */
+
+#define VMALLOC_START 0xFB400000
+#define VMALLOC_END   0xFF800000
+
+enum
+{
+    VMALLOC_GUARD = 1, // Guard pages of vmalloc()
+};
+
+void vmalloc_init() __init;
+void vmalloc_dump();
+
+/*
+ * Virtual address range without mapping, returns 0 if
+ * there's no space. align must be a power of two.
+ */
+
+uint32_t vmap_area_alloc(size_t size, size_t align, int guard);
+void     vmap_area_free(uint32_t addr);
+
+/*
+ * Virtually contiguous memory (cleared)
+ */
+
+void*  vmalloc(size_t size);
+void   vfree(void*);
+size_t vmalloc_size(const void*);
+
+static inline bool is_vmalloc_addr(const void* p)
+{
+    return ((uint32_t)p >= VMALLOC_START && (uint32_t)p < VMALLOC_END);
+}
+
+#endif // _VMALLOC_H
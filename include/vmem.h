@@ -2,6 +2,7 @@
 #define _VMEM_H
 
 #include <types.h>
+#include <page.h>
 
 /*
  * Initialize memory management
@@ -10,7 +11,10 @@
 void vmem_init() __init;
 
 /*
- * Allocate/free single page of virtual memory
+ * Allocate/free virtual memory
+ *
+ * The range functions walk each page table only once and
+ * flush the TLB at the end instead of once per page.
  */
 
 bool vmem_alloc(uint32_t start, uint32_t end, int flags);
@@ -29,9 +33,57 @@ void vmem_free_page(uint32_t addr);
  *    pmem_reserve(phys_start, phys_start + (end - start));
  */
 
-bool vmem_map(uint32_t start, uint32_t end, uint32_t phys_start, int flags);
+bool vmem_map(uint32_t start, uint32_t end, paddr_t phys_start, int flags);
 void vmem_unmap(uint32_t start, uint32_t end);
-bool vmem_map_page(uint32_t addr, uint32_t page, int flags);
-uint32_t vmem_unmap_page(uint32_t addr);
+bool vmem_map_page(uint32_t addr, paddr_t page, int flags);
+paddr_t vmem_unmap_page(uint32_t addr);
+
+/*
+ * Accessed bit of the page table entry for the reclaim scanner.
+ * The bit is cleared, so the next access sets it again.
+ */
+
+bool vmem_test_and_clear_accessed(uint32_t addr);
+
+// Dirty bit, the pageout detects writes during the I/O with it
+void vmem_clear_dirty(uint32_t addr);
+
+/*
+ * Swap support
+ *
+ * A swapped page has a non-present entry with PAGE_SWAPPED,
+ * the swap slot as address and its other flags unchanged.
+ * The entry still counts as used in the page table.
+ * While the slot is read the entry has PAGE_LOCKED.
+ *
+ * vmem_get_page() returns the mapped page (BAD_PAGE if it's
+ * not present) and the entry flags, vmem_get_swap() the
+ * slot and the flags of a swapped entry.
+ */
+
+paddr_t vmem_get_page(uint32_t addr, int* flags);
+bool vmem_get_swap(uint32_t addr, uint32_t* slot, int* flags);
+void vmem_lock_swap(uint32_t addr, bool lock);
+void vmem_swap_out(uint32_t addr, uint32_t slot);
+void vmem_swap_in(uint32_t addr, paddr_t page);
+
+/*
+ * Same-page merging
+ *
+ * vmem_merge_page() maps a merged page (PMEM_KSM) read-only
+ * with PAGE_KSM instead of the current writable anonymous page.
+ * A write fault gives the address a private copy again.
+ */
+
+void vmem_merge_page(uint32_t addr, paddr_t page);
+
+/*
+ * Temporary kernel mappings of physical pages. The window is small,
+ * so every vmem_kmap() must be followed by vmem_kunmap() soon.
+ * This is the only way to access pages above 4G.
+ */
+
+void* vmem_kmap(paddr_t page);
+void  vmem_kunmap(void*);
 
 #endif // _VMEM_H
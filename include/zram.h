@@ -0,0 +1,46 @@
+#ifndef _ZRAM_H
+#define _ZRAM_H
+
+#include <types.h>
+#include <blkdev.h>
+
+/*
+ * Compressed RAM disk statistics
+ */
+typedef struct zram_stats_s
+{
+    // Stored pages
+    int pages;
+    int same;      // Same-filled (no memory used)
+    int huge;      // Incompressible (stored uncompressed)
+    uint32_t compr_size; // Bytes of compressed data
+    // Requests
+    int reads;
+    int writes;
+    int errors;
+    // Cycles spent in (de)compression (0 without TSC)
+    uint64_t compr_cycles;
+    uint64_t decompr_cycles;
+    int      compressed;
+    int      decompressed;
+} zram_stats_t;
+
+/*
+ * Compressed RAM disks
+ *    - Pages are compressed by LZ4 and stored by zsmalloc,
+ *      memory is only used for written pages
+ *    - Pages consisting of a repeated 32 bit value are
+ *      only stored as the value
+ *
+ * zram_init() creates zram0 with half of the physical memory
+ * and writes a swap signature, so it's used as swap if there
+ * is no other swap device.
+ */
+
+void zram_init() __init;
+blkdev_t* zram_create(const char* name, int pages);
+void zram_reset(blkdev_t*);
+const zram_stats_t* zram_get_stats(blkdev_t*);
+void zram_dump_stats(const zram_stats_t*);
+
+#endif // _ZRAM_H
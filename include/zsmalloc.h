@@ -0,0 +1,48 @@
+#ifndef _ZSMALLOC_H
+#define _ZSMALLOC_H
+
+#include <types.h>
+#include <page.h>
+
+/*
+ * Allocator for compressed pages
+ *    - Objects of up to a page are packed into physical pages
+ *      by size classes (multiples of 32 bytes)
+ *    - The pages aren't mapped, objects are accessed by
+ *      temporary kernel mappings (zs_map)
+ *    - Handles are the physical addresses of the objects
+ *      divided by 32 (0 is no handle)
+ */
+
+enum
+{
+    ZS_ALIGN_SHIFT = 5,
+    ZS_ALIGN       = 1 << ZS_ALIGN_SHIFT,
+    ZS_MAX_SIZE    = PAGE_SIZE,
+};
+
+/*
+ * Allocator statistics
+ */
+typedef struct zs_stats_s
+{
+    int pages;   // Physical pages used
+    int objects; // Allocated objects
+    int size;    // Allocated bytes (with padding to the class size)
+} zs_stats_t;
+
+void zs_init() __init;
+const zs_stats_t* zs_get_stats();
+
+uint32_t zs_malloc(size_t size);
+void     zs_free(uint32_t handle);
+
+/*
+ * Access the object. Only a few objects can be mapped
+ * at the same time (see vmem_kmap).
+ */
+
+void* zs_map(uint32_t handle);
+void  zs_unmap(void*);
+
+#endif // _ZSMALLOC_H
@@ -0,0 +1,49 @@
+/*
+ * Alternative instructions
+ */
+#include <alternative.h>
+#include <section.h>
+#include <string.h>
+#include <stdio.h>
+#include <debug.h>
+#include <cpu.h>
+
+enum
+{
+    OP_NOP   = 0x90,
+    OP_CALL  = 0xE8, // call rel32
+    OP_JMP   = 0xE9, // jmp rel32
+};
+
+void __init alternatives_apply()
+{
+    const alt_instr_t* alt = (const alt_instr_t*)ALTINSTR_START;
+    const alt_instr_t* end = (const alt_instr_t*)(ALTINSTR_START + ALTINSTR_SIZE);
+    const cpu_info_t* cpu = cpu_get_info();
+    uint8_t* p;
+    int applied = 0;
+
+    for (; alt < end; ++alt)
+    {
+        if (alt->repl_len > alt->orig_len)
+            panic("Alternative at 0x%08X too long", alt->orig);
+
+        if (!cpu_has_feature(cpu, alt->feature))
+            continue;
+
+        // Paging is off, the kernel is writable by segmentation
+        p = (uint8_t*)alt->orig;
+        memcpy(p, (const void*)alt->repl, alt->repl_len);
+
+        // Relative target moves with the instruction
+        if (alt->repl_len == 5 && (p[0] == OP_CALL || p[0] == OP_JMP))
+            *(uint32_t*)(p + 1) += alt->repl - alt->orig;
+
+        memset(p + alt->repl_len, OP_NOP, alt->orig_len - alt->repl_len);
+        ++applied;
+    }
+
+    // The patched code is far away from the prefetch queue,
+    // so there's no need to serialize
+    printf("Alternatives: %d of %d applied\n", applied, end - (const alt_instr_t*)ALTINSTR_START);
+}
@@ -0,0 +1,263 @@
+/*
+ * ATA driver (PIO, LBA28, polling)
+ */
+#include <ata.h>
+#include <blkdev.h>
+#include <io.h>
+#include <asm.h>
+#include <thread.h>
+#include <string.h>
+#include <stdio.h>
+
+enum
+{
+    // Primary controller ports
+    ATA_BASE        = 0x1F0,
+    ATA_CTRL        = 0x3F6,
+
+    // Register offsets
+    ATA_DATA        = 0,
+    ATA_ERROR       = 1,
+    ATA_SECCOUNT    = 2,
+    ATA_LBA0        = 3,
+    ATA_LBA1        = 4,
+    ATA_LBA2        = 5,
+    ATA_DRIVE       = 6,
+    ATA_STATUS      = 7,
+    ATA_COMMAND     = 7,
+
+    // Status bits
+    ATA_STATUS_ERR  = 0x01,
+    ATA_STATUS_DRQ  = 0x08,
+    ATA_STATUS_DF   = 0x20,
+    ATA_STATUS_DRDY = 0x40,
+    ATA_STATUS_BSY  = 0x80,
+
+    // Control bits
+    ATA_CTRL_NIEN   = 0x02, // No interrupts
+
+    // Commands
+    ATA_CMD_READ     = 0x20,
+    ATA_CMD_WRITE    = 0x30,
+    ATA_CMD_FLUSH    = 0xE7,
+    ATA_CMD_IDENTIFY = 0xEC,
+
+    // Max. sectors per command
+    ATA_MAX_SECTORS = 256,
+
+    // Status polls before a timeout
+    ATA_TIMEOUT     = 1000000,
+};
+
+typedef struct ata_drive_s
+{
+    blkdev_t dev;
+    int      slave;
+} ata_drive_t;
+
+static ata_drive_t drives[2];
+
+// Both drives share the channel, one transfer at a time
+static bool channel_busy = false;
+static waitqueue_t channel_wait = WAITQUEUE_INIT(channel_wait);
+
+static bool ata_read(blkdev_t*, uint32_t, int, void*);
+static bool ata_write(blkdev_t*, uint32_t, int, const void*);
+
+// Wait until the drive isn't busy and all bits of mask are set
+static bool ata_wait(uint8_t mask)
+{
+    uint8_t status;
+    int i;
+
+    for (i = 0; i < ATA_TIMEOUT; ++i)
+    {
+        status = inb(ATA_BASE + ATA_STATUS);
+        if (status & ATA_STATUS_BSY)
+            continue;
+        if (status & (ATA_STATUS_ERR | ATA_STATUS_DF))
+            return false;
+        if ((status & mask) == mask)
+            return true;
+    }
+    return false;
+}
+
+// Wait until the drive isn't busy (errors of the last command are ignored)
+static bool ata_idle()
+{
+    int i;
+    for (i = 0; i < ATA_TIMEOUT; ++i)
+    {
+        if (~inb(ATA_BASE + ATA_STATUS) & ATA_STATUS_BSY)
+            return true;
+    }
+    return false;
+}
+
+// Select drive and wait 400ns for the status
+static void ata_select(int slave, uint32_t lba)
+{
+    outb(ATA_BASE + ATA_DRIVE, 0xE0 | (slave << 4) | ((lba >> 24) & 0x0F));
+    inb(ATA_CTRL);
+    inb(ATA_CTRL);
+    inb(ATA_CTRL);
+    inb(ATA_CTRL);
+}
+
+static bool ata_command(int slave, uint8_t cmd, uint32_t lba, int count)
+{
+    if (!ata_idle())
+        return false;
+    ata_select(slave, lba);
+    outb(ATA_BASE + ATA_SECCOUNT, count & 0xFF); // 0 means 256
+    outb(ATA_BASE + ATA_LBA0, lba);
+    outb(ATA_BASE + ATA_LBA1, lba >> 8);
+    outb(ATA_BASE + ATA_LBA2, lba >> 16);
+    outb(ATA_BASE + ATA_COMMAND, cmd);
+    return true;
+}
+
+static bool __init ata_identify(ata_drive_t* drive)
+{
+    uint16_t id[256];
+
+    ata_select(drive->slave, 0);
+    outb(ATA_BASE + ATA_SECCOUNT, 0);
+    outb(ATA_BASE + ATA_LBA0, 0);
+    outb(ATA_BASE + ATA_LBA1, 0);
+    outb(ATA_BASE + ATA_LBA2, 0);
+    outb(ATA_BASE + ATA_COMMAND, ATA_CMD_IDENTIFY);
+
+    // No drive or ATAPI device
+    if (inb(ATA_BASE + ATA_STATUS) == 0 ||
+        inb(ATA_BASE + ATA_LBA1) != 0 || inb(ATA_BASE + ATA_LBA2) != 0)
+        return false;
+    if (!ata_wait(ATA_STATUS_DRQ))
+        return false;
+
+    insw(ATA_BASE + ATA_DATA, id, 256);
+
+    // LBA28 sector count
+    drive->dev.sectors = id[60] | ((uint32_t)id[61] << 16);
+    return (drive->dev.sectors > 0);
+}
+
+void __init ata_init()
+{
+    int i;
+
+    // Floating bus, no controller
+    if (inb(ATA_BASE + ATA_STATUS) == 0xFF)
+        return;
+
+    // Polling only
+    outb(ATA_CTRL, ATA_CTRL_NIEN);
+
+    for (i = 0; i < 2; ++i)
+    {
+        drives[i].slave = i;
+        if (!ata_identify(drives + i))
+            continue;
+
+        strcpy(drives[i].dev.name, i ? "hdb" : "hda");
+        drives[i].dev.read  = ata_read;
+        drives[i].dev.write = ata_write;
+        drives[i].dev.data  = drives + i;
+        blkdev_register(&drives[i].dev);
+    }
+}
+
+/*
+ * Sleeping lock of the channel. Transfers run with irqs enabled
+ * (swap), so a preempted transfer must not be interleaved with
+ * the command and data phases of another one.
+ */
+static void channel_lock()
+{
+    bool irq_status;
+
+    irqs_save(&irq_status);
+    while (channel_busy)
+        thread_wait(&channel_wait, 0);
+    channel_busy = true;
+    irqs_restore(irq_status);
+}
+
+static void channel_unlock()
+{
+    bool irq_status;
+
+    irqs_save(&irq_status);
+    channel_busy = false;
+    thread_wakeup(&channel_wait);
+    irqs_restore(irq_status);
+}
+
+static bool pio_read(ata_drive_t* drive, uint32_t sector, int count, void* buf)
+{
+    char* p = (char*)buf;
+    int n;
+
+    while (count > 0)
+    {
+        n = (count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS);
+        if (!ata_command(drive->slave, ATA_CMD_READ, sector, n))
+            return false;
+
+        sector += n;
+        count -= n;
+        for (; n > 0; --n, p += BLKDEV_SECTOR_SIZE)
+        {
+            if (!ata_wait(ATA_STATUS_DRQ))
+                return false;
+            insw(ATA_BASE + ATA_DATA, p, BLKDEV_SECTOR_SIZE / 2);
+        }
+    }
+    return true;
+}
+
+static bool pio_write(ata_drive_t* drive, uint32_t sector, int count, const void* buf)
+{
+    const char* p = (const char*)buf;
+    int n;
+
+    while (count > 0)
+    {
+        n = (count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS);
+        if (!ata_command(drive->slave, ATA_CMD_WRITE, sector, n))
+            return false;
+
+        sector += n;
+        count -= n;
+        for (; n > 0; --n, p += BLKDEV_SECTOR_SIZE)
+        {
+            if (!ata_wait(ATA_STATUS_DRQ))
+                return false;
+            outsw(ATA_BASE + ATA_DATA, p, BLKDEV_SECTOR_SIZE / 2);
+        }
+    }
+
+    // Write cache
+    return (ata_command(drive->slave, ATA_CMD_FLUSH, 0, 0) && ata_wait(0));
+}
+
+static bool ata_read(blkdev_t* dev, uint32_t sector, int count, void* buf)
+{
+    bool ok;
+
+    channel_lock();
+    ok = pio_read((ata_drive_t*)dev->data, sector, count, buf);
+    channel_unlock();
+    return ok;
+}
+
+static bool ata_write(blkdev_t* dev, uint32_t sector, int count, const void* buf)
+{
+    bool ok;
+
+    channel_lock();
+    ok = pio_write((ata_drive_t*)dev->data, sector, count, buf);
+    channel_unlock();
+    return ok;
+}
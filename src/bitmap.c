@@ -53,18 +53,8 @@ int bitmap_find1(const ulong* map, int bits)
     if (p == end)
         return -1;
 
-    for (n = 0; n < BITS_PER_LONG; ++n)
-    {
-        if (*p & (1 << n))
-        {
-            n += (p - map) * BITS_PER_LONG;
-            if (n >= bits)
-                return -1;
-            return n;
-        }
-    }
-            
-    return -1;
+    n = (p - map) * BITS_PER_LONG + bitmap_ffs(*p);
+    return (n < bits ? n : -1);
 }
 
 int bitmap_find0(const ulong* map, int bits)
@@ -76,21 +66,11 @@ int bitmap_find0(const ulong* map, int bits)
     while (p < end && *p == 0xFFFFFFFF)
         ++p;
     
-    if (p < end)
+    if (p == end)
         return -1;
 
-    for (n = 0; n < BITS_PER_LONG; ++n)
-    {
-        if (~*p & (1 << n))
-        {
-            n += (p - map) * BITS_PER_LONG;
-            if (n >= bits)
-                return -1;
-            return n;
-        }
-    }
-            
-    return -1;
+    n = (p - map) * BITS_PER_LONG + bitmap_ffs(~*p);
+    return (n < bits ? n : -1);
 }
 
 bool bitmap_range1(const ulong* map, int first, int count)
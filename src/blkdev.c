@@ -0,0 +1,35 @@
+#include <blkdev.h>
+#include <string.h>
+#include <stdio.h>
+
+// Registered devices
+static blkdev_t* devices[BLKDEV_MAX];
+static int num_devices = 0;
+
+void blkdev_register(blkdev_t* dev)
+{
+    if (num_devices == BLKDEV_MAX)
+    {
+        printf("Too many block devices, %s ignored\n", dev->name);
+        return;
+    }
+    devices[num_devices++] = dev;
+    printf(" %s: %dK\n", dev->name, dev->sectors / (1024 / BLKDEV_SECTOR_SIZE));
+}
+
+// Get device by number (NULL if there's none)
+blkdev_t* blkdev_get(int i)
+{
+    return (i < num_devices ? devices[i] : NULL);
+}
+
+blkdev_t* blkdev_find(const char* name)
+{
+    int i;
+    for (i = 0; i < num_devices; ++i)
+    {
+        if (!strcmp(devices[i]->name, name))
+            return devices[i];
+    }
+    return NULL;
+}
@@ -10,15 +10,29 @@
 
 #define VGA_ADDR (VGA_PHYS + 0xC0000000)
 
+/*
+ * Text memory
+ *    - Every console is kept in a cacheable shadow buffer
+ *      (region of REGION_LINES), the screen scrolls by moving
+ *      through the region and is copied back only at its end
+ *    - Changed lines are marked dirty and copied to the frame
+ *      buffer by con_flush(), only for the visible console
+ *    - The frame buffer holds the region of the visible console,
+ *      so scrolling just moves the CRTC start address
+ *    - con_flush_thread() flushes every FLUSH_INTERVAL ticks,
+ *      until it runs (and after con_sync()) con_write() flushes
+ */
 enum
 {
-    VGA_PHYS      = 0xB8000,
-    VGA_SIZE      = 0x8000,
-    VGA_CRTC      = 0x3D4,
-    SCREEN_WIDTH  = 80,
-    SCREEN_HEIGHT = 25,
-    SCREEN_SIZE   = SCREEN_WIDTH * SCREEN_HEIGHT,
-    NUM_CONSOLES  = 8,
+    VGA_PHYS       = 0xB8000,
+    VGA_SIZE       = 0x8000,
+    VGA_CRTC       = 0x3D4,
+    SCREEN_WIDTH   = 80,
+    SCREEN_HEIGHT  = 25,
+    SCREEN_SIZE    = SCREEN_WIDTH * SCREEN_HEIGHT,
+    REGION_LINES   = 4 * SCREEN_HEIGHT,
+    REGION_SIZE    = REGION_LINES * SCREEN_WIDTH,
+    FLUSH_INTERVAL = 20,
 
     // Options
     MAX_PARAMS     = 4,
@@ -54,8 +68,13 @@ typedef struct cursor_s
 // Virtual console structure
 typedef struct con_s
 {
-    // Start address in the frame buffer
+    // Start address of the region and the screen in the shadow buffer
+    char*    base;
     char*    addr;
+    int      top;  // First screen line in the region
+
+    // Lines of the region not yet in the frame buffer
+    int      dirty_start, dirty_end;
 
     // Cursors
     cursor_t cur;
@@ -68,10 +87,13 @@ typedef struct con_s
     int      param[MAX_PARAMS];
 } con_t;
 
-static con_t console[8] =
+static uint16_t shadow[NUM_CONSOLES][REGION_SIZE];
+
+static con_t console[NUM_CONSOLES] =
 {
     {
-        .addr  = (char*)VGA_ADDR,
+        .base  = (char*)shadow[0],
+        .addr  = (char*)shadow[0],
         .cur   = { 0, 0, DEFAULT_ATTR },
         .state = STATE_NORMAL,
     },
@@ -80,6 +102,14 @@ static con_t console[8] =
 static int num_consoles = 1;
 static int curr_vc = 0;
 
+static con_sink_t sink[NUM_CONSOLES];
+
+// Flushed by con_flush_thread()
+static bool flush_deferred = false;
+
+// Programmed CRTC registers
+static int vga_origin = 0, vga_cursor = -1;
+
 static void normal(con_t* c, int ch);
 static void escape(con_t* c, int ch);
 static void csi(con_t* c, int ch);
@@ -87,8 +117,8 @@ static void csi_J(con_t* c);
 static void csi_K(con_t* c);
 static void csi_m(con_t* c);
 
-static void set_cursor(con_t* c);
-static void set_origin(con_t* c);
+static void set_crtc(int reg, int offset);
+static void mark_dirty(con_t* c, int, int);
 static void save_cursor(con_t* c);
 static void restore_cursor(con_t* c);
 static void line_feed(con_t* c);
@@ -115,79 +145,190 @@ void __init con_init()
     int i;
 
     // Map complete vga memory
-    vmem_map(VGA_ADDR, VGA_ADDR + VGA_SIZE, VGA_PHYS, PAGE_RW);
+    vmem_map(VGA_ADDR, VGA_ADDR + VGA_SIZE, VGA_PHYS, PAGE_RW | PAGE_NX);
 
     // Initialize consoles
     num_consoles = NUM_CONSOLES;
     for (i = 1; i < num_consoles; ++i)
     {
-        console[i].addr     = (char*)VGA_ADDR + i * 2 * SCREEN_SIZE;
+        console[i].base     = (char*)shadow[i];
+        console[i].addr     = console[i].base;
         console[i].cur.attr = min(i, COLOR_WHITE);
         console[i].state    = STATE_NORMAL;
     }
 }
 
-// This function should interpret most ansi-escape-sequences
-int con_putchar(int vc, int ch)
+// Plain text run at the cursor, returns the number of characters written
+static size_t text_run(con_t* c, const char* buf, size_t len)
+{
+    uint16_t* p = (uint16_t*)c->addr + c->cur.y * SCREEN_WIDTH + c->cur.x;
+    uint16_t attr = c->cur.attr << 8;
+    size_t n = 0;
+
+    // Until the end of the line
+    len = min(len, SCREEN_WIDTH - c->cur.x);
+    while (n < len && (uchar)buf[n] >= ' ' && buf[n] != 127)
+    {
+        e9_putchar(buf[n]);
+        *p++ = attr | (uchar)buf[n++];
+    }
+
+    mark_dirty(c, c->cur.y * SCREEN_WIDTH + c->cur.x, c->cur.y * SCREEN_WIDTH + c->cur.x + n);
+    c->cur.x += n;
+    // Auto wrap
+    if (c->cur.x == SCREEN_WIDTH)
+        line_feed(c);
+
+    return n;
+}
+
+/*
+ * Write characters to the console
+ *    - This function should interpret most ansi-escape-sequences
+ *    - Plain text is written in runs, irqs are disabled once
+ *      per call
+ */
+size_t con_write(int vc, const char* buf, size_t len)
 {
     con_t* c = console + clamp(vc, 0, num_consoles - 1);
-    int oldx = c->cur.x, oldy = c->cur.y;
+    const char *p = buf, *end = buf + len;
     bool irq_status;
 
-    switch (c->state)
+    irqs_save(&irq_status);
+
+    while (p < end)
     {
-    case STATE_NORMAL:
-        e9_putchar(ch);
-        normal(c, ch);
-        break;
+        switch (c->state)
+        {
+        case STATE_NORMAL:
+            if ((uchar)*p >= ' ' && *p != 127)
+            {
+                p += text_run(c, p, end - p);
+                continue;
+            }
+            e9_putchar(*p);
+            normal(c, *p);
+            break;
 
-    case STATE_ESCAPE:
-        irqs_save(&irq_status);
-	escape(c, ch);
-        irqs_restore(irq_status);
-	break;
+        case STATE_ESCAPE:
+            escape(c, *p);
+            break;
 
-    case STATE_CSI:
-	irqs_save(&irq_status);
-        csi(c, ch);
-        irqs_restore(irq_status);
-	break;
+        case STATE_CSI:
+            csi(c, *p);
+            break;
 
-    default: break;
+        default: break;
+        }
+        ++p;
     }
 
-    if (vc == curr_vc && (oldx != c->cur.x || oldy != c->cur.y))
-    {
-        irqs_save(&irq_status);
-        set_cursor(c);
-	irqs_restore(irq_status);
-    }
+    irqs_restore(irq_status);
+
+    if (sink[c - console])
+        sink[c - console](buf, len);
+
+    if (!flush_deferred)
+        con_flush();
+
+    return len;
+}
 
+void con_set_sink(int vc, con_sink_t func)
+{
+    sink[clamp(vc, 0, NUM_CONSOLES - 1)] = func;
+}
+
+int con_putchar(int vc, int ch)
+{
+    char c = ch;
+    con_write(vc, &c, 1);
     return ch;
 }
 
 // Set virtual console
 void con_setvc(int vc)
 {
+    bool irq_status;
+    con_t* c;
+
+    irqs_save(&irq_status);
     curr_vc = clamp(vc, 0, num_consoles - 1);
+    c = console + curr_vc;
+
+    // The frame buffer holds the region of another console
+    c->dirty_start = 0;
+    c->dirty_end   = REGION_LINES;
+    irqs_restore(irq_status);
+
+    if (!flush_deferred)
+        con_flush();
+}
+
+/*
+ * Copy the dirty lines of the visible console to the
+ * frame buffer, irqs are enabled between the lines
+ */
+void con_flush()
+{
+    uint16_t* vga = (uint16_t*)VGA_ADDR;
     bool irq_status;
+    int line, origin;
+    con_t* c;
+
     irqs_save(&irq_status);
-    set_origin(console + curr_vc);
+
+    for (;;)
+    {
+        // Console may change between the lines
+        c = console + curr_vc;
+        if (c->dirty_start >= c->dirty_end)
+            break;
+
+        line = c->dirty_start++;
+        memcpy(vga + line * SCREEN_WIDTH, c->base + 2 * line * SCREEN_WIDTH, 2 * SCREEN_WIDTH);
+
+        irqs_restore(irq_status);
+        irqs_save(&irq_status);
+    }
+
+    origin = c->top * SCREEN_WIDTH;
+    if (origin != vga_origin)
+        set_crtc(12, vga_origin = origin);
+    if (origin + c->cur.y * SCREEN_WIDTH + c->cur.x != vga_cursor)
+        set_crtc(14, vga_cursor = origin + c->cur.y * SCREEN_WIDTH + c->cur.x);
+
     irqs_restore(irq_status);
 }
 
+// Flush and write through from now on (panic)
+void con_sync()
+{
+    flush_deferred = false;
+    con_flush();
+}
+
+// Flush the visible console at a capped rate
+void __noreturn con_flush_thread()
+{
+    thread_setpriority(THREAD_PRIO_MIN);
+    flush_deferred = true;
+    for (;;)
+    {
+        con_flush();
+        thread_sleep(FLUSH_INTERVAL);
+    }
+}
+
 // Get virtual console
 int con_getvc()
 {
     return curr_vc;
 }
 
-// Normal state
+// Normal state (control characters)
 static void normal(con_t* c, int ch)
 {
-    char* p;
-    bool irq_status;
-
     switch (ch)
     {
     // FIXME: Depends on erase character of tty
@@ -197,9 +338,7 @@ static void normal(con_t* c, int ch)
 	{
             int end = c->cur.y * SCREEN_WIDTH + c->cur.x;
 	    --c->cur.x;
-	    irqs_save(&irq_status);
 	    erase(c, end - 1, end);
-	    irqs_restore(irq_status);
 	}
 	break;
 
@@ -208,9 +347,7 @@ static void normal(con_t* c, int ch)
         break;
 
     case '\n':
-	irqs_save(&irq_status);
 	line_feed(c);
-	irqs_restore(irq_status);
         break;
 
     case '\r':
@@ -222,15 +359,6 @@ static void normal(con_t* c, int ch)
         break;
 
     default:
-	irqs_save(&irq_status);
-	p = c->addr + ((c->cur.y * SCREEN_WIDTH + c->cur.x) << 1);
-        *p = ch;
-        *(p + 1) = c->cur.attr;
-	++c->cur.x;
-        // Auto wrap
-        if (c->cur.x == SCREEN_WIDTH)
-            line_feed(c);
-	irqs_restore(irq_status);
         break;
     }
 }
@@ -544,24 +672,33 @@ static void csi_m(con_t* c)
     }
 }
 
-static void set_cursor(con_t* c)
+// Start address (12) or cursor location (14)
+static void set_crtc(int reg, int offset)
 {
-    int offset = c->cur.y * SCREEN_WIDTH + c->cur.x +
-                 ((int)(c->addr - VGA_ADDR) >> 1);
-    outb(VGA_CRTC, 14);
+    outb(VGA_CRTC, reg);
     outb(VGA_CRTC + 1, offset >> 8);
-    outb(VGA_CRTC, 15);
+    outb(VGA_CRTC, reg + 1);
     outb(VGA_CRTC + 1, offset);
 }
 
-static void set_origin(con_t* c)
+// Screen cells changed
+static void mark_dirty(con_t* c, int start, int end)
 {
-    int offset = (int)(c->addr - VGA_ADDR) >> 1;
-    outb(VGA_CRTC, 12);
-    outb(VGA_CRTC + 1, offset >> 8);
-    outb(VGA_CRTC, 13);
-    outb(VGA_CRTC + 1, offset);
-    set_cursor(c);
+    start = c->top + start / SCREEN_WIDTH;
+    end   = min(c->top + (end + SCREEN_WIDTH - 1) / SCREEN_WIDTH, REGION_LINES);
+    if (start >= end)
+        return;
+
+    if (c->dirty_start >= c->dirty_end)
+    {
+        c->dirty_start = start;
+        c->dirty_end   = end;
+    }
+    else
+    {
+        c->dirty_start = min(c->dirty_start, start);
+        c->dirty_end   = max(c->dirty_end, end);
+    }
 }
 
 static void save_cursor(con_t* c)
@@ -588,6 +725,7 @@ static void erase(con_t* c, int start, int end)
 {
     char* p = c->addr + (start << 1);
     char* q = c->addr + (end << 1);
+    mark_dirty(c, start, end);
     while (p < q)
     {
         *p++ = ' ';
@@ -599,6 +737,7 @@ static void insert(con_t* c, int start, int end)
 {
     memmove(c->addr + (end << 1), c->addr + (start << 1),
             (end - start) << 1);
+    mark_dirty(c, end, 2 * end - start);
     erase(c, start, end);
 }
 
@@ -607,18 +746,41 @@ static void delete(con_t* c, int start, int end)
     int size = SCREEN_SIZE - end;
     memmove(c->addr + (start << 1), c->addr + (end << 1),
             size << 1);
+    mark_dirty(c, start, SCREEN_SIZE);
     size = end - start;
     erase(c, SCREEN_SIZE - size, SCREEN_SIZE);
 }
 
+// Move the screen in the region by lines
+static void move_screen(con_t* c, int top)
+{
+    c->top  = top;
+    c->addr = c->base + 2 * SCREEN_WIDTH * top;
+}
+
 static void scroll_up(con_t* c)
 {
-    delete(c, 0, SCREEN_WIDTH);
+    if (c->top + SCREEN_HEIGHT < REGION_LINES)
+        move_screen(c, c->top + 1);
+    else
+    {
+        // End of the region, copy the screen back to the start
+        memmove(c->base, c->addr + 2 * SCREEN_WIDTH, 2 * (SCREEN_SIZE - SCREEN_WIDTH));
+        move_screen(c, 0);
+        mark_dirty(c, 0, SCREEN_SIZE);
+    }
+    erase(c, SCREEN_SIZE - SCREEN_WIDTH, SCREEN_SIZE);
     --c->cur.y;
 }
 
 static void scroll_down(con_t* c)
 {
-    insert(c, 0, SCREEN_WIDTH);
+    if (c->top > 0)
+    {
+        move_screen(c, c->top - 1);
+        erase(c, 0, SCREEN_WIDTH);
+    }
+    else
+        insert(c, 0, SCREEN_WIDTH);
     ++c->cur.y;
 }
@@ -270,7 +270,7 @@ static const char* feature_str[] =
     NULL,  "DS",  "ACPI",     "MMX",     "FXSR",     "SSE",  "SSE2", "SS",    "HTT", "TM",  
     NULL,  "PBE", NULL,       NULL,      NULL,       NULL,   NULL,   NULL,    NULL,  NULL,
     NULL,  NULL,  NULL,       "SYSCALL", NULL,       NULL,   NULL,   NULL,    NULL,  NULL,
-    NULL,  NULL,  NULL,       NULL,      "MMXEXT",   NULL,   NULL,   NULL,    NULL,  NULL,
+    NULL,  NULL,  "NX",       NULL,      "MMXEXT",   NULL,   NULL,   NULL,    NULL,  NULL,
     NULL,  "LM",  "3DNOWEXT", "3DNOW",   "RECOVERY", "LR",   NULL,   "LRTI",
 };
 
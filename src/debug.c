@@ -1,6 +1,8 @@
 #include <debug.h>
 #include <math.h>
 #include <stdio.h>
+#include <console.h>
+#include <serial.h>
 #include <ctype.h>
 #include <asm.h>
 #include <ansicode.h>
@@ -11,6 +13,9 @@ void __printf_noreturn(1, 2) panic(const char *format, ...)
     va_list argptr;
 
     irqs_disable();
+    serial_sync();
+    klog_sync();
+    con_sync();
 
     va_start(argptr, format);
     vsnprintf(buffer, sizeof (buffer), format, argptr);
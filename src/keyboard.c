@@ -7,10 +7,19 @@
 #include <regs.h>
 #include <keymap.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <console.h>
+#include <ringbuf.h>
+#include <thread.h>
+#include <softirq.h>
+#include <klog.h>
 
 enum
 {
     MAX_WAIT_TRIES  = 32,
+    SCANCODE_RING   = 256,
+    INPUT_RING      = 256,
     /*
     // Keys codes
     KEY_CAPS_LOCK   = 0x3A,
@@ -43,6 +52,27 @@ enum
 
 static int shift_state = 0;
 
+// Raw scancodes of the irq handler
+static ringbuf_t scancodes;
+static char scancode_data[SCANCODE_RING];
+static waitqueue_t scancode_wait = WAITQUEUE_INIT(scancode_wait);
+static int scancodes_dropped = 0;
+
+// Wakes kbd_thread() after the irq
+static void scancodes_ready(void*);
+static tasklet_t scancode_tasklet = TASKLET_INIT(scancodes_ready, NULL);
+
+// Input queue of a console
+typedef struct input_s
+{
+    ringbuf_t   ring;
+    char        data[INPUT_RING];
+    waitqueue_t wait;
+} input_t;
+
+static input_t input[NUM_CONSOLES];
+static int input_dropped = 0;
+
 void irq_keyboard();
 static void kbd_setleds();
 static void kbd_wait();
@@ -88,6 +118,15 @@ static key_t key_handler[16] =
 
 void __init kbd_init()
 {
+    int i;
+
+    ringbuf_setup(&scancodes, scancode_data, SCANCODE_RING);
+    for (i = 0; i < NUM_CONSOLES; ++i)
+    {
+        ringbuf_setup(&input[i].ring, input[i].data, INPUT_RING);
+        list_init(&input[i].wait.list);
+    }
+
     idt_set(PIC_INTBASE + IRQ_KEYBOARD, irq_keyboard, DESC_TYPE_INT | DESC_PRESENT);
     pic_irq_enable(IRQ_KEYBOARD);
 
@@ -116,48 +155,111 @@ void kbd_reboot()
     force_reboot();
 }
 
-// Keyboard handler
+// Keyboard handler, only queues the scancodes for kbd_thread()
 void do_irq_keyboard(const regs_t regs)
 {
+    uchar key;
+
     pic_irq_end(IRQ_KEYBOARD);
     while (inb(0x64) & 1)
     {
-        ushort* map;
-        int key, sym;
-        
         key = inb(0x60);
-        
-        // TODO: "Gray" key
-        if (key == 0xE0 || key == 0xE1)
-            continue;
-  
-        // Index in the key map
-        /*
-        if ((key_status & CAPS_LOCK) && !(key_status & SHIFT) || (key_status & SHIFT))
-            i |= 1;
-        if (key_status & LEFT_ALT)
-            i |= 2;
-        if (key_status & CTRL)
-            i |= 4;        
-        if (key_status & RIGHT_ALT)
-            i |= 4;
-        */
-             
-        if (shift_state >= keymap_count)
-            continue;
-        map = key_maps[shift_state];
-        if (!map)
-            continue;
-            
-        sym = map[key & 0x7F] & 0xFFF;
+        if (!ringbuf_write(&scancodes, &key, 1))
+            ++scancodes_dropped;
+    }
+    tasklet_schedule(&scancode_tasklet);
+}
+
+static void scancodes_ready(void* arg)
+{
+    thread_wakeup(&scancode_wait);
+}
+
+// Translate a scancode and call the key handler
+static void translate(uchar key)
+{
+    ushort* map;
+    int sym;
+
+    // TODO: "Gray" key
+    if (key == 0xE0 || key == 0xE1)
+        return;
+
+    // Index in the key map
+    /*
+    if ((key_status & CAPS_LOCK) && !(key_status & SHIFT) || (key_status & SHIFT))
+        i |= 1;
+    if (key_status & LEFT_ALT)
+        i |= 2;
+    if (key_status & CTRL)
+        i |= 4;        
+    if (key_status & RIGHT_ALT)
+        i |= 4;
+    */
+
+    if (shift_state >= keymap_count)
+        return;
+    map = key_maps[shift_state];
+    if (!map)
+        return;
 
-	con_printf(6, "KEY: handler=%d key=%d (%c)\n", sym >> 8, sym & 0xFF, sym & 0xFF);
-	
-        if (key_handler[sym >> 8])
-            (key_handler[sym >> 8])(sym & 0xFF, key & 0x80);
+    sym = map[key & 0x7F] & 0xFFF;
+
+    KLOG(KLOG_CAT_DEV, KLOG_DEBUG, "KEY: handler=%d key=%d (%c)\n", sym >> 8, sym & 0xFF, sym & 0xFF);
+
+    if (key_handler[sym >> 8])
+        (key_handler[sym >> 8])(sym & 0xFF, key & 0x80);
+}
+
+// Bottom half of the keyboard irq
+void __noreturn kbd_thread()
+{
+    bool irq_status;
+    uchar key;
+
+    thread_setpriority(THREAD_PRIO_MAX);
+    for (;;)
+    {
+        irqs_save(&irq_status);
+        while (!ringbuf_used(&scancodes))
+            thread_wait(&scancode_wait, 0);
+        irqs_restore(irq_status);
+
+        while (ringbuf_read(&scancodes, &key, 1))
+            translate(key);
     }
 }
 
+// Queue input for the visible console and echo it,
+// the whole key is dropped if the queue is full
+static void emit(const char* buf, size_t len)
+{
+    int vc = con_getvc();
+
+    if (ringbuf_space(&input[vc].ring) < len)
+    {
+        ++input_dropped;
+        return;
+    }
+
+    ringbuf_write(&input[vc].ring, buf, len);
+    thread_wakeup(&input[vc].wait);
+    con_write(vc, buf, len);
+}
+
+size_t kbd_read(int vc, char* buf, size_t len)
+{
+    input_t* in = input + clamp(vc, 0, NUM_CONSOLES - 1);
+    bool irq_status;
+
+    irqs_save(&irq_status);
+    while (!ringbuf_used(&in->ring))
+        thread_wait(&in->wait, 0);
+    irqs_restore(irq_status);
+
+    return ringbuf_read(&in->ring, buf, len);
+}
+
 static void kbd_outb(ushort port, uchar b)
 {
     kbd_wait();
@@ -197,16 +299,16 @@ static void kbd_setleds()
 
 static void key_self(int key, bool released)
 {
+    char ch = key;
     if (released)
         return;
-    putchar(key);
+    emit(&ch, 1);
 }
 
 static void key_fn(int key, bool released)
 { 
     const char* p = func_table[key];
-    while (*p)
-	putchar(*p++);
+    emit(p, strlen(p));
 }
 
 static void key_spec(int key, bool released)
@@ -218,7 +320,7 @@ static void key_spec(int key, bool released)
     {
     // Enter
     case 1:
-        putchar('\n');
+        emit("\n", 1);
 	break;
     }
 }
@@ -226,16 +328,15 @@ static void key_spec(int key, bool released)
 static void key_pad(int key, bool released)
 {
     static const char ch[] = { 0, 0, 'B', 0, 'D', 0, 'C', 0, 'A', 0 };
+    char seq[] = { '\033', '[', ch[key] };
     if (released)
 	return;
-    putchar('\033');
-    putchar('[');
-    putchar(ch[key]);
+    emit(seq, sizeof (seq));
 }
 
 static void key_dead(int key, bool released)
 {
-    printf("key_dead: key=%d, released=%d\n", key, released);
+    KLOG(KLOG_CAT_DEV, KLOG_DEBUG, "key_dead: key=%d, released=%d\n", key, released);
 }
 
 static void key_cons(int key, bool released)
@@ -245,10 +346,8 @@ static void key_cons(int key, bool released)
 
 static void key_cur(int key, bool released)
 {
-    printf("%d\n", key);
-    putchar('\033');
-    putchar('[');
-    putchar(key + 'A' - 1);
+    char seq[] = { '\033', '[', key + 'A' - 1 };
+    emit(seq, sizeof (seq));
 }
 
 static void key_shift(int key, bool released)
@@ -326,22 +425,23 @@ static void key_shift(int key, bool released)
 
 static void key_meta(int key, bool released)
 {
-    printf("key_meta: key=%d, released=%d\n", key, released);
+    KLOG(KLOG_CAT_DEV, KLOG_DEBUG, "key_meta: key=%d, released=%d\n", key, released);
 }
 
 static void key_ascii(int key, bool released)
 {
-    printf("key_ascii: key=%d, released=%d\n", key, released);
+    KLOG(KLOG_CAT_DEV, KLOG_DEBUG, "key_ascii: key=%d, released=%d\n", key, released);
 }
 
 static void key_lock(int key, bool released)
 {
-    printf("key_lock: key=%d, released=%d\n", key, released);
+    KLOG(KLOG_CAT_DEV, KLOG_DEBUG, "key_lock: key=%d, released=%d\n", key, released);
 }
 
 static void key_lowercase(int key, bool released)
 {
+    char ch = key;
     if (released)
 	return;
-    putchar(key);
+    emit(&ch, 1);
 }
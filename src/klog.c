@@ -0,0 +1,236 @@
+/*
+ * Kernel log ring buffer
+ */
+#include <klog.h>
+#include <console.h>
+#include <thread.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <bitmap.h>
+#include <asm.h>
+
+enum
+{
+    KLOG_LINE     = 256, // Formatting buffer of printk()
+    KLOG_INTERVAL = 10,  // Sleep ticks of klogd
+};
+
+static klog_record_t ring[KLOG_RECORDS];
+static klog_stats_t stats;
+
+// Last reserved sequence number
+static uint32_t last_seq = 0;
+
+// Next record for the console
+static uint32_t console_seq = 1;
+static int console_level = KLOG_DEBUG;
+
+// Rendered by klogd, set while a context renders
+static bool render_deferred = false;
+static bool rendering = false;
+
+uint32_t klog_enabled[KLOG_DEBUG + 1] =
+{
+    KLOG_CAT_ALL, KLOG_CAT_ALL, KLOG_CAT_ALL, 0,
+};
+
+static const char* level_name[] = { "err", "warn", "info", "debug" };
+static const char* cat_name[] = { "core", "malloc", "mem", "irq", "thread", "dev" };
+
+static void append(int cat, int level, int flags, const char* text, int len)
+{
+    uint32_t seq = __sync_add_and_fetch(&last_seq, 1);
+    klog_record_t* r = ring + (seq & (KLOG_RECORDS - 1));
+
+    // Unpublished while written
+    r->seq = 0;
+    barrier();
+
+    r->tsc   = rdtsc();
+    r->cat   = cat;
+    r->level = level;
+    r->flags = flags;
+    r->len   = len;
+    memcpy(r->text, text, len);
+
+    barrier();
+    r->seq = seq;
+}
+
+bool klog_read(uint32_t* seq, klog_record_t* rec)
+{
+    const klog_record_t* r;
+    uint32_t last, oldest, s;
+
+    for (;;)
+    {
+        // Oldest record still in the ring
+        last   = last_seq;
+        oldest = (last >= KLOG_RECORDS ? last - KLOG_RECORDS + 1 : 1);
+        if ((int)(*seq - oldest) < 0)
+            *seq = oldest;
+        if ((int)(*seq - last) > 0)
+            return false;
+
+        r = ring + (*seq & (KLOG_RECORDS - 1));
+        s = r->seq;
+        if (s != *seq)
+        {
+            // Not published yet, or overwritten (skip ahead)
+            if (s == 0 || (int)(s - *seq) < 0)
+                return false;
+            continue;
+        }
+
+        barrier();
+        *rec = *r;
+        barrier();
+
+        // Overwritten while copied
+        if (r->seq != *seq)
+            continue;
+
+        ++*seq;
+        return true;
+    }
+}
+
+// Render new records to the console, one context at a time
+static void render()
+{
+    klog_record_t rec;
+    uint32_t seq;
+
+    if (__sync_lock_test_and_set(&rendering, true))
+        return;
+
+    seq = console_seq;
+    while (klog_read(&seq, &rec))
+    {
+        if (rec.seq != console_seq)
+            stats.dropped += rec.seq - console_seq;
+        console_seq = seq;
+        if (rec.level <= console_level)
+            con_write(KLOG_CONSOLE, rec.text, rec.len);
+    }
+
+    __sync_lock_release(&rendering);
+}
+
+int vklog(int cat, int level, const char* format, va_list args)
+{
+    char buffer[KLOG_LINE];
+    int len, n, i = 0;
+
+    len   = vsnprintf(buffer, sizeof (buffer), format, args);
+    level = clamp(level, KLOG_ERR, KLOG_DEBUG);
+    cat  &= KLOG_CAT_ALL;
+    if (!cat)
+        cat = KLOG_CAT_CORE;
+    do
+    {
+        n = min(len - i, KLOG_TEXT);
+        append(cat, level, i > 0 ? KLOG_CONT : 0, buffer + i, n);
+        i += n;
+    }
+    while (i < len);
+    stats.records = last_seq;
+
+    if (!render_deferred)
+        render();
+
+    return len;
+}
+
+int klog(int cat, int level, const char* format, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vklog(cat, level, format, args);
+    va_end(args);
+    return len;
+}
+
+int printk(int level, const char* format, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vklog(KLOG_CAT_CORE, level, format, args);
+    va_end(args);
+    return len;
+}
+
+void klog_enable(int cats, int level)
+{
+    int i;
+
+    for (i = KLOG_ERR; i <= KLOG_DEBUG; ++i)
+    {
+        if (i <= level)
+            klog_enabled[i] |= cats;
+        else
+            klog_enabled[i] &= ~cats;
+    }
+}
+
+void klog_set_console_level(int level)
+{
+    console_level = level;
+}
+
+void klog_sync()
+{
+    render_deferred = false;
+
+    // Interrupted renderer (panic), take over
+    __sync_lock_release(&rendering);
+    render();
+}
+
+// Render the log to the console while there's time
+void __noreturn klog_thread()
+{
+    render_deferred = true;
+    for (;;)
+    {
+        render();
+        thread_sleep(KLOG_INTERVAL);
+    }
+}
+
+void klog_dump()
+{
+    klog_record_t rec;
+    uint32_t seq = 0;
+    bool line = true;
+
+    while (klog_read(&seq, &rec))
+    {
+        // Record header at the start of a line
+        if (line && !(rec.flags & KLOG_CONT))
+            printf("[%12llu] %-5s %-6s ", rec.tsc >> 10, level_name[rec.level],
+                   cat_name[bitmap_ffs(rec.cat)]);
+        con_write(con_getvc(), rec.text, rec.len);
+        line = (rec.len > 0 && rec.text[rec.len - 1] == '\n');
+    }
+    if (!line)
+        putchar('\n');
+}
+
+const klog_stats_t* klog_get_stats()
+{
+    return &stats;
+}
+
+void klog_dump_stats(const klog_stats_t* s)
+{
+    printf("Kernel log Statistics:\n"
+           " Records: %u (%d slots)\n"
+           " Dropped: %u (console)\n",
+           s->records, KLOG_RECORDS, s->dropped);
+}
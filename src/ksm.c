@@ -0,0 +1,322 @@
+/*
+ * Same-page merging
+ */
+#include <ksm.h>
+#include <vmem.h>
+#include <thread.h>
+#include <pool.h>
+#include <list.h>
+#include <malloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <debug.h>
+#include <asm.h>
+
+enum
+{
+    KSM_BUCKETS  = 256,
+    KSM_POOL     = 64,
+
+    // Pages scanned per interval of the scanner
+    KSM_BATCH    = 100,
+    KSM_INTERVAL = 20,
+};
+
+/*
+ * Registered range
+ *    - The checksums of the last scan are kept, pages
+ *      which changed since then aren't merged
+ */
+typedef struct ksm_area_s
+{
+    list_t    list_entry;
+    uint32_t  start, end;
+    uint32_t* checksum;
+} ksm_area_t;
+
+/*
+ * Stable table
+ *    - Merged pages by checksum, one node for each
+ *    - The node is referenced by the owner of the page descriptor
+ */
+typedef struct ksm_node_s
+{
+    list_t       list_entry;
+    uint32_t     checksum;
+    pmem_page_t* desc;
+} ksm_node_t;
+
+/*
+ * Unstable table
+ *    - Candidates of the current pass by checksum
+ *    - The pages are still writable, so they are compared
+ *      again before merging and the table is dropped after
+ *      each pass
+ */
+typedef struct ksm_item_s
+{
+    list_t   list_entry;
+    uint32_t checksum;
+    uint32_t addr;
+} ksm_item_t;
+
+static ksm_stats_t stats;
+
+static list_t areas = LIST_INIT(areas);
+static list_t stable[KSM_BUCKETS];
+static list_t unstable[KSM_BUCKETS];
+
+static pool_t node_pool;
+static pool_t item_pool;
+
+// Scan position
+static ksm_area_t* scan_area = NULL;
+static uint32_t    scan_addr;
+
+static void scan(int);
+static void scan_page(ksm_area_t*, uint32_t);
+static void merge(uint32_t, paddr_t, uint32_t);
+static void end_pass();
+
+void __init ksm_init()
+{
+    int i;
+
+    for (i = 0; i < KSM_BUCKETS; ++i)
+    {
+        list_init(stable + i);
+        list_init(unstable + i);
+    }
+    pool_init(&node_pool, KSM_POOL, sizeof (ksm_node_t));
+    pool_init(&item_pool, KSM_POOL, sizeof (ksm_item_t));
+}
+
+const ksm_stats_t* ksm_get_stats()
+{
+    bool irq_status;
+    ksm_node_t* node;
+    list_t* entry;
+    int i;
+
+    // Mappings are counted by the pages
+    irqs_save(&irq_status);
+    stats.sharing = 0;
+    for (i = 0; i < KSM_BUCKETS; ++i)
+    {
+        for (entry = stable[i].next; entry != stable + i; entry = entry->next)
+        {
+            node = LIST_OBJECT(entry, ksm_node_t, list_entry);
+            stats.sharing += node->desc->count;
+        }
+    }
+    irqs_restore(irq_status);
+
+    return &stats;
+}
+
+// Same-page merging statistics
+void ksm_dump_stats(const ksm_stats_t* stats)
+{
+    printf("KSM Statistics:\n"
+           " Shared:     %d pages\n"
+           " Sharing:    %d mappings\n"
+           " Saved:      %dK\n"
+           " Scanned:    %d pages (%d full scans)\n",
+           stats->shared, stats->sharing, (stats->sharing - stats->shared) << 2,
+           stats->scanned, stats->full_scans);
+}
+
+void ksm_register(uint32_t start, uint32_t end)
+{
+    ksm_area_t* area;
+    bool irq_status;
+
+    ASSERT(is_page_aligned(start));
+    ASSERT(is_page_aligned(end));
+
+    area = malloc(sizeof (ksm_area_t));
+    area->start    = start;
+    area->end      = end;
+    area->checksum = calloc((end - start) / PAGE_SIZE * sizeof (uint32_t));
+
+    irqs_save(&irq_status);
+    list_add(&areas, &area->list_entry);
+    irqs_restore(irq_status);
+}
+
+void ksm_remove_page(pmem_page_t* desc)
+{
+    ksm_node_t* node = (ksm_node_t*)desc->owner;
+    bool irq_status;
+
+    ASSERT(desc->flags & PMEM_KSM);
+
+    irqs_save(&irq_status);
+    list_delete(&node->list_entry);
+    pool_release(&node_pool, node);
+    desc->flags &= ~PMEM_KSM;
+    desc->owner = NULL;
+    --stats.shared;
+    irqs_restore(irq_status);
+}
+
+void __noreturn ksm_thread()
+{
+    thread_setpriority(THREAD_PRIO_MIN);
+    for (;;)
+    {
+        scan(KSM_BATCH);
+        thread_sleep(KSM_INTERVAL);
+    }
+}
+
+static uint32_t checksum(paddr_t page)
+{
+    const uint32_t* p = (const uint32_t*)vmem_kmap(page);
+    uint32_t sum = 2166136261U;
+    int i;
+
+    // FNV-1a over words
+    for (i = 0; i < PAGE_SIZE / 4; ++i)
+        sum = (sum ^ p[i]) * 16777619U;
+
+    vmem_kunmap((void*)p);
+    return sum;
+}
+
+static bool same_page(paddr_t a, paddr_t b)
+{
+    void *p = vmem_kmap(a), *q = vmem_kmap(b);
+    bool same = !memcmp(p, q, PAGE_SIZE);
+    vmem_kunmap(q);
+    vmem_kunmap(p);
+    return same;
+}
+
+// Page at addr can be merged?
+static bool candidate(uint32_t addr, paddr_t* page)
+{
+    int flags;
+
+    *page = vmem_get_page(addr, &flags);
+    return (*page != BAD_PAGE &&
+            (flags & (PAGE_RW | PAGE_ANON | PAGE_KSM)) == (PAGE_RW | PAGE_ANON) &&
+            pmem_get_page(*page)->count == 1);
+}
+
+static void scan(int count)
+{
+    while (count-- > 0 && !list_empty(&areas))
+    {
+        // Next area, the pass ends after the last one
+        if (!scan_area || scan_addr >= scan_area->end)
+        {
+            if (!scan_area || scan_area->list_entry.next == &areas)
+            {
+                if (scan_area)
+                    end_pass();
+                scan_area = LIST_OBJECT(areas.next, ksm_area_t, list_entry);
+            }
+            else
+                scan_area = LIST_OBJECT(scan_area->list_entry.next, ksm_area_t, list_entry);
+            scan_addr = scan_area->start;
+            continue;
+        }
+
+        scan_page(scan_area, scan_addr);
+        scan_addr += PAGE_SIZE;
+    }
+}
+
+static void scan_page(ksm_area_t* area, uint32_t addr)
+{
+    uint32_t* last = area->checksum + (addr - area->start) / PAGE_SIZE;
+    bool irq_status;
+    paddr_t page;
+    uint32_t sum;
+
+    irqs_save(&irq_status);
+    ++stats.scanned;
+
+    if (candidate(addr, &page))
+    {
+        // Only pages which didn't change since the last pass
+        sum = checksum(page);
+        if (sum == *last)
+            merge(addr, page, sum);
+        *last = sum;
+    }
+
+    irqs_restore(irq_status);
+}
+
+// Merge page with a stable page or a candidate of this pass
+static void merge(uint32_t addr, paddr_t page, uint32_t sum)
+{
+    list_t *bucket, *entry;
+    ksm_node_t* node;
+    ksm_item_t* item;
+    paddr_t other;
+
+    bucket = stable + sum % KSM_BUCKETS;
+    for (entry = bucket->next; entry != bucket; entry = entry->next)
+    {
+        node = LIST_OBJECT(entry, ksm_node_t, list_entry);
+        other = pmem_page_address(node->desc);
+        if (node->checksum == sum && same_page(other, page))
+        {
+            vmem_merge_page(addr, other);
+            return;
+        }
+    }
+
+    bucket = unstable + sum % KSM_BUCKETS;
+    for (entry = bucket->next; entry != bucket; entry = entry->next)
+    {
+        item = LIST_OBJECT(entry, ksm_item_t, list_entry);
+        if (item->checksum != sum || !candidate(item->addr, &other) || !same_page(other, page))
+            continue;
+
+        // Candidate becomes stable page
+        node = pool_get(&node_pool);
+        node->checksum = sum;
+        node->desc     = pmem_get_page(other);
+        node->desc->flags |= PMEM_KSM;
+        node->desc->owner  = node;
+        list_add(stable + sum % KSM_BUCKETS, &node->list_entry);
+        ++stats.shared;
+
+        vmem_merge_page(item->addr, other);
+        vmem_merge_page(addr, other);
+
+        list_delete(&item->list_entry);
+        pool_release(&item_pool, item);
+        return;
+    }
+
+    item = pool_get(&item_pool);
+    item->checksum = sum;
+    item->addr     = addr;
+    list_add(bucket, &item->list_entry);
+}
+
+// Drop the unstable table
+static void end_pass()
+{
+    bool irq_status;
+    list_t* entry;
+    int i;
+
+    irqs_save(&irq_status);
+    for (i = 0; i < KSM_BUCKETS; ++i)
+    {
+        while (!list_empty(unstable + i))
+        {
+            entry = unstable[i].next;
+            list_delete(entry);
+            pool_release(&item_pool, LIST_OBJECT(entry, ksm_item_t, list_entry));
+        }
+    }
+    ++stats.full_scans;
+    irqs_restore(irq_status);
+}
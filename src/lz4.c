@@ -0,0 +1,213 @@
+/*
+ * LZ4 block format
+ *
+ * A block is a sequence of:
+ *    - Token: literal length (high nibble) and match length - 4
+ *      (low nibble), 15 means more length bytes follow
+ *    - Literal length bytes (255 means another one follows)
+ *    - Literals
+ *    - Match offset (16 bit, little endian)
+ *    - Match length bytes
+ *
+ * The last sequence consists of literals only. The last
+ * 5 bytes are always literals and the last match starts
+ * at least 12 bytes before the end.
+ */
+#include <lz4.h>
+#include <string.h>
+#include <debug.h>
+
+enum
+{
+    MIN_MATCH     = 4,
+    LAST_LITERALS = 5,
+    MFLIMIT       = 12,
+    MIN_LENGTH    = MFLIMIT + 1,
+
+    // Length nibbles of the token
+    ML_MASK       = 15,
+    RUN_MASK      = 15,
+
+    // Searches get faster if no match was found for a while
+    SKIP_SHIFT    = 6,
+};
+
+static inline uint32_t read32(const uint8_t* p)
+{
+    // x86 allows unaligned access
+    return *(const uint32_t*)p;
+}
+
+static inline uint32_t hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+// Length extension bytes
+static uint8_t* put_length(uint8_t* op, int len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+// Write sequence (no match if mlen is 0), NULL if it doesn't fit
+static uint8_t* put_sequence(uint8_t* op, const uint8_t* oend, const uint8_t* lit,
+                             int nlit, int offset, int mlen)
+{
+    uint8_t* token = op++;
+
+    if (op + nlit + nlit / 255 + mlen / 255 + 4 > oend)
+        return NULL;
+
+    if (nlit >= RUN_MASK)
+    {
+        *token = RUN_MASK << 4;
+        op = put_length(op, nlit - RUN_MASK);
+    }
+    else
+        *token = nlit << 4;
+
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (mlen == 0)
+        return op;
+
+    *op++ = offset;
+    *op++ = offset >> 8;
+
+    mlen -= MIN_MATCH;
+    if (mlen >= ML_MASK)
+    {
+        *token |= ML_MASK;
+        op = put_length(op, mlen - ML_MASK);
+    }
+    else
+        *token |= mlen;
+
+    return op;
+}
+
+/*
+ * Greedy compression with a single hash table of the
+ * last positions of all 4 byte sequences
+ */
+int lz4_compress(const void* src, int size, void* dst, int max, void* workmem)
+{
+    const uint8_t *base = (const uint8_t*)src, *ip = base, *anchor = base, *ref;
+    const uint8_t *iend = base + size, *mflimit = iend - MFLIMIT, *matchlimit = iend - LAST_LITERALS;
+    uint8_t *op = (uint8_t*)dst, *oend = op + max;
+    uint16_t* table = (uint16_t*)workmem;
+    uint32_t h;
+    int len;
+
+    ASSERT(size <= LZ4_MAX_INPUT);
+
+    memset(table, 0, LZ4_WORKMEM_SIZE);
+
+    if (size >= MIN_LENGTH)
+    {
+        for (++ip; ip < mflimit; )
+        {
+            h = hash(read32(ip));
+            ref = base + table[h];
+            table[h] = ip - base;
+
+            if (read32(ref) != read32(ip))
+            {
+                ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+                continue;
+            }
+
+            // Extend match backwards into the literals
+            while (ip > anchor && ref > base && ip[-1] == ref[-1])
+            {
+                --ip;
+                --ref;
+            }
+
+            for (len = MIN_MATCH; ip + len < matchlimit && ip[len] == ref[len]; ++len);
+
+            op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, len);
+            if (!op)
+                return 0;
+
+            ip += len;
+            anchor = ip;
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    return (op ? op - (uint8_t*)dst : 0);
+}
+
+// Read length extension bytes, -1 on overrun
+static int get_length(const uint8_t** ip, const uint8_t* iend)
+{
+    int len = 0, b;
+    do
+    {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+int lz4_decompress(const void* src, int size, void* dst, int max)
+{
+    const uint8_t *ip = (const uint8_t*)src, *iend = ip + size, *ref;
+    uint8_t *op = (uint8_t*)dst, *oend = op + max;
+    int token, len, offset;
+
+    while (ip < iend)
+    {
+        token = *ip++;
+
+        // Literals
+        len = token >> 4;
+        if (len == RUN_MASK)
+        {
+            if ((offset = get_length(&ip, iend)) < 0)
+                return -1;
+            len += offset;
+        }
+        if (len > iend - ip || len > oend - op)
+            return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        // Last sequence
+        if (ip == iend)
+            break;
+
+        // Match
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - (uint8_t*)dst)
+            return -1;
+
+        len = token & ML_MASK;
+        if (len == ML_MASK)
+        {
+            if ((token = get_length(&ip, iend)) < 0)
+                return -1;
+            len += token;
+        }
+        len += MIN_MATCH;
+        if (len > oend - op)
+            return -1;
+
+        // Byte-wise because source and destination may overlap
+        for (ref = op - offset; len > 0; --len)
+            *op++ = *ref++;
+    }
+
+    return op - (uint8_t*)dst;
+}
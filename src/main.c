@@ -1,16 +1,31 @@
 #include <vmem.h>
+#include <vmalloc.h>
+#include <memgroup.h>
 #include <pmem.h>
+#include <memblock.h>
+#include <reclaim.h>
+#include <ksm.h>
+#include <swap.h>
+#include <ata.h>
+#include <ramdisk.h>
+#include <zram.h>
+#include <malloc.h>
 #include <pic.h>
 #include <pit.h>
 #include <stdarg.h>
 #include <string.h>
+#include <memops.h>
 #include <idt.h>
 #include <irq.h>
 #include <stdio.h>
 #include <console.h>
+#include <klog.h>
+#include <serial.h>
+#include <softirq.h>
 #include <idt.h>
 #include <multiboot.h>
 #include <cpu.h>
+#include <alternative.h>
 #include <asm.h>
 #include <desc.h>
 #include <ansicode.h>
@@ -52,14 +67,22 @@ void __noreturn kernel_main(uint32_t eax, uint32_t ebx)
     
     cpu_detect();
     cpu_dump_info(cpu_get_info());
+    alternatives_apply();
+    memops_init();
+    printf("Memory routines: %s\n", memops_current());
    
     puts("Initializing PMEM...");
+    memblock_init();
     pmem_init();
-    pmem_dump_stats(pmem_get_stats());
     
     puts("Initializing VMEM...");
     vmem_init();
+    pmem_handoff();
+    vmalloc_init();
     con_init();
+    memblock_dump();
+    pmem_dump_stats(pmem_get_stats());
+    pmem_dump_regions();
     
     puts("Setting up IDT...");
     idt_init();
@@ -70,11 +93,24 @@ void __noreturn kernel_main(uint32_t eax, uint32_t ebx)
     puts("Initializing keyboard...");
     kbd_init();
    
+    puts("Initializing serial ports...");
+    serial_init();
+    serial_console(SERIAL_COM1, 0);
+
     puts("Initializing timer...");
     timer_init();
 
     puts("Initializing threading...");
     thread_init();
+    memgroup_init();
+    reclaim_init();
+    ksm_init();
+
+    puts("Initializing swap...");
+    ata_init();
+    ramdisk_init();
+    zram_init();
+    swap_init();
    
     irqs_enable();
  
@@ -135,6 +171,220 @@ static void __noreturn mem_test()
     }
 }
 
+static void __noreturn __unused reclaim_test()
+{
+    // Pageable memory in the unused process space
+    uint32_t start = 0x10000000, end = start + (16 << 20), addr;
+
+    vmem_alloc(start, end, PAGE_RW | PAGE_NX | PAGE_ANON);
+    for (;;)
+    {
+        // Only the first quarter is used, the rest becomes inactive
+        for (addr = start; addr < start + (end - start) / 4; addr += PAGE_SIZE)
+            ++*(int*)addr;
+        reclaim_dump_stats(reclaim_get_stats());
+        swap_dump_stats(swap_get_stats());
+        thread_sleep(1000);
+    }
+}
+
+static void __noreturn __unused zram_test()
+{
+    // Kernel text as sample data, followed by as many zero pages
+    const int spp = PAGE_SIZE / BLKDEV_SECTOR_SIZE, pages = TEXT_SIZE / PAGE_SIZE;
+    blkdev_t* dev = zram_create("zram1", pages * 2);
+    char* zero = calloc(PAGE_SIZE);
+    char* buf = malloc(PAGE_SIZE);
+    const char* data;
+    int i, errors;
+
+    for (;;)
+    {
+        for (i = 0; i < pages * 2; ++i)
+        {
+            data = (i < pages ? (char*)TEXT_START + i * PAGE_SIZE : zero);
+            blkdev_write(dev, i * spp, spp, data);
+        }
+
+        errors = 0;
+        for (i = 0; i < pages * 2; ++i)
+        {
+            data = (i < pages ? (char*)TEXT_START + i * PAGE_SIZE : zero);
+            if (!blkdev_read(dev, i * spp, spp, buf) || memcmp(buf, data, PAGE_SIZE))
+                ++errors;
+        }
+
+        zram_dump_stats(zram_get_stats(dev));
+        printf(" Verify errors: %d\n", errors);
+        zram_reset(dev);
+        thread_sleep(1000);
+    }
+}
+
+static void __noreturn __unused ksm_test()
+{
+    // Pageable memory with only four different pages
+    uint32_t start = 0x20000000, end = start + (4 << 20), addr;
+    int n = 0;
+
+    vmem_alloc(start, end, PAGE_RW | PAGE_NX | PAGE_ANON);
+    for (addr = start; addr < end; addr += PAGE_SIZE)
+        memset((void*)addr, (addr >> 12) & 3, PAGE_SIZE);
+    ksm_register(start, end);
+
+    for (;;)
+    {
+        ksm_dump_stats(ksm_get_stats());
+        thread_sleep(1000);
+
+        // Write to some merged pages
+        for (addr = start + (n++ & 15) * PAGE_SIZE; addr < end; addr += 16 * PAGE_SIZE)
+            ++*(char*)addr;
+    }
+}
+
+static void __noreturn __unused memgroup_test()
+{
+    // Pageable memory larger than the hard limit of the group
+    uint32_t start = 0x30000000, end = start + (8 << 20), addr;
+    memgroup_t* group = memgroup_create("test");
+
+    memgroup_set_limits(group, 256, 512);
+    memgroup_attach(curr_thread, group);
+
+    vmem_alloc(start, end, PAGE_RW | PAGE_NX | PAGE_ANON);
+    for (;;)
+    {
+        for (addr = start; addr < end; addr += PAGE_SIZE)
+            ++*(int*)addr;
+        thread_sleep(100);
+    }
+}
+
+static void __noreturn __unused memops_bench()
+{
+    static const char* variants[] = { "rep", "mmx", "sse2" };
+    const char* best = memops_current();
+    char *src = vmalloc(4 << 20), *dst = vmalloc(4 << 20);
+    uint64_t t;
+    int i, size, n, rounds;
+
+    for (;;)
+    {
+        printf("Memory routines (cycles per KB: memcpy/memset):\n");
+        for (i = 0; i < 3; ++i)
+        {
+            if (!memops_select(variants[i]))
+                continue;
+            printf(" %s:\n", variants[i]);
+            for (size = 16; size <= (4 << 20); size *= 4)
+            {
+                // 16M per measurement
+                rounds = (16 << 20) / size;
+
+                t = rdtsc();
+                for (n = 0; n < rounds; ++n)
+                    memcpy(dst, src, size);
+                t = rdtsc() - t;
+                printf("  %7d: %6d", size, (uint32_t)(t >> 4) / (uint32_t)(rounds * size >> 14));
+
+                t = rdtsc();
+                for (n = 0; n < rounds; ++n)
+                    memset(dst, n, size);
+                t = rdtsc() - t;
+                printf("/%d\n", (uint32_t)(t >> 4) / (uint32_t)(rounds * size >> 14));
+            }
+        }
+        memops_select(best);
+        thread_sleep(5000);
+    }
+}
+
+// Cycles per snprintf() call, 64 bit value for "%lld"
+static uint32_t printf_cycles(const char* format)
+{
+    bool wide = !strcmp(format, "%lld");
+    char buf[128];
+    uint64_t t;
+    int n;
+
+    t = rdtsc();
+    for (n = 0; n < 4096; ++n)
+    {
+        if (wide)
+            snprintf(buf, sizeof (buf), format, (llong)n * -123456789123LL);
+        else
+            snprintf(buf, sizeof (buf), format, n, n * 7, n);
+    }
+    t = rdtsc() - t;
+    return (uint32_t)(t >> 12);
+}
+
+static void __noreturn __unused printf_bench()
+{
+    static const char* formats[] = { "%d", "%08X", "%5d|%-5u|%x", "x=%d y=%d z=%d\n", "%lld" };
+    char format[32];
+    int i;
+
+    for (;;)
+    {
+        printf("snprintf (cycles per call: constant/copied format):\n");
+        for (i = 0; i < 5; ++i)
+        {
+            // Copied formats aren't in the format cache
+            strcpy(format, formats[i]);
+            printf(" %-16s %6d/%d\n", i == 3 ? "x=%d y=%d z=%d" : formats[i],
+                   printf_cycles(formats[i]), printf_cycles(format));
+        }
+        thread_sleep(5000);
+    }
+}
+
+// Input of console 0 on the kernel log
+static void __noreturn __unused kbd_test()
+{
+    char buf[64];
+    int n;
+
+    for (;;)
+    {
+        n = kbd_read(0, buf, sizeof (buf) - 1);
+        buf[n] = 0;
+        printk(KLOG_INFO, "kbd_test: %d bytes \"%s\"\n", n, buf);
+    }
+}
+
+// Timer -> tasklet -> work which sleeps
+static void softirq_test_work(void* arg)
+{
+    thread_sleep(10);
+    printk(KLOG_INFO, "softirq_test: work done\n");
+}
+
+static work_t softirq_test_w = WORK_INIT(softirq_test_work, NULL);
+
+static void softirq_test_tasklet(void* arg)
+{
+    queue_work(&softirq_test_w);
+}
+
+static tasklet_t softirq_test_t = TASKLET_INIT(softirq_test_tasklet, NULL);
+
+static void softirq_test_timer(void* arg)
+{
+    tasklet_schedule(&softirq_test_t);
+}
+
+static void __noreturn __unused softirq_test()
+{
+    for (;;)
+    {
+        timer_add(softirq_test_timer, NULL, 100);
+        thread_sleep(1000);
+        softirq_dump_stats(softirq_get_stats());
+    }
+}
+
 static void __noreturn thread_a() 
 {
     double x = 0;
@@ -156,9 +406,24 @@ static void __noreturn init()
     vmem_free(INIT_START, INIT_START + INIT_SIZE);
     pmem_dump_stats(pmem_get_stats());
   	 
+    thread_create(con_flush_thread, "consoled");
+    thread_create(klog_thread, "klogd");
+    thread_create(kbd_thread, "kbdd");
+    thread_create(workqueue_thread, "kworker");
+    thread_create(pmem_zero_thread, "zerod");
+    thread_create(reclaim_thread, "reclaimd");
+    thread_create(ksm_thread, "ksmd");
     thread_create(thread_view, "thread_view");
     //thread_create(mem_view, "mem_view");
     //thread_create(mem_test, "mem_test");
+    //thread_create(reclaim_test, "reclaim_test");
+    //thread_create(zram_test, "zram_test");
+    //thread_create(ksm_test, "ksm_test");
+    //thread_create(memgroup_test, "memgroup_test");
+    //thread_create(memops_bench, "memops_bench");
+    //thread_create(printf_bench, "printf_bench");
+    //thread_create(kbd_test, "kbd_test");
+    //thread_create(softirq_test, "softirq_test");
     
     //for (i = 0; i < 10; ++i)
     //{
@@ -1,17 +1,19 @@
 #include <malloc.h>
+#include <vmalloc.h>
 #include <vmem.h>
 #include <page.h>
 #include <string.h>
 #include <math.h>
 #include <debug.h>
 #include <thread.h>
+#include <memgroup.h>
 
 //---------------------------------------------------------------
 // Heap implementation
 
-// Max. 100M kernel heap
+// Max. 32M kernel heap, the rest of the window is used by vmalloc
 #define HEAP_START 0xF9400000 
-#define HEAP_END   0xFF800000
+#define HEAP_END   VMALLOC_START
 
 static uint32_t heap_page_end = HEAP_START,
 		heap_end      = HEAP_START;
@@ -26,7 +28,7 @@ static int brk(void* end)
     // New pages needed?
     if (new_page_end > heap_page_end)
     {
-        vmem_alloc(heap_page_end, new_page_end, PAGE_RW);
+        vmem_alloc(heap_page_end, new_page_end, PAGE_RW | PAGE_NX);
 	heap_page_end = new_page_end;
     }
     // Too many pages allocated?
@@ -38,7 +40,7 @@ static int brk(void* end)
    
     heap_end = (uint32_t)end;
     
-    TRACE("Kernel heap changed: end=0x%X, num_pages=%d\n",
+    TRACE(KLOG_CAT_MALLOC, "Kernel heap changed: end=0x%X, num_pages=%d\n",
            heap_end, SIZE_TO_PAGES(heap_end - HEAP_START));
     
     return 0;
@@ -61,6 +63,7 @@ typedef struct block_s
     struct block_s* next;
     uint            size : 31;
     uint            free : 1;    
+    memgroup_t*     group;    // Charged group
 } block_t __packed;
 
 enum
@@ -70,6 +73,11 @@ enum
      */
     BLOCK_MINSIZE = 64,
     BLOCK_HDRSIZE = sizeof (block_t),
+
+    /* Large allocations get their own virtual area, so
+     * they don't pin the end of the heap.
+     */
+    LARGE_MINSIZE = 16 * PAGE_SIZE,
 };
 
 static block_t block_list;
@@ -97,11 +105,14 @@ void* malloc(size_t size)
     block_t *block, *prev;
     size_t newsize;
     
+    if (size >= LARGE_MINSIZE)
+        return vmalloc(size);
+
     size += BLOCK_HDRSIZE;
     if (size < BLOCK_MINSIZE)
         size = BLOCK_MINSIZE;
    
-    TRACE("malloc: size=%d\n", size);
+    TRACE(KLOG_CAT_MALLOC, "malloc: size=%d\n", size);
     
     critical_enter();
     
@@ -115,13 +126,18 @@ void* malloc(size_t size)
     // Heap full? --> Increase heap size
     if (!block)
     {
-        TRACE(" Heap is full\n");
+        TRACE(KLOG_CAT_MALLOC, " Heap is full\n");
         
 	block_t* newb = (block_t*)sbrk(size);
         if (!newb)
+        {
+            critical_leave();
             return NULL;
-        newb->size = size;
-        newb->free = false;
+        }
+        newb->size  = size;
+        newb->free  = false;
+        newb->group = memgroup_current();
+        memgroup_charge_heap(newb->group, size);
         block_insert(prev, newb);
         
         critical_leave();	
@@ -132,7 +148,7 @@ void* malloc(size_t size)
     newsize = block->size - size;
     if (newsize >= BLOCK_MINSIZE)
     {
-        TRACE(" Splitting free block\n");
+        TRACE(KLOG_CAT_MALLOC, " Splitting free block\n");
         
 	block_t* newb = (block_t*)((char*)block + size);
         newb->size = newsize;
@@ -141,9 +157,11 @@ void* malloc(size_t size)
         block->size = size;
     }
     
-    TRACE(" User address: %p\n", (char*)block + BLOCK_HDRSIZE);
+    TRACE(KLOG_CAT_MALLOC, " User address: %p\n", (char*)block + BLOCK_HDRSIZE);
     
-    block->free = false;
+    block->free  = false;
+    block->group = memgroup_current();
+    memgroup_charge_heap(block->group, block->size);
 
     critical_leave(); 
     return ((char*)block + BLOCK_HDRSIZE);
@@ -161,11 +179,25 @@ void* calloc(size_t size)
 void* realloc(void* mem, size_t size)
 {
     ASSERT(mem);
-    block_t* block = (block_t*)((char*)mem - BLOCK_HDRSIZE);
-    void* newmem = malloc(size);
+    size_t oldsize;
+    void* newmem;
+
+    if (is_vmalloc_addr(mem))
+    {
+        // Still fits into the mapped pages?
+        oldsize = vmalloc_size(mem);
+        if (size <= oldsize && size >= LARGE_MINSIZE)
+            return mem;
+    }
+    else
+        oldsize = ((block_t*)((char*)mem - BLOCK_HDRSIZE))->size - BLOCK_HDRSIZE;
+
+    newmem = malloc(size);
     if (newmem)
-        memcpy(newmem, mem, block->size - BLOCK_HDRSIZE);
-    free(mem);
+    {
+        memcpy(newmem, mem, min(oldsize, size));
+        free(mem);
+    }
     return newmem;
 }
 
@@ -174,7 +206,13 @@ void free(void* mem)
     block_t *block, *prev, *next;
     ASSERT(mem);
     
-    TRACE("free: address=%p\n", (char*)mem - BLOCK_HDRSIZE);
+    if (is_vmalloc_addr(mem))
+    {
+        vfree(mem);
+        return;
+    }
+
+    TRACE(KLOG_CAT_MALLOC, "free: address=%p\n", (char*)mem - BLOCK_HDRSIZE);
    
     critical_enter();
     
@@ -183,11 +221,12 @@ void free(void* mem)
     next = block->next;
     
     block->free = true;
+    memgroup_charge_heap(block->group, -(int)block->size);
     
     // Concatenate with previous
     if (prev != &block_list && prev->free)
     {
-        TRACE(" Concatenating with previous\n");
+        TRACE(KLOG_CAT_MALLOC, " Concatenating with previous\n");
         
 	blocks_concat(prev, block);
 
@@ -199,7 +238,7 @@ void free(void* mem)
     // Decrease heap size
     if (!next)
     {
-        TRACE(" Last block; Decreasing heap size\n");
+        TRACE(KLOG_CAT_MALLOC, " Last block; Decreasing heap size\n");
         
 	sbrk(-block->size);
         prev->next = NULL;
@@ -209,7 +248,7 @@ void free(void* mem)
     {
         blocks_concat(block, next);
         
-	TRACE("Concatenating with next\n");
+	TRACE(KLOG_CAT_MALLOC, "Concatenating with next\n");
     }
 
     critical_leave(); 
@@ -0,0 +1,277 @@
+#include <memblock.h>
+#include <multiboot.h>
+#include <section.h>
+#include <segment.h>
+#include <string.h>
+#include <stdio.h>
+#include <debug.h>
+#include <math.h>
+#include <cpu.h>
+
+enum
+{
+    // Allocations start in upper memory
+    ALLOC_START = 0x100000,
+};
+
+typedef struct range_list_s
+{
+    memblock_range_t range[MEMBLOCK_MAX];
+    int count;
+    const char* name;
+} range_list_t;
+
+static range_list_t memory   = { .name = "memory" };
+static range_list_t reserved = { .name = "reserved" };
+
+// Allocations in order, adjacent ones are merged
+static memblock_range_t allocs[MEMBLOCK_MAX];
+static int num_allocs = 0;
+
+// End of the physical address space (36 bit with PAE)
+static paddr_t max_phys;
+
+// Free ranges are owned by the page allocator
+static bool released = false;
+
+static void add_range(range_list_t*, paddr_t, paddr_t);
+
+void __init memblock_init()
+{
+    const multiboot_info_t* info = multiboot_get();
+    const multiboot_mmap_t* mmap;
+    const multiboot_module_t* mods;
+    int i, count;
+
+    // vmem_init() enables PAE if it's supported
+    max_phys = (CPU_HAS_FEATURE(PAE) ? 1ULL << 36 : 1ULL << 32);
+
+    mmap = multiboot_get_mmap(&count);
+    if (mmap)
+    {
+        for (i = 0; i < count; ++i)
+        {
+            if (mmap[i].type == MULTIBOOT_MEMORY_AVAILABLE)
+                memblock_add(mmap[i].base, mmap[i].base + mmap[i].length);
+        }
+    }
+    else if (info->flags & MULTIBOOT_MEM)
+    {
+        // No memory map, use lower and upper memory
+        memblock_add(0, info->mem_lower << 10);
+        memblock_add(ALLOC_START, ALLOC_START + (info->mem_upper << 10));
+    }
+
+    if (memory.count == 0)
+        panic("No memory information from boot manager");
+
+    // Reserved ranges may overlap usable ones
+    for (i = 0; mmap && i < count; ++i)
+    {
+        if (mmap[i].type != MULTIBOOT_MEMORY_AVAILABLE)
+            memblock_reserve(mmap[i].base, mmap[i].base + mmap[i].length);
+    }
+
+    // Boot modules
+    mods = multiboot_get_mods(&count);
+    for (i = 0; i < count; ++i)
+        memblock_reserve(mods[i].start, mods[i].end);
+
+    // Real mode IVT and BIOS data area
+    memblock_reserve(0, PAGE_SIZE);
+
+    memblock_reserve(KERNEL_START_PHYS, KERNEL_START_PHYS + KERNEL_SIZE);
+}
+
+// Add usable memory, only whole pages which can be mapped
+void __init memblock_add(uint64_t start, uint64_t end)
+{
+    if (end > max_phys)
+        end = max_phys;
+    start = (start + PAGE_SIZE - 1) & ~0xFFFULL;
+    end &= ~0xFFFULL;
+    if (start < end)
+        add_range(&memory, start, end);
+}
+
+// Reserve range, partially used pages are reserved completely
+void __init memblock_reserve(uint64_t start, uint64_t end)
+{
+    int i;
+
+    ASSERT(!released);
+
+    if (end > max_phys)
+        end = max_phys;
+    start &= ~0xFFFULL;
+    end = (end + PAGE_SIZE - 1) & ~0xFFFULL;
+
+    // Only ranges in usable memory are of interest
+    for (i = 0; i < memory.count; ++i)
+    {
+        if (start < memory.range[i].end && end > memory.range[i].start)
+        {
+            add_range(&reserved, start, end);
+            return;
+        }
+    }
+}
+
+/*
+ * Allocate cleared memory (bottom-up), panics if
+ * there's no free range
+ */
+paddr_t __init memblock_alloc(size_t size, size_t align)
+{
+    const memblock_range_t* r;
+    paddr_t start, end;
+    int i, j;
+
+    ASSERT(!released);
+
+    size  = ceil(size, PAGE_SIZE);
+    align = max(align, PAGE_SIZE);
+
+    for (i = 0; i < memory.count; ++i)
+    {
+        start = (memory.range[i].start > ALLOC_START ? memory.range[i].start : ALLOC_START);
+        start = (start + align - 1) & ~(paddr_t)(align - 1);
+
+        // Skip reserved ranges (sorted) in the way
+        for (j = 0; j < reserved.count; ++j)
+        {
+            r = reserved.range + j;
+            if (r->end <= start)
+                continue;
+            if (r->start >= start + size)
+                break;
+            start = (r->end + align - 1) & ~(paddr_t)(align - 1);
+        }
+
+        end = start + size;
+        if (end > memory.range[i].end || end > MEMBLOCK_LIMIT)
+            continue;
+
+        add_range(&reserved, start, end);
+        if (num_allocs > 0 && allocs[num_allocs - 1].end == start)
+            allocs[num_allocs - 1].end = end;
+        else if (num_allocs < MEMBLOCK_MAX)
+        {
+            allocs[num_allocs].start = start;
+            allocs[num_allocs].end   = end;
+            ++num_allocs;
+        }
+        else
+            panic("Too many boot allocations");
+
+        memset((void*)PHYS_TO_VIRT((uint32_t)start), 0, size);
+        return start;
+    }
+
+    panic("Out of boot memory (%d bytes)", size);
+}
+
+/*
+ * Hand all free ranges (usable memory without the
+ * reserved ranges) over to the page allocator
+ */
+void __init memblock_release(memblock_func_t func)
+{
+    const memblock_range_t *m, *r;
+    paddr_t start;
+
+    released = true;
+
+    for (m = memory.range; m < memory.range + memory.count; ++m)
+    {
+        start = m->start;
+        for (r = reserved.range; r < reserved.range + reserved.count; ++r)
+        {
+            if (r->end <= start || r->start >= m->end)
+                continue;
+            if (r->start > start)
+                func(start, r->start);
+            start = r->end;
+        }
+        if (start < m->end)
+            func(start, m->end);
+    }
+}
+
+static void __init dump_list(const range_list_t* list)
+{
+    const memblock_range_t* r;
+
+    printf(" %s:\n", list->name);
+    for (r = list->range; r < list->range + list->count; ++r)
+    {
+        printf("  0x%08X%08X - 0x%08X%08X\n",
+               (uint32_t)(r->start >> 32), (uint32_t)r->start,
+               (uint32_t)(r->end >> 32), (uint32_t)r->end);
+    }
+}
+
+// Ranges and boot allocations
+void __init memblock_dump()
+{
+    int i, size = 0;
+
+    printf("Boot memory:\n");
+    dump_list(&memory);
+    dump_list(&reserved);
+
+    for (i = 0; i < num_allocs; ++i)
+        size += allocs[i].end - allocs[i].start;
+    printf(" allocated: %dK in %d ranges\n", size >> 10, num_allocs);
+}
+
+const memblock_range_t* memblock_get_memory(int* count)
+{
+    *count = memory.count;
+    return memory.range;
+}
+
+const memblock_range_t* memblock_get_reserved(int* count)
+{
+    *count = reserved.count;
+    return reserved.range;
+}
+
+// Get allocation by number (NULL if there's none)
+const memblock_range_t* memblock_get_alloc(int i)
+{
+    return (i < num_allocs ? allocs + i : NULL);
+}
+
+// Add range and merge overlapping or adjacent ones
+static void __init add_range(range_list_t* list, paddr_t start, paddr_t end)
+{
+    memblock_range_t* range = list->range;
+    int i, j;
+
+    // Find position and merge overlapping or adjacent ranges
+    for (i = 0; i < list->count && range[i].end < start; ++i);
+    for (j = i; j < list->count && range[j].start <= end; ++j)
+    {
+        if (range[j].start < start)
+            start = range[j].start;
+        if (range[j].end > end)
+            end = range[j].end;
+    }
+
+    if (i == j && list->count == MEMBLOCK_MAX)
+    {
+        // Reserved memory must never be handed out
+        if (list == &reserved)
+            panic("Too many reserved boot memory ranges");
+        printf(" Boot memory: %s range 0x%08X%08X ignored\n",
+               list->name, (uint32_t)(start >> 32), (uint32_t)start);
+        return;
+    }
+
+    // Replace ranges i..j-1 by the new one
+    memmove(range + i + 1, range + j, (list->count - j) * sizeof (memblock_range_t));
+    list->count += i + 1 - j;
+    range[i].start = start;
+    range[i].end   = end;
+}
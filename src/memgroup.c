@@ -0,0 +1,157 @@
+/*
+ * Memory accounting groups
+ */
+#include <memgroup.h>
+#include <reclaim.h>
+#include <softirq.h>
+#include <malloc.h>
+#include <string.h>
+#include <debug.h>
+#include <asm.h>
+
+enum
+{
+    // Extra pages reclaimed when a group hits its hard limit
+    HARD_LIMIT_BATCH = 8,
+};
+
+memgroup_t memgroup_root = { .name = "root" };
+
+static list_t groups = LIST_INIT(groups);
+
+void __init memgroup_init()
+{
+    list_add(&groups, &memgroup_root.list_entry);
+    memgroup_attach(curr_thread, &memgroup_root);
+}
+
+memgroup_t* memgroup_create(const char* name)
+{
+    memgroup_t* group;
+    bool irq_status;
+
+    group = calloc(sizeof (memgroup_t));
+    if (!group)
+        return NULL;
+    strncpy(group->name, name, sizeof (group->name) - 1);
+
+    irqs_save(&irq_status);
+    list_add(&groups, &group->list_entry);
+    irqs_restore(irq_status);
+
+    return group;
+}
+
+void memgroup_set_limits(memgroup_t* group, int soft, int hard)
+{
+    ASSERT(soft >= 0 && hard >= 0);
+    group->soft_limit = soft;
+    group->hard_limit = hard;
+}
+
+memgroup_t* memgroup_next(const memgroup_t* group)
+{
+    const list_t* entry = (group ? group->list_entry.next : groups.next);
+    return (entry != &groups ? LIST_OBJECT(entry, memgroup_t, list_entry) : NULL);
+}
+
+memgroup_t* memgroup_current()
+{
+    return (curr_thread && !softirq_running() ? curr_thread->memgroup : NULL);
+}
+
+void memgroup_attach(thread_t* t, memgroup_t* group)
+{
+    bool irq_status;
+
+    irqs_save(&irq_status);
+    if (t->memgroup)
+        --t->memgroup->threads;
+    t->memgroup = group;
+    ++group->threads;
+    irqs_restore(irq_status);
+}
+
+bool memgroup_charge(memgroup_t* group, int pages)
+{
+    bool irq_status, allowed;
+    int n;
+
+    if (!group)
+        return true;
+
+    allowed = reclaim_allowed();
+    irqs_save(&irq_status);
+
+    // Over the hard limit --> reclaim pages of the group
+    // (with the irqs of the caller, the pageout does I/O)
+    while (allowed && group->hard_limit > 0 && group->pages + pages > group->hard_limit && !reclaim_running())
+    {
+        n = group->pages + pages - group->hard_limit + HARD_LIMIT_BATCH;
+        irqs_restore(irq_status);
+        n = reclaim_group(group, n);
+        irqs_save(&irq_status);
+        group->reclaimed += n;
+        if (n == 0)
+        {
+            ++group->failed;
+            irqs_restore(irq_status);
+            return false;
+        }
+    }
+
+    group->pages += pages;
+    if (group->pages > group->max_pages)
+        group->max_pages = group->pages;
+
+    irqs_restore(irq_status);
+    return true;
+}
+
+void memgroup_uncharge(memgroup_t* group, int pages)
+{
+    bool irq_status;
+
+    if (!group)
+        return;
+
+    irqs_save(&irq_status);
+    group->pages -= pages;
+    ASSERT(group->pages >= 0);
+    irqs_restore(irq_status);
+}
+
+void memgroup_charge_heap(memgroup_t* group, int bytes)
+{
+    bool irq_status;
+
+    if (!group)
+        return;
+
+    irqs_save(&irq_status);
+    group->heap += bytes;
+    irqs_restore(irq_status);
+}
+
+memgroup_t* memgroup_soft_excess(int* excess)
+{
+    memgroup_t *group, *worst = NULL;
+    bool irq_status;
+    list_t* entry;
+
+    *excess = 0;
+
+    irqs_save(&irq_status);
+    for (entry = groups.next; entry != &groups; entry = entry->next)
+    {
+        group = LIST_OBJECT(entry, memgroup_t, list_entry);
+        if (group->soft_limit > 0 && group->pages - group->soft_limit > *excess)
+        {
+            worst = group;
+            *excess = group->pages - group->soft_limit;
+        }
+    }
+    irqs_restore(irq_status);
+
+    return worst;
+}
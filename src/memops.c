@@ -0,0 +1,409 @@
+/*
+ * Block memory routines
+ */
+#include <memops.h>
+#include <string.h>
+#include <thread.h>
+#include <math.h>
+#include <cpu.h>
+#include <asm.h>
+
+enum
+{
+    // Smaller blocks aren't worth the FPU setup
+    FPU_MIN   = 512,
+
+    // Bigger blocks bypass the cache
+    NT_MIN    = 256 * 1024,
+
+    // Max. bytes per FPU section (irqs are disabled meanwhile)
+    FPU_CHUNK = 64 * 1024,
+};
+
+/*
+ * Block functions
+ *    - Destination is 16 byte aligned
+ *    - Count is a multiple of 64
+ *    - Called between kernel_fpu_begin() and kernel_fpu_end()
+ */
+typedef void   (*block_copy_t)(char* dest, const char* src, size_t count);
+typedef void   (*block_set_t)(char* dest, uint32_t val, size_t count);
+typedef size_t (*block_diff_t)(const char* a, const char* b, size_t count); // Equal bytes
+
+typedef struct memops_s
+{
+    const char*  name;
+    int          feature; // Required cpu feature (-1 if none)
+    block_copy_t copy, copy_nt;
+    block_set_t  set, set_nt;
+    block_diff_t diff;
+} memops_t;
+
+static void copy_mmx(char*, const char*, size_t);
+static void set_mmx(char*, uint32_t, size_t);
+static void copy_sse2(char*, const char*, size_t);
+static void copy_sse2_nt(char*, const char*, size_t);
+static void set_sse2(char*, uint32_t, size_t);
+static void set_sse2_nt(char*, uint32_t, size_t);
+static size_t diff_sse2(const char*, const char*, size_t);
+
+// Variants ordered by preference
+static const memops_t variants[] =
+{
+    { "rep",  -1 },
+    { "mmx",  CPU_FEATURE_MMX,  copy_mmx,  copy_mmx,     set_mmx,  set_mmx },
+    { "sse2", CPU_FEATURE_SSE2, copy_sse2, copy_sse2_nt, set_sse2, set_sse2_nt, diff_sse2 },
+};
+
+static const memops_t* ops = variants;
+
+void __init memops_init()
+{
+    int i;
+
+    // SSE instructions raise #UD without OSFXSR
+    if (CPU_HAS_FEATURE(SSE) && CPU_HAS_FEATURE(FXSR))
+        set_reg(cr4, get_reg(cr4) | CR4_OSFXSR);
+
+    for (i = sizeof (variants) / sizeof (variants[0]) - 1; i > 0; --i)
+    {
+        if (memops_select(variants[i].name))
+            break;
+    }
+}
+
+bool memops_select(const char* name)
+{
+    const memops_t* v;
+
+    for (v = variants; v < variants + sizeof (variants) / sizeof (variants[0]); ++v)
+    {
+        if (strcmp(v->name, name))
+            continue;
+        if (v->feature >= 0 && !cpu_has_feature(cpu_get_info(), v->feature))
+            return false;
+        if (v->feature == CPU_FEATURE_SSE2 && !(get_reg(cr4) & CR4_OSFXSR))
+            return false;
+        ops = v;
+        return true;
+    }
+    return false;
+}
+
+const char* memops_current()
+{
+    return ops->name;
+}
+
+//---------------------------------------------------------------
+// String instructions
+
+static inline void* copy_rep(void* dest, const void* src, size_t count)
+{
+    int d0, d1, d2;
+    __asm__ __volatile__ (
+        "rep; movsl       \n\t"
+        "movl %4, %%ecx   \n\t"
+        "rep; movsb"
+        : "=&c" (d0), "=&D" (d1), "=&S" (d2)
+        : "0" (count >> 2), "g" (count & 3), "1" (dest), "2" (src)
+        : "memory");
+    return dest;
+}
+
+// Copy backwards (overlapping blocks)
+static inline void* copy_rep_back(void* dest, const void* src, size_t count)
+{
+    int d0, d1, d2;
+    __asm__ __volatile__ (
+        "std              \n\t"
+        "rep; movsb       \n\t"
+        "subl $3, %%esi   \n\t"
+        "subl $3, %%edi   \n\t"
+        "movl %4, %%ecx   \n\t"
+        "rep; movsl       \n\t"
+        "cld"
+        : "=&c" (d0), "=&D" (d1), "=&S" (d2)
+        : "0" (count & 3), "g" (count >> 2),
+          "1" ((char*)dest + count - 1), "2" ((const char*)src + count - 1)
+        : "memory");
+    return dest;
+}
+
+static inline void* set_rep(void* buf, uint32_t val, size_t count)
+{
+    int d0, d1;
+    __asm__ __volatile__ (
+        "rep; stosl       \n\t"
+        "movl %3, %%ecx   \n\t"
+        "rep; stosb"
+        : "=&c" (d0), "=&D" (d1)
+        : "a" (val), "g" (count & 3), "0" (count >> 2), "1" (buf)
+        : "memory");
+    return buf;
+}
+
+//---------------------------------------------------------------
+// Exported routines
+
+void* memcpy(void* dest, const void* src, size_t count)
+{
+    const char* s = src;
+    char* d = dest;
+    bool irq_status;
+    block_copy_t func;
+    size_t n;
+
+    if (count < FPU_MIN || !ops->copy)
+        return copy_rep(dest, src, count);
+
+    func = (count >= NT_MIN ? ops->copy_nt : ops->copy);
+
+    // Align destination
+    n = -(uint32_t)d & 15;
+    copy_rep(d, s, n);
+    d += n;
+    s += n;
+    count -= n;
+
+    while (count >= 64)
+    {
+        n = min(count & ~63, FPU_CHUNK);
+        kernel_fpu_begin(&irq_status);
+        func(d, s, n);
+        kernel_fpu_end(irq_status);
+        d += n;
+        s += n;
+        count -= n;
+    }
+
+    copy_rep(d, s, count);
+    return dest;
+}
+
+void* memset(void* buf, int c, size_t count)
+{
+    uint32_t val = (uint8_t)c * 0x01010101U;
+    bool irq_status;
+    block_set_t func;
+    char* d = buf;
+    size_t n;
+
+    if (count < FPU_MIN || !ops->set)
+        return set_rep(buf, val, count);
+
+    func = (count >= NT_MIN ? ops->set_nt : ops->set);
+
+    n = -(uint32_t)d & 15;
+    set_rep(d, val, n);
+    d += n;
+    count -= n;
+
+    while (count >= 64)
+    {
+        n = min(count & ~63, FPU_CHUNK);
+        kernel_fpu_begin(&irq_status);
+        func(d, val, n);
+        kernel_fpu_end(irq_status);
+        d += n;
+        count -= n;
+    }
+
+    set_rep(d, val, count);
+    return buf;
+}
+
+void* memmove(void* dest, const void* src, size_t count)
+{
+    // Not overlapping
+    if ((char*)dest + count <= (const char*)src || (const char*)src + count <= (char*)dest)
+        return memcpy(dest, src, count);
+
+    // Forward copy only reads bytes which weren't written yet
+    if (dest < src)
+        return copy_rep(dest, src, count);
+    return copy_rep_back(dest, src, count);
+}
+
+int memcmp(const void* a, const void* b, size_t count)
+{
+    const unsigned char *p = a, *q = b;
+    bool irq_status;
+    size_t i = 0, n, equal;
+
+    // Skip equal 16 byte blocks
+    if (count >= FPU_MIN && ops->diff)
+    {
+        while (count - i >= 64)
+        {
+            n = min((count - i) & ~63, FPU_CHUNK);
+            kernel_fpu_begin(&irq_status);
+            equal = ops->diff((const char*)p + i, (const char*)q + i, n);
+            kernel_fpu_end(irq_status);
+            i += equal;
+            if (equal < n)
+                break;
+        }
+    }
+
+    // Skip equal words
+    while (i + 4 <= count && *(const uint32_t*)(p + i) == *(const uint32_t*)(q + i))
+        i += 4;
+
+    for (; i < count; ++i)
+    {
+        if (p[i] != q[i])
+            return p[i] - q[i];
+    }
+    return 0;
+}
+
+//---------------------------------------------------------------
+// MMX (8 registers of 8 bytes)
+
+static void copy_mmx(char* dest, const char* src, size_t count)
+{
+    for (; count > 0; count -= 64, src += 64, dest += 64)
+    {
+        __asm__ __volatile__ (
+            "movq   (%0), %%mm0 \n\t"
+            "movq  8(%0), %%mm1 \n\t"
+            "movq 16(%0), %%mm2 \n\t"
+            "movq 24(%0), %%mm3 \n\t"
+            "movq 32(%0), %%mm4 \n\t"
+            "movq 40(%0), %%mm5 \n\t"
+            "movq 48(%0), %%mm6 \n\t"
+            "movq 56(%0), %%mm7 \n\t"
+            "movq %%mm0,   (%1) \n\t"
+            "movq %%mm1,  8(%1) \n\t"
+            "movq %%mm2, 16(%1) \n\t"
+            "movq %%mm3, 24(%1) \n\t"
+            "movq %%mm4, 32(%1) \n\t"
+            "movq %%mm5, 40(%1) \n\t"
+            "movq %%mm6, 48(%1) \n\t"
+            "movq %%mm7, 56(%1)"
+            : : "r" (src), "r" (dest) : "memory");
+    }
+    __asm__ __volatile__ ("emms");
+}
+
+static void set_mmx(char* dest, uint32_t val, size_t count)
+{
+    __asm__ __volatile__ (
+        "movd      %0, %%mm0    \n\t"
+        "punpckldq %%mm0, %%mm0"
+        : : "r" (val));
+
+    for (; count > 0; count -= 64, dest += 64)
+    {
+        __asm__ __volatile__ (
+            "movq %%mm0,   (%0) \n\t"
+            "movq %%mm0,  8(%0) \n\t"
+            "movq %%mm0, 16(%0) \n\t"
+            "movq %%mm0, 24(%0) \n\t"
+            "movq %%mm0, 32(%0) \n\t"
+            "movq %%mm0, 40(%0) \n\t"
+            "movq %%mm0, 48(%0) \n\t"
+            "movq %%mm0, 56(%0)"
+            : : "r" (dest) : "memory");
+    }
+    __asm__ __volatile__ ("emms");
+}
+
+//---------------------------------------------------------------
+// SSE2 (16 byte registers, source may be unaligned)
+
+static void copy_sse2(char* dest, const char* src, size_t count)
+{
+    for (; count > 0; count -= 64, src += 64, dest += 64)
+    {
+        __asm__ __volatile__ (
+            "movdqu   (%0), %%xmm0 \n\t"
+            "movdqu 16(%0), %%xmm1 \n\t"
+            "movdqu 32(%0), %%xmm2 \n\t"
+            "movdqu 48(%0), %%xmm3 \n\t"
+            "movdqa %%xmm0,   (%1) \n\t"
+            "movdqa %%xmm1, 16(%1) \n\t"
+            "movdqa %%xmm2, 32(%1) \n\t"
+            "movdqa %%xmm3, 48(%1)"
+            : : "r" (src), "r" (dest) : "memory");
+    }
+}
+
+static void copy_sse2_nt(char* dest, const char* src, size_t count)
+{
+    for (; count > 0; count -= 64, src += 64, dest += 64)
+    {
+        __asm__ __volatile__ (
+            "prefetchnta 256(%0)    \n\t"
+            "movdqu   (%0), %%xmm0  \n\t"
+            "movdqu 16(%0), %%xmm1  \n\t"
+            "movdqu 32(%0), %%xmm2  \n\t"
+            "movdqu 48(%0), %%xmm3  \n\t"
+            "movntdq %%xmm0,   (%1) \n\t"
+            "movntdq %%xmm1, 16(%1) \n\t"
+            "movntdq %%xmm2, 32(%1) \n\t"
+            "movntdq %%xmm3, 48(%1)"
+            : : "r" (src), "r" (dest) : "memory");
+    }
+
+    // Non-temporal stores are weakly ordered
+    __asm__ __volatile__ ("sfence" : : : "memory");
+}
+
+static void set_sse2(char* dest, uint32_t val, size_t count)
+{
+    __asm__ __volatile__ (
+        "movd   %0, %%xmm0          \n\t"
+        "pshufd $0, %%xmm0, %%xmm0"
+        : : "r" (val));
+
+    for (; count > 0; count -= 64, dest += 64)
+    {
+        __asm__ __volatile__ (
+            "movdqa %%xmm0,   (%0) \n\t"
+            "movdqa %%xmm0, 16(%0) \n\t"
+            "movdqa %%xmm0, 32(%0) \n\t"
+            "movdqa %%xmm0, 48(%0)"
+            : : "r" (dest) : "memory");
+    }
+}
+
+static void set_sse2_nt(char* dest, uint32_t val, size_t count)
+{
+    __asm__ __volatile__ (
+        "movd   %0, %%xmm0          \n\t"
+        "pshufd $0, %%xmm0, %%xmm0"
+        : : "r" (val));
+
+    for (; count > 0; count -= 64, dest += 64)
+    {
+        __asm__ __volatile__ (
+            "movntdq %%xmm0,   (%0) \n\t"
+            "movntdq %%xmm0, 16(%0) \n\t"
+            "movntdq %%xmm0, 32(%0) \n\t"
+            "movntdq %%xmm0, 48(%0)"
+            : : "r" (dest) : "memory");
+    }
+    __asm__ __volatile__ ("sfence" : : : "memory");
+}
+
+// Length of the equal prefix in 16 byte blocks
+static size_t diff_sse2(const char* a, const char* b, size_t count)
+{
+    size_t i;
+    int mask;
+
+    for (i = 0; i < count; i += 16)
+    {
+        __asm__ __volatile__ (
+            "movdqu   (%1), %%xmm0   \n\t"
+            "movdqu   (%2), %%xmm1   \n\t"
+            "pcmpeqb  %%xmm1, %%xmm0 \n\t"
+            "pmovmskb %%xmm0, %0"
+            : "=r" (mask) : "r" (a + i), "r" (b + i) : "memory");
+        if (mask != 0xFFFF)
+            break;
+    }
+    return i;
+}
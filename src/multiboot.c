@@ -7,6 +7,14 @@
 static multiboot_info_t info;
 static char cmdline[512];
 
+// Memory map and modules
+static multiboot_mmap_t   mmap[MULTIBOOT_MAX_MMAP];
+static multiboot_module_t mods[MULTIBOOT_MAX_MODS];
+static int num_mmap = 0, num_mods = 0;
+
+static void copy_mmap() __init;
+static void copy_mods() __init;
+
 void __init multiboot_init(uint32_t eax, uint32_t ebx, int* argc, char** argv)
 {
     char* p;
@@ -32,8 +40,15 @@ void __init multiboot_init(uint32_t eax, uint32_t ebx, int* argc, char** argv)
         printf(" Cmdline: %s\n", cmdline);
     }
     
+    if (info.flags & MULTIBOOT_MMAP)
+        copy_mmap();
+
+    if (info.flags & MULTIBOOT_MODS)
+        copy_mods();
+    
     // These fields aren't loaded from physical memory
-    // so they're invalid
+    // so they're invalid (use multiboot_get_mmap() and
+    // multiboot_get_mods() instead)
     info.flags &=
         ~MULTIBOOT_CMDLINE      &
 	~MULTIBOOT_MMAP         &
@@ -63,3 +78,43 @@ const multiboot_info_t* multiboot_get()
     return &info;
 }
 
+// Get copied memory map (NULL if there's none)
+const multiboot_mmap_t* multiboot_get_mmap(int* count)
+{
+    *count = num_mmap;
+    return (num_mmap > 0 ? mmap : NULL);
+}
+
+// Get copied module list
+const multiboot_module_t* multiboot_get_mods(int* count)
+{
+    *count = num_mods;
+    return mods;
+}
+
+static void __init copy_mmap()
+{
+    char* p   = (char*)PHYS_TO_VIRT(info.map_addr);
+    char* end = p + info.mmap_length;
+
+    while (p < end && num_mmap < MULTIBOOT_MAX_MMAP)
+    {
+        const multiboot_mmap_t* m = (const multiboot_mmap_t*)p;
+        if (m->length > 0)
+            mmap[num_mmap++] = *m;
+        p += m->size + sizeof (m->size);
+    }
+
+    if (p < end)
+        printf(" Memory map truncated to %d entries\n", num_mmap);
+}
+
+static void __init copy_mods()
+{
+    const multiboot_module_t* m = (const multiboot_module_t*)PHYS_TO_VIRT((uint32_t)info.mods_addr);
+    uint32_t i;
+
+    for (i = 0; i < info.mods_count && num_mods < MULTIBOOT_MAX_MODS; ++i)
+        mods[num_mods++] = m[i];
+    printf(" Modules: %d\n", num_mods);
+}
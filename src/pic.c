@@ -25,7 +25,7 @@ static inline void set_irq_mask()
 {
     outb(PIC1 + 1, irq_mask);
     outb(PIC2 + 1, irq_mask >> 8);
-    TRACE("New IRQ mask: %016b\n", irq_mask);
+    TRACE(KLOG_CAT_IRQ, "New IRQ mask: %016b\n", irq_mask);
 }
 
 void __init pic_init()
@@ -3,10 +3,17 @@
 #include <multiboot.h>
 #include <stdio.h>
 #include <section.h>
+#include <segment.h>
 #include <page.h>
 #include <debug.h>
 #include <ansicode.h>
 #include <string.h>
+#include <vmem.h>
+#include <thread.h>
+#include <cpu.h>
+#include <reclaim.h>
+#include <memblock.h>
+#include <memgroup.h>
 
 enum
 {
@@ -15,11 +22,38 @@ enum
     
     // Start of upper memory
     UPPER_START = 0x100000,
+
+    // Max. number of usable memory regions
+    MAX_REGIONS = MEMBLOCK_MAX,
+
+    // Pre-zeroed page pool
+    ZERO_POOL_SIZE = 256, // Max. pages in the pool
+    ZERO_RESERVE   = 128, // Free pages which are never zeroed in advance
+    ZERO_INTERVAL  = 100, // Sleep ticks of the zero thread if there's no work
 };
 
 // Memory statistics
 static pmem_stats_t stats;
 
+/*
+ * Usable memory regions
+ *    - Usable memory of the boot allocator
+ *    - Sorted by address and not overlapping
+ *    - Page map indices are consecutive over all
+ *      regions, so holes don't take space in the maps
+ *    - Each region has its own descriptor array
+ */
+typedef struct region_s
+{
+    paddr_t      start; // Page aligned physical range
+    paddr_t      end;
+    int          index; // Page map index of the first page
+    pmem_page_t* desc;  // Descriptors of the region
+} region_t;
+
+static region_t regions[MAX_REGIONS];
+static int      num_regions = 0;
+
 /*
  * Superpage map
  *    - One bit for 1024 pages
@@ -42,45 +76,87 @@ static ulong* page_map;
 static int    page_map_size;
 
 /*
- * Page usage counter
+ * Pre-zeroed pages
+ *    - Filled by pmem_zero_thread()
+ *    - Linked by the lru entry of the descriptor
+ *    - Pages in the pool are marked as used
+ *      in the page map
  */
-static ushort* page_counter;
-static int     page_counter_size;
+static list_t zero_list = LIST_INIT(zero_list);
 
-static void init_bitmap();
+static void init_regions();
+static void init_maps();
+static int init_reserved(paddr_t, paddr_t, int);
 static void dump_bitmap(ulong*, int);
+static void zero_page(paddr_t);
+static paddr_t zero_pool_get();
 
 // Index in memory map to page address
-static inline uint32_t index_to_page(int index)
+static inline paddr_t index_to_page(int index)
+{
+    const region_t* r = regions + num_regions - 1;
+    while (r->index > index)
+        --r;
+    return (r->start + (paddr_t)(index - r->index) * PAGE_SIZE);
+}
+
+// Index in memory map to page descriptor
+static inline pmem_page_t* index_to_desc(int index)
 {
-    if (index < stats.lower)
-        return (index * PAGE_SIZE);
-    return ((index - stats.lower) * PAGE_SIZE + UPPER_START);
+    const region_t* r = regions + num_regions - 1;
+    while (r->index > index)
+        --r;
+    return (r->desc + (index - r->index));
 }
 
-// Page address to index in memory map
-static inline int page_to_index(uint32_t page)
+// Page address to index in memory map (-1 if not in the map)
+static inline int page_to_index(paddr_t page)
 {
-    if (page / PAGE_SIZE < stats.lower)
-        return (page / PAGE_SIZE);
-    return ((page - UPPER_START) / PAGE_SIZE + stats.lower);
+    const region_t* r;
+    for (r = regions; r < regions + num_regions; ++r)
+    {
+        if (page < r->start)
+            break;
+        if (page < r->end)
+            return ((page - r->start) / PAGE_SIZE + r->index);
+    }
+    return -1;
 }
 
-// Initialize physical memory management
+/*
+ * Initialize physical memory management
+ *
+ * The maps are allocated by the boot allocator. All pages are
+ * used until pmem_handoff() takes over the free boot memory.
+ */
 void __init pmem_init()
 {
-    if (~multiboot_get()->flags & MULTIBOOT_MEM)
-        panic("No memory information from boot manager");
+    init_regions();
 
-    stats.upper = (multiboot_get()->mem_upper << 10) / PAGE_SIZE;
-    stats.lower = (multiboot_get()->mem_lower << 10) / PAGE_SIZE;
-    stats.total = stats.upper + stats.lower;
-    
-    stats.free = stats.total;
-    stats.used = 0;
-    stats.kernel = SIZE_TO_PAGES(KERNEL_SIZE);
+    stats.free = 0;
+    stats.used = stats.total;
 
-    init_bitmap();
+    init_maps();
+}
+
+// Take over free memory from the boot allocator
+void __init pmem_handoff()
+{
+    const memblock_range_t* r;
+    int i, count;
+
+    // Firmware, modules etc.
+    r = memblock_get_reserved(&count);
+    for (i = 0; i < count; ++i)
+        init_reserved(r[i].start, r[i].end, PMEM_LOCKED);
+
+    // Kernel image and boot allocations are kernel memory
+    stats.kernel = init_reserved(KERNEL_START_PHYS, KERNEL_START_PHYS + KERNEL_SIZE,
+                                 PMEM_KERNEL | PMEM_LOCKED);
+    for (i = 0; (r = memblock_get_alloc(i)) != NULL; ++i)
+        stats.kernel += init_reserved(r->start, r->end, PMEM_KERNEL | PMEM_LOCKED);
+
+    memblock_release(pmem_free_region);
 }
 
 const pmem_stats_t* pmem_get_stats()
@@ -94,12 +170,51 @@ void pmem_dump_stats(const pmem_stats_t* stats)
     printf("Memory Statistics:\n"
            " Lower: %dK\n"
            " Upper: %dK\n"
+           " High:  %dK\n"
            " Total: %dK\n"
            " Free:  %dK\n"
-           " Used:  %dK\n",
-           stats->lower << 2, stats->upper << 2,
+           " Used:  %dK\n"
+           " Zeroed: %dK (%d%% hits)\n",
+           stats->lower << 2, stats->upper << 2, stats->high << 2,
            stats->total << 2, stats->free << 2,
-           stats->used << 2);
+           stats->used << 2, stats->zeroed << 2,
+           100 * stats->zero_hits / max(stats->zero_hits + stats->zero_misses, 1));
+}
+
+// Memory map and usage of each region
+void pmem_dump_regions()
+{
+    static const char* type_name[] =
+    {
+        "unknown", "usable", "reserved", "ACPI", "ACPI NVS", "bad"
+    };
+    const multiboot_mmap_t* mmap;
+    int i, j, count, first, pages, free;
+
+    mmap = multiboot_get_mmap(&count);
+    if (mmap)
+    {
+        printf("Memory map from boot manager:\n");
+        for (i = 0; i < count; ++i)
+        {
+            printf(" 0x%08X%08X %8dK %s\n",
+                   (uint32_t)(mmap[i].base >> 32), (uint32_t)mmap[i].base,
+                   (uint32_t)(mmap[i].length >> 10),
+                   type_name[mmap[i].type <= MULTIBOOT_MEMORY_BAD ? mmap[i].type : 0]);
+        }
+    }
+
+    printf("Managed regions:\n");
+    for (i = 0; i < num_regions; ++i)
+    {
+        first = regions[i].index;
+        pages = (regions[i].end - regions[i].start) / PAGE_SIZE;
+        for (j = free = 0; j < pages; ++j)
+            free += bitmap_getbit(page_map, first + j);
+        printf(" 0x%08X%08X %8dK, %dK free\n",
+               (uint32_t)(regions[i].start >> 32), (uint32_t)regions[i].start,
+               pages << 2, free << 2);
+    }
 }
 
 // Dump memory map
@@ -112,13 +227,36 @@ void pmem_dump_map()
     dump_bitmap(page_map, page_map_size);
 }
 
-// Allocate physical page
-uint32_t pmem_alloc_page()
+// Allocate physical page (charged to the group of the current thread)
+paddr_t pmem_alloc_page()
 {
+    memgroup_t* group = memgroup_current();
     int offset, index;
+    bool irq_status;
+    paddr_t page;
+
+    // Over the hard limit of the group?
+    if (!memgroup_charge(group, 1))
+        return BAD_PAGE;
+
+    // Wake up or run page reclaim if memory gets low
+    reclaim_check(stats.free);
     
+    irqs_save(&irq_status);
+
     if (stats.free == 0)
     {
+        // Last resort: pre-zeroed pages
+        if (stats.zeroed > 0)
+        {
+            page = zero_pool_get();
+            pmem_get_page(page)->memgroup = group;
+            irqs_restore(irq_status);
+            return page;
+        }
+
+        irqs_restore(irq_status);
+        memgroup_uncharge(group, 1);
         puts(FG_RED "Out of physical memory" NOCOLOR);
         return BAD_PAGE;
     }
@@ -146,31 +284,128 @@ uint32_t pmem_alloc_page()
     ++stats.used;
     --stats.free;
 
+    index_to_desc(index)->memgroup = group;
+
+    irqs_restore(irq_status);
     return index_to_page(index);
 }
 
+// Allocate cleared physical page, preferably from the pool
+paddr_t pmem_alloc_zeroed_page()
+{
+    memgroup_t* group = memgroup_current();
+    bool irq_status;
+    paddr_t page;
+
+    if (!memgroup_charge(group, 1))
+        return BAD_PAGE;
+
+    irqs_save(&irq_status);
+    if (stats.zeroed > 0)
+    {
+        page = zero_pool_get();
+        pmem_get_page(page)->memgroup = group;
+        ++stats.zero_hits;
+        irqs_restore(irq_status);
+        return page;
+    }
+    ++stats.zero_misses;
+    irqs_restore(irq_status);
+
+    // Charged again by pmem_alloc_page()
+    memgroup_uncharge(group, 1);
+
+    page = pmem_alloc_page();
+    if (page != BAD_PAGE)
+        zero_page(page);
+    return page;
+}
+
 // Free physical page
-void pmem_free_page(uint32_t page)
+void pmem_free_page(paddr_t page)
 {
+    pmem_page_t* desc;
+    bool irq_status;
     int index;
 
     ASSERT(is_page_aligned(page));
 
     index = page_to_index(page);
+    if (index < 0)
+        panic("Physical frame 0x%X isn't managed", (uint32_t)(page / PAGE_SIZE));
 
 #ifndef NDEBUG
     if (bitmap_getbit(page_map, index))
-        panic("Physical page at 0x%X already freed", page);
+        panic("Physical frame 0x%X already freed", (uint32_t)(page / PAGE_SIZE));
 #endif
     
+    irqs_save(&irq_status);
+
+    // Reset descriptor
+    desc = index_to_desc(index);
+    ASSERT(~desc->flags & PMEM_LRU);
+    desc->count    = 0;
+    desc->mapcount = 0;
+    desc->flags    = 0;
+    desc->owner    = NULL;
+    desc->vaddr    = 0;
+    memgroup_uncharge(desc->memgroup, 1);
+    desc->memgroup = NULL;
+
     bitmap_setbit(page_map, index);
     bitmap_setbit(super_map, index / SUPER_SIZE);
 
     --stats.used;
     ++stats.free;
+
+    irqs_restore(irq_status);
+}
+
+/*
+ * Fill the pool of pre-zeroed pages in the background
+ *    - The thread has the lowest priority, so it gets the
+ *      shortest timeslice, but it still runs once per epoch
+ *      besides the other threads
+ *    - It sleeps if the pool is full, memory gets low or
+ *      no page could be allocated
+ */
+void __noreturn pmem_zero_thread()
+{
+    pmem_page_t* desc;
+    bool irq_status;
+    paddr_t page;
+
+    thread_setpriority(THREAD_PRIO_MIN);
+    for (;;)
+    {
+        if (stats.zeroed >= ZERO_POOL_SIZE ||
+            stats.free <= max(ZERO_RESERVE, reclaim_get_stats()->wmark_high))
+        {
+            thread_sleep(ZERO_INTERVAL);
+            continue;
+        }
+
+        page = pmem_alloc_page();
+        if (page == BAD_PAGE)
+        {
+            thread_sleep(ZERO_INTERVAL);
+            continue;
+        }
+        zero_page(page);
+
+        // Pool pages are charged when they are handed out
+        irqs_save(&irq_status);
+        desc = pmem_get_page(page);
+        memgroup_uncharge(desc->memgroup, 1);
+        desc->memgroup = NULL;
+        desc->flags |= PMEM_ZEROED;
+        list_add(&zero_list, &desc->lru);
+        ++stats.zeroed;
+        irqs_restore(irq_status);
+    }
 }
 
-void pmem_alloc_region(uint32_t start, uint32_t end)
+void pmem_alloc_region(paddr_t start, paddr_t end)
 {
     int si, ei, ssi, sei;
     
@@ -178,11 +413,12 @@ void pmem_alloc_region(uint32_t start, uint32_t end)
     ASSERT(is_page_aligned(end));
     
     si = page_to_index(start);
-    ei = page_to_index(end);
+    ei = page_to_index(end - PAGE_SIZE) + 1;
     
 #ifndef NDEBUG
     if (!bitmap_range1(page_map, si, ei - si)) 
-        panic("Can't allocate physical memory region: 0x%X - 0x%X", start, end);  
+        panic("Can't allocate physical frames: 0x%X - 0x%X",
+              (uint32_t)(start / PAGE_SIZE), (uint32_t)(end / PAGE_SIZE));  
 #endif
 
     bitmap_clearbits(page_map, si, ei - si);
@@ -195,7 +431,7 @@ void pmem_alloc_region(uint32_t start, uint32_t end)
     stats.used += ei - si;    
 }
 
-void pmem_free_region(uint32_t start, uint32_t end)
+void pmem_free_region(paddr_t start, paddr_t end)
 {
     int si, ei, ssi, sei;
     
@@ -203,11 +439,12 @@ void pmem_free_region(uint32_t start, uint32_t end)
     ASSERT(is_page_aligned(end));
     
     si = page_to_index(start);
-    ei = page_to_index(end);
+    ei = page_to_index(end - PAGE_SIZE) + 1;
     
 #ifndef NDEBUG
     if (!bitmap_range0(page_map, si, ei - si)) 
-        panic("Can't free physical memory region: 0x%X - 0x%X", start, end);  
+        panic("Can't free physical frames: 0x%X - 0x%X",
+              (uint32_t)(start / PAGE_SIZE), (uint32_t)(end / PAGE_SIZE));  
 #endif
 
     bitmap_setbits(page_map, si, ei - si);
@@ -220,52 +457,92 @@ void pmem_free_region(uint32_t start, uint32_t end)
     stats.used -= ei - si; 
 }
 
-int pmem_inc(uint32_t page)
+pmem_page_t* pmem_get_page(paddr_t page)
 {
     int i = page_to_index(page);
-    ASSERT(i < page_counter_size);
-    return ++page_counter[i];
+    return (i >= 0 ? index_to_desc(i) : NULL);
 }
 
-int pmem_dec(uint32_t page)
-{ 
-    int i = page_to_index(page);
-    ASSERT(i < page_counter_size);
-    return --page_counter[i];
+paddr_t pmem_page_address(const pmem_page_t* desc)
+{
+    const region_t* r;
+    for (r = regions; r < regions + num_regions; ++r)
+    {
+        if (desc >= r->desc && desc < r->desc + (r->end - r->start) / PAGE_SIZE)
+            return (r->start + (paddr_t)(desc - r->desc) * PAGE_SIZE);
+    }
+    panic("Invalid page descriptor %p", (const void*)desc);
+}
+
+// Build region table from the usable boot memory
+static void __init init_regions()
+{
+    const memblock_range_t* mem;
+    int i, count, index = 0;
+
+    mem = memblock_get_memory(&count);
+    for (i = 0; i < count; ++i)
+    {
+        regions[i].start = mem[i].start;
+        regions[i].end   = mem[i].end;
+    }
+    num_regions = count;
+
+    stats.lower = stats.upper = stats.high = 0;
+    for (i = 0; i < num_regions; ++i)
+    {
+        regions[i].index = index;
+        count = (regions[i].end - regions[i].start) / PAGE_SIZE;
+        index += count;
+        if (regions[i].start < UPPER_START)
+            stats.lower += count;
+        else if (regions[i].start < 0x100000000ULL)
+            stats.upper += count;
+        else
+            stats.high += count;
+    }
+    stats.total = index;
 }
 
-// Initialize memory bitmap
-static void __init init_bitmap()
+// Allocate maps and descriptors (all pages used)
+static void __init init_maps()
 {
-    int size = 0;
-    char* start = (char*)(KERNEL_START + KERNEL_SIZE);
+    int i, pages;
 
-    // Allocate page map
-    page_map = (ulong*)(start + size);
     page_map_size  = stats.total;
-    size += ceil(page_map_size >> 3, sizeof (ulong));
-   
-    // Allocate super map
-    super_map = (ulong*)(start + size);
     super_map_size = (page_map_size + SUPER_SIZE - 1) / SUPER_SIZE;
-    size += ceil(super_map_size >> 3, sizeof (ulong));
 
-    // Allocate page usage counters
-    page_counter = (ushort*)(start + size);
-    page_counter_size = stats.total;
-    size += page_counter_size * sizeof (ushort);
-    memset(page_counter, 0, page_counter_size * sizeof (ushort));
-    
-    // Add to kernel memory
-    stats.kernel += SIZE_TO_PAGES(size);
-    
-    // All pages are free
-    bitmap_setbits(page_map, 0, page_map_size);
-    bitmap_setbits(super_map, 0, super_map_size);
-    
-    // Reserve kernel memory
-    pmem_alloc_region(KERNEL_START_PHYS,
-                      KERNEL_START_PHYS + stats.kernel * PAGE_SIZE);
+    page_map  = (ulong*)PHYS_TO_VIRT((uint32_t)memblock_alloc(BITS_TO_LONGS(page_map_size) * sizeof (ulong), PAGE_SIZE));
+    super_map = (ulong*)PHYS_TO_VIRT((uint32_t)memblock_alloc(BITS_TO_LONGS(super_map_size) * sizeof (ulong), PAGE_SIZE));
+
+    for (i = 0; i < num_regions; ++i)
+    {
+        pages = (regions[i].end - regions[i].start) / PAGE_SIZE;
+        regions[i].desc = (pmem_page_t*)PHYS_TO_VIRT((uint32_t)memblock_alloc(pages * sizeof (pmem_page_t), PAGE_SIZE));
+    }
+}
+
+/*
+ * Descriptors of reserved pages, returns the number of
+ * pages. Page tables keep their state.
+ */
+static int __init init_reserved(paddr_t start, paddr_t end, int flags)
+{
+    pmem_page_t* desc;
+    paddr_t page;
+    int count = 0;
+
+    for (page = start; page < end; page += PAGE_SIZE)
+    {
+        desc = pmem_get_page(page);
+        if (!desc || desc->flags & PMEM_PGTABLE)
+            continue;
+        desc->flags = flags;
+        if (flags & PMEM_KERNEL)
+            desc->count = 1;
+        ++count;
+    }
+    return count;
 }
 
 static void dump_bitmap(ulong* map, int size)
@@ -280,3 +557,21 @@ static void dump_bitmap(ulong* map, int size)
     putchar('\n');
     putchar('\n');
 }
+
+// Clear physical page by a temporary mapping
+static void zero_page(paddr_t page)
+{
+    void* p = vmem_kmap(page);
+    memset(p, 0, PAGE_SIZE);
+    vmem_kunmap(p);
+}
+
+// Take page from the zero pool (irqs must be disabled)
+static paddr_t zero_pool_get()
+{
+    pmem_page_t* desc = LIST_OBJECT(zero_list.next, pmem_page_t, lru);
+    list_delete(&desc->lru);
+    desc->flags &= ~PMEM_ZEROED;
+    --stats.zeroed;
+    return pmem_page_address(desc);
+}
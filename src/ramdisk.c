@@ -0,0 +1,80 @@
+/*
+ * RAM disks from boot modules
+ */
+#include <ramdisk.h>
+#include <blkdev.h>
+#include <multiboot.h>
+#include <vmem.h>
+#include <malloc.h>
+#include <string.h>
+#include <stdio.h>
+
+typedef struct ramdisk_s
+{
+    blkdev_t dev;
+    paddr_t  start;
+} ramdisk_t;
+
+static bool rd_read(blkdev_t*, uint32_t, int, void*);
+static bool rd_write(blkdev_t*, uint32_t, int, const void*);
+static bool rd_transfer(blkdev_t*, uint32_t, int, void*, bool);
+
+void __init ramdisk_init()
+{
+    const multiboot_module_t* mods;
+    ramdisk_t* rd;
+    int i, count;
+
+    mods = multiboot_get_mods(&count);
+    for (i = 0; i < count; ++i)
+    {
+        rd = calloc(sizeof (ramdisk_t));
+        rd->start = mods[i].start;
+        rd->dev.sectors = (mods[i].end - mods[i].start) / BLKDEV_SECTOR_SIZE;
+        rd->dev.read  = rd_read;
+        rd->dev.write = rd_write;
+        rd->dev.data  = rd;
+        snprintf(rd->dev.name, sizeof (rd->dev.name), "rd%d", i);
+        blkdev_register(&rd->dev);
+    }
+}
+
+static bool rd_read(blkdev_t* dev, uint32_t sector, int count, void* buf)
+{
+    return rd_transfer(dev, sector, count, buf, false);
+}
+
+static bool rd_write(blkdev_t* dev, uint32_t sector, int count, const void* buf)
+{
+    return rd_transfer(dev, sector, count, (void*)buf, true);
+}
+
+// Copy page-wise through temporary mappings
+static bool rd_transfer(blkdev_t* dev, uint32_t sector, int count, void* buf, bool write)
+{
+    ramdisk_t* rd = (ramdisk_t*)dev->data;
+    paddr_t addr = rd->start + (paddr_t)sector * BLKDEV_SECTOR_SIZE;
+    size_t size = count * BLKDEV_SECTOR_SIZE, n, offset;
+    char *p = (char*)buf, *map;
+
+    if (sector + count > dev->sectors)
+        return false;
+
+    while (size > 0)
+    {
+        offset = addr & (PAGE_SIZE - 1);
+        n = (PAGE_SIZE - offset < size ? PAGE_SIZE - offset : size);
+
+        map = (char*)vmem_kmap(addr - offset);
+        if (write)
+            memcpy(map + offset, p, n);
+        else
+            memcpy(p, map + offset, n);
+        vmem_kunmap(map);
+
+        addr += n;
+        p    += n;
+        size -= n;
+    }
+    return true;
+}
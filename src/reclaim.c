@@ -0,0 +1,393 @@
+#include <reclaim.h>
+#include <memgroup.h>
+#include <vmem.h>
+#include <thread.h>
+#include <softirq.h>
+#include <stdio.h>
+#include <debug.h>
+#include <math.h>
+
+enum
+{
+    // Pages reclaimed per run
+    RECLAIM_BATCH    = 32,
+
+    // Active pages aged per interval of the reclaim thread
+    AGE_BATCH        = 64,
+
+    // Sleep ticks of the reclaim thread if it's not woken up
+    RECLAIM_INTERVAL = 1000,
+};
+
+// Reclaim statistics
+static reclaim_stats_t stats;
+
+/*
+ * Reclaim lists
+ *    - Linked by the lru entry of the descriptor
+ *    - New pages are added to the active list
+ *    - Both lists are scanned like a clock: the hand is
+ *      the head, pages with accessed bit get a second chance
+ *      at the tail
+ *    - Pages are evicted from the head of the inactive list
+ */
+
+static list_t active_list   = LIST_INIT(active_list);
+static list_t inactive_list = LIST_INIT(inactive_list);
+
+static reclaim_pageout_t pageout = NULL;
+static bool in_reclaim = false;
+
+static waitqueue_t reclaim_wait = WAITQUEUE_INIT(reclaim_wait);
+
+static void age_active(int);
+static int shrink_inactive(int);
+static int shrink_group(memgroup_t*, int);
+static int shrink_groups(int);
+
+static inline pmem_page_t* list_head_page(list_t* list)
+{
+    return LIST_OBJECT(list->next, pmem_page_t, lru);
+}
+
+// Move page to the tail of a list (irqs must be disabled)
+static inline void move_tail(pmem_page_t* desc, list_t* list)
+{
+    list_delete(&desc->lru);
+    list_add(list, &desc->lru);
+}
+
+/*
+ * Evict inactive page (irqs must be disabled), returns the
+ * number of freed pages. The page is isolated and irqs are
+ * restored to irq_status during pageout.
+ */
+static int evict(pmem_page_t* desc, bool irq_status)
+{
+    int n;
+
+    reclaim_isolate(desc);
+    irqs_restore(irq_status);
+    n = pageout(desc);
+    irqs_disable();
+
+    return n;
+}
+
+// Only one reclaim at a time, pageout may allocate memory
+static bool reclaim_enter()
+{
+    return (pageout && !__sync_lock_test_and_set(&in_reclaim, true));
+}
+
+static void reclaim_leave()
+{
+    __sync_lock_release(&in_reclaim);
+}
+
+void __init reclaim_init()
+{
+    int total = pmem_get_stats()->total;
+
+    stats.wmark_min  = clamp(total / 256, 16, 1024);
+    stats.wmark_low  = stats.wmark_min * 2;
+    stats.wmark_high = stats.wmark_min * 3;
+}
+
+const reclaim_stats_t* reclaim_get_stats()
+{
+    return &stats;
+}
+
+// Reclaim statistics
+void reclaim_dump_stats(const reclaim_stats_t* stats)
+{
+    printf("Reclaim Statistics:\n"
+           " Active:    %dK\n"
+           " Inactive:  %dK\n"
+           " Scanned:   %d pages\n"
+           " Reclaimed: %d pages\n"
+           " Runs:      %d direct, %d wakeups\n"
+           " Watermarks: %dK/%dK/%dK\n",
+           stats->active << 2, stats->inactive << 2,
+           stats->scanned, stats->reclaimed,
+           stats->direct, stats->wakeups,
+           stats->wmark_min << 2, stats->wmark_low << 2, stats->wmark_high << 2);
+}
+
+void reclaim_set_pageout(reclaim_pageout_t func)
+{
+    pageout = func;
+}
+
+void reclaim_add_page(pmem_page_t* desc)
+{
+    bool irq_status;
+
+    ASSERT(~desc->flags & PMEM_LRU);
+
+    irqs_save(&irq_status);
+    desc->flags |= PMEM_LRU | PMEM_ACTIVE;
+    list_add(&active_list, &desc->lru);
+    ++stats.active;
+    irqs_restore(irq_status);
+}
+
+void reclaim_remove_page(pmem_page_t* desc)
+{
+    bool irq_status;
+
+    ASSERT(desc->flags & PMEM_LRU);
+
+    irqs_save(&irq_status);
+    list_delete(&desc->lru);
+    if (desc->flags & PMEM_ACTIVE)
+        --stats.active;
+    else
+        --stats.inactive;
+    desc->flags &= ~(PMEM_LRU | PMEM_ACTIVE);
+    irqs_restore(irq_status);
+}
+
+// Take inactive page off the lists for pageout (irqs must be disabled)
+void reclaim_isolate(pmem_page_t* desc)
+{
+    ASSERT((desc->flags & (PMEM_LRU | PMEM_ACTIVE | PMEM_LOCKED)) == PMEM_LRU);
+
+    list_delete(&desc->lru);
+    desc->flags = (desc->flags & ~PMEM_LRU) | PMEM_LOCKED;
+    ++desc->count;
+    --stats.inactive;
+}
+
+// End of pageout (irqs must be disabled), returns 1 if the page was freed
+int reclaim_putback(pmem_page_t* desc)
+{
+    ASSERT(desc->flags & PMEM_LOCKED);
+
+    desc->flags &= ~PMEM_LOCKED;
+    if (--desc->count == 0)
+    {
+        pmem_free_page(pmem_page_address(desc));
+        return 1;
+    }
+
+    // Still mapped, try again later
+    desc->flags |= PMEM_LRU;
+    list_add(&inactive_list, &desc->lru);
+    ++stats.inactive;
+    return 0;
+}
+
+bool reclaim_allowed()
+{
+    return irqs_enabled() && !softirq_running();
+}
+
+void reclaim_check(int free)
+{
+    if (free < stats.wmark_low && !list_empty(&reclaim_wait.list))
+    {
+        ++stats.wakeups;
+        thread_wakeup(&reclaim_wait);
+    }
+
+    if (free <= stats.wmark_min && reclaim_allowed())
+        reclaim_direct(RECLAIM_BATCH);
+}
+
+// Reclaim pages synchronously, returns number of freed pages
+int reclaim_direct(int count)
+{
+    int reclaimed;
+
+    if (!reclaim_enter())
+        return 0;
+
+    ++stats.direct;
+    reclaimed = shrink_groups(count);
+    if (reclaimed < count)
+        reclaimed += shrink_inactive(count - reclaimed);
+    reclaim_leave();
+
+    return reclaimed;
+}
+
+// Reclaim pages of one group synchronously
+int reclaim_group(memgroup_t* group, int count)
+{
+    int reclaimed;
+
+    if (!reclaim_enter())
+        return 0;
+
+    reclaimed = shrink_group(group, count);
+    reclaim_leave();
+
+    return reclaimed;
+}
+
+bool reclaim_running()
+{
+    return in_reclaim;
+}
+
+void __noreturn reclaim_thread()
+{
+    int n;
+
+    for (;;)
+    {
+        thread_wait(&reclaim_wait, RECLAIM_INTERVAL);
+
+        // Keep the accessed information up to date
+        age_active(AGE_BATCH);
+
+        if (!reclaim_enter())
+            continue;
+
+        while (pmem_get_stats()->free < stats.wmark_high)
+        {
+            n = shrink_groups(RECLAIM_BATCH);
+            if (n < RECLAIM_BATCH)
+                n += shrink_inactive(RECLAIM_BATCH - n);
+            if (n == 0)
+                break;
+        }
+        reclaim_leave();
+    }
+}
+
+/*
+ * Age active pages while the inactive list is smaller.
+ * Pages which were accessed since the last scan stay active.
+ */
+static void age_active(int count)
+{
+    pmem_page_t* desc;
+    bool irq_status;
+
+    irqs_save(&irq_status);
+    while (count-- > 0 && stats.inactive < stats.active)
+    {
+        desc = list_head_page(&active_list);
+        ++stats.scanned;
+
+        if (vmem_test_and_clear_accessed(desc->vaddr))
+            move_tail(desc, &active_list);
+        else
+        {
+            desc->flags &= ~PMEM_ACTIVE;
+            move_tail(desc, &inactive_list);
+            --stats.active;
+            ++stats.inactive;
+        }
+    }
+    irqs_restore(irq_status);
+}
+
+/*
+ * Evict up to count pages from the inactive list.
+ * Every page is looked at once at most.
+ */
+static int shrink_inactive(int count)
+{
+    int reclaimed = 0, scan;
+    pmem_page_t* desc;
+    bool irq_status;
+
+    age_active(count);
+
+    irqs_save(&irq_status);
+    for (scan = stats.inactive; scan > 0 && reclaimed < count && !list_empty(&inactive_list); --scan)
+    {
+        desc = list_head_page(&inactive_list);
+        ++stats.scanned;
+
+        // Accessed --> second chance on the active list
+        if (vmem_test_and_clear_accessed(desc->vaddr))
+        {
+            desc->flags |= PMEM_ACTIVE;
+            move_tail(desc, &active_list);
+            --stats.inactive;
+            ++stats.active;
+            continue;
+        }
+
+        reclaimed += evict(desc, irq_status);
+    }
+    stats.reclaimed += reclaimed;
+    irqs_restore(irq_status);
+
+    return reclaimed;
+}
+
+/*
+ * Evict up to count pages of a group from both lists,
+ * inactive pages first. Pages of other groups are rotated.
+ */
+static int shrink_group(memgroup_t* group, int count)
+{
+    list_t* lists[] = { &inactive_list, &active_list };
+    int reclaimed = 0, i, scan;
+    pmem_page_t* desc;
+    bool irq_status;
+
+    irqs_save(&irq_status);
+    for (i = 0; i < 2; ++i)
+    {
+        scan = (i == 0 ? stats.inactive : stats.active);
+        for (; scan > 0 && reclaimed < count && !list_empty(lists[i]); --scan)
+        {
+            desc = list_head_page(lists[i]);
+            if (desc->memgroup != group)
+            {
+                move_tail(desc, lists[i]);
+                continue;
+            }
+            ++stats.scanned;
+
+            // Accessed --> second chance on the active list
+            if (vmem_test_and_clear_accessed(desc->vaddr))
+            {
+                if (~desc->flags & PMEM_ACTIVE)
+                {
+                    desc->flags |= PMEM_ACTIVE;
+                    --stats.inactive;
+                    ++stats.active;
+                }
+                move_tail(desc, &active_list);
+                continue;
+            }
+
+            if (desc->flags & PMEM_ACTIVE)
+            {
+                desc->flags &= ~PMEM_ACTIVE;
+                --stats.active;
+                ++stats.inactive;
+            }
+            reclaimed += evict(desc, irq_status);
+        }
+    }
+    stats.reclaimed += reclaimed;
+    irqs_restore(irq_status);
+
+    return reclaimed;
+}
+
+// Groups over their soft limit are shrunk first
+static int shrink_groups(int count)
+{
+    int reclaimed = 0, excess, n;
+    memgroup_t* group;
+
+    while (reclaimed < count && (group = memgroup_soft_excess(&excess)))
+    {
+        n = shrink_group(group, min(count - reclaimed, excess));
+        if (n == 0)
+            break;
+        reclaimed += n;
+    }
+
+    return reclaimed;
+}
@@ -1,30 +1,171 @@
+/*
+ * Lock-free byte ring
+ */
 #include <ringbuf.h>
+#include <malloc.h>
+#include <string.h>
+#include <math.h>
+#include <debug.h>
 
-void ringbuf_init(ringbuf_t* buf, size_t size)
+// Distance between two positions
+static inline uint32_t dist(uint32_t a, uint32_t b)
 {
-    buf->__data = (char*)malloc(size);
-    buf->__head = buf->__tail = buf->available = 0;
-    buf->size = size;
+    return (a - b) & RINGBUF_POS_MASK;
 }
 
-bool ringbuf_write(ringbuf_t* buf, int ch)
+void ringbuf_setup(ringbuf_t* rb, void* data, size_t size)
 {
-    if (buf->available == buf->size)
-	return false;
-    buf->__data[buf->__head] = ch;
-    ++buf->available;
-    if (++buf->__head == buf->size)
-	buf->__head = 0;
+    ASSERT(size > 0 && size <= RINGBUF_MAX_SIZE && !(size & (size - 1)));
+
+    rb->data  = data;
+    rb->size  = size;
+    rb->head  = 0;
+    rb->state = 0;
+    rb->tail  = 0;
+}
+
+bool ringbuf_init(ringbuf_t* rb, size_t size)
+{
+    size_t n = 1;
+    void* data;
+
+    while (n < size)
+        n <<= 1;
+    data = malloc(n);
+    if (!data)
+        return false;
+    ringbuf_setup(rb, data, n);
+    return true;
+}
+
+void ringbuf_free(ringbuf_t* rb)
+{
+    free(rb->data);
+    rb->data = NULL;
+    rb->size = 0;
+}
+
+size_t ringbuf_used(const ringbuf_t* rb)
+{
+    return dist(rb->head, rb->tail);
+}
+
+size_t ringbuf_space(const ringbuf_t* rb)
+{
+    return rb->size - dist(rb->head, rb->tail);
+}
+
+// Copy into the ring at pos (may wrap)
+static void copy_in(ringbuf_t* rb, uint32_t pos, const void* buf, size_t n)
+{
+    uint32_t off = pos & (rb->size - 1);
+    size_t first = min(n, rb->size - off);
+
+    memcpy(rb->data + off, buf, first);
+    memcpy(rb->data, (const char*)buf + first, n - first);
+}
+
+size_t ringbuf_write(ringbuf_t* rb, const void* buf, size_t n)
+{
+    uint32_t head = rb->head;
+
+    n = min(n, rb->size - dist(head, rb->tail));
+    copy_in(rb, head, buf, n);
+
+    // Data before the position
+    barrier();
+    rb->head = (head + n) & RINGBUF_POS_MASK;
+    return n;
+}
+
+size_t ringbuf_read(ringbuf_t* rb, void* buf, size_t n)
+{
+    uint32_t tail = rb->tail, off = tail & (rb->size - 1);
+    size_t first;
+
+    n = min(n, dist(rb->head, tail));
+    barrier();
+
+    first = min(n, rb->size - off);
+    memcpy(buf, rb->data + off, first);
+    memcpy((char*)buf + first, rb->data, n - first);
+
+    // Space is released after the copy
+    barrier();
+    rb->tail = (tail + n) & RINGBUF_POS_MASK;
+    return n;
+}
+
+size_t ringbuf_mp_write(ringbuf_t* rb, const void* buf, size_t n)
+{
+    uint32_t state, pos, head;
+
+    if (n == 0 || n > rb->size)
+        return 0;
+
+    // Reserve: advance the position and count the producer
+    do
+    {
+        state = rb->state;
+        pos   = state >> 8;
+        if (rb->size - dist(pos, rb->tail) < n)
+            return 0;
+    }
+    while (!__sync_bool_compare_and_swap(&rb->state, state,
+                                         (((pos + n) & RINGBUF_POS_MASK) << 8) | ((state & 0xFF) + 1)));
+
+    copy_in(rb, pos, buf, n);
+    barrier();
+
+    // Leave, the last producer publishes all reservations
+    do
+        state = rb->state;
+    while (!__sync_bool_compare_and_swap(&rb->state, state, state - 1));
+
+    if ((state & 0xFF) == 1)
+    {
+        // Only forward, a later producer may have published more
+        pos = state >> 8;
+        do
+        {
+            head = rb->head;
+            if ((int)(dist(pos, head) << (32 - RINGBUF_POS_BITS)) <= 0)
+                break;
+        }
+        while (!__sync_bool_compare_and_swap(&rb->head, head, pos));
+    }
+
+    return n;
+}
+
+size_t ringbuf_write_reserve(ringbuf_t* rb, void** p)
+{
+    uint32_t head = rb->head, off = head & (rb->size - 1);
+
+    *p = rb->data + off;
+    return min(rb->size - dist(head, rb->tail), rb->size - off);
 }
 
-int ringbuf_read(ringbuf_t* buf)
+void ringbuf_write_commit(ringbuf_t* rb, size_t n)
 {
-    if (buf->available == 0)
-	return -1;
-    char ch = buf->__data[buf->__tail];
-    --buf->available;
-    if (++buf->__tail == buf->size)
-	buf->__tail = 0;
-    return ch;
+    ASSERT(n <= ringbuf_space(rb));
+    barrier();
+    rb->head = (rb->head + n) & RINGBUF_POS_MASK;
 }
 
+size_t ringbuf_read_reserve(ringbuf_t* rb, const void** p)
+{
+    uint32_t tail = rb->tail, off = tail & (rb->size - 1);
+    size_t n = min(dist(rb->head, tail), rb->size - off);
+
+    barrier();
+    *p = rb->data + off;
+    return n;
+}
+
+void ringbuf_read_commit(ringbuf_t* rb, size_t n)
+{
+    ASSERT(n <= ringbuf_used(rb));
+    barrier();
+    rb->tail = (rb->tail + n) & RINGBUF_POS_MASK;
+}
@@ -0,0 +1,365 @@
+/*
+ * 16550 UART driver
+ */
+#include <serial.h>
+#include <console.h>
+#include <pic.h>
+#include <irq.h>
+#include <idt.h>
+#include <desc.h>
+#include <regs.h>
+#include <io.h>
+#include <asm.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <ringbuf.h>
+
+enum
+{
+    // Registers
+    UART_DATA = 0, // RBR/THR, DLL with DLAB
+    UART_IER  = 1, // Interrupt enable, DLM with DLAB
+    UART_IIR  = 2, // Interrupt identification (read)
+    UART_FCR  = 2, // FIFO control (write)
+    UART_LCR  = 3, // Line control
+    UART_MCR  = 4, // Modem control
+    UART_LSR  = 5, // Line status
+    UART_MSR  = 6, // Modem status
+    UART_SCR  = 7, // Scratch
+
+    // Interrupt enable
+    IER_RDI  = 0x01, // Received data
+    IER_THRI = 0x02, // Transmitter holding register empty
+    IER_RLSI = 0x04, // Receiver line status
+
+    // Interrupt identification
+    IIR_NONE    = 0x01,
+    IIR_ID      = 0x0E,
+    IIR_MSI     = 0x00,
+    IIR_THRI    = 0x02,
+    IIR_RDI     = 0x04,
+    IIR_RLSI    = 0x06,
+    IIR_TIMEOUT = 0x0C,
+    IIR_FIFO    = 0xC0, // FIFO works (16550A)
+
+    // FIFO control: enable, clear both, trigger at 14 bytes
+    FCR_INIT = 0xC7,
+
+    // Line control
+    LCR_8N1  = 0x03,
+    LCR_DLAB = 0x80,
+
+    // Modem control: DTR, RTS, OUT2 (irq enable)
+    MCR_INIT = 0x0B,
+
+    // Line status
+    LSR_DR   = 0x01, // Data ready
+    LSR_OE   = 0x02, // Overrun
+    LSR_THRE = 0x20, // Transmitter holding register empty
+
+    UART_CLOCK = 115200,
+    RING_SIZE  = 4096, // Power of two
+};
+
+typedef struct serial_s
+{
+    uint16_t base;
+    int      irq;
+    bool     present;
+    int      fifo; // Bytes per THRE interrupt
+
+    // Transmit ring (written with irqs disabled), receive
+    // ring (written by the irq handler)
+    ringbuf_t tx, rx;
+    char      tx_data[RING_SIZE];
+    char      rx_data[RING_SIZE];
+
+    serial_stats_t stats;
+} serial_t;
+
+static serial_t ports[SERIAL_PORTS] =
+{
+    { .base = 0x3F8, .irq = IRQ_SERIAL1 },
+    { .base = 0x2F8, .irq = IRQ_SERIAL2 },
+};
+
+// Transmit by polling (panic)
+static bool polled = false;
+
+// Port of the console mirror
+static int console_port = -1;
+
+void irq_serial1();
+void irq_serial2();
+
+static bool valid(int port)
+{
+    return (port >= 0 && port < SERIAL_PORTS && ports[port].present);
+}
+
+static void set_ier(serial_t* s)
+{
+    outb(s->base + UART_IER, IER_RDI | IER_RLSI |
+         (ringbuf_used(&s->tx) && !polled ? IER_THRI : 0));
+}
+
+// Fill the FIFO if the transmitter is empty (irqs disabled)
+static void tx_fill(serial_t* s)
+{
+    char buf[16];
+    int i, n;
+
+    if (!(inb(s->base + UART_LSR) & LSR_THRE))
+        return;
+
+    n = ringbuf_read(&s->tx, buf, s->fifo);
+    for (i = 0; i < n; ++i)
+        outb(s->base + UART_DATA, buf[i]);
+    s->stats.tx += n;
+}
+
+// Wait until the transmitter takes the next bytes (irqs disabled)
+static void tx_wait(serial_t* s)
+{
+    while (!(inb(s->base + UART_LSR) & LSR_THRE))
+        ;
+    tx_fill(s);
+}
+
+static void rx_drain(serial_t* s)
+{
+    uint8_t lsr;
+    char ch;
+
+    while ((lsr = inb(s->base + UART_LSR)) & LSR_DR)
+    {
+        if (lsr & LSR_OE)
+            ++s->stats.overruns;
+        ch = inb(s->base + UART_DATA);
+        if (ringbuf_write(&s->rx, &ch, 1))
+            ++s->stats.rx;
+        else
+            ++s->stats.rx_dropped;
+    }
+}
+
+static void handle_irq(serial_t* s)
+{
+    uint8_t iir;
+
+    while (!((iir = inb(s->base + UART_IIR)) & IIR_NONE))
+    {
+        switch (iir & IIR_ID)
+        {
+        case IIR_RLSI:
+            if (inb(s->base + UART_LSR) & LSR_OE)
+                ++s->stats.overruns;
+            break;
+
+        case IIR_RDI:
+        case IIR_TIMEOUT:
+            rx_drain(s);
+            break;
+
+        case IIR_THRI:
+            tx_fill(s);
+            break;
+
+        case IIR_MSI:
+            inb(s->base + UART_MSR);
+            break;
+        }
+    }
+
+    // Ring empty: no more THRE interrupts
+    set_ier(s);
+}
+
+void do_irq_serial1(const regs_t regs)
+{
+    pic_irq_end(IRQ_SERIAL1);
+    handle_irq(ports + SERIAL_COM1);
+}
+
+void do_irq_serial2(const regs_t regs)
+{
+    pic_irq_end(IRQ_SERIAL2);
+    handle_irq(ports + SERIAL_COM2);
+}
+
+static bool __init probe(serial_t* s)
+{
+    outb(s->base + UART_SCR, 0x5A);
+    if (inb(s->base + UART_SCR) != 0x5A)
+        return false;
+    outb(s->base + UART_SCR, 0xA5);
+    return (inb(s->base + UART_SCR) == 0xA5);
+}
+
+void __init serial_init()
+{
+    static void (*const stubs[])() = { irq_serial1, irq_serial2 };
+    serial_t* s;
+    int i;
+
+    for (i = 0; i < SERIAL_PORTS; ++i)
+    {
+        s = ports + i;
+        if (!probe(s))
+            continue;
+
+        outb(s->base + UART_IER, 0);
+        ringbuf_setup(&s->tx, s->tx_data, RING_SIZE);
+        ringbuf_setup(&s->rx, s->rx_data, RING_SIZE);
+        s->present = true;
+        serial_set_baud(i, SERIAL_BAUD);
+
+        outb(s->base + UART_FCR, FCR_INIT);
+        s->fifo = ((inb(s->base + UART_IIR) & IIR_FIFO) == IIR_FIFO ? 16 : 1);
+        outb(s->base + UART_MCR, MCR_INIT);
+
+        // Clear pending events
+        inb(s->base + UART_LSR);
+        inb(s->base + UART_DATA);
+        inb(s->base + UART_IIR);
+        inb(s->base + UART_MSR);
+
+        idt_set(PIC_INTBASE + s->irq, stubs[i], DESC_TYPE_INT | DESC_PRESENT);
+        pic_irq_enable(s->irq);
+        set_ier(s);
+
+        printf("COM%d: 0x%X, irq %d, %d byte FIFO\n", i + 1, s->base, s->irq, s->fifo);
+    }
+}
+
+bool serial_present(int port)
+{
+    return valid(port);
+}
+
+bool serial_set_baud(int port, int baud)
+{
+    uint16_t divisor;
+    bool irq_status;
+    serial_t* s;
+
+    if (!valid(port) || baud <= 0 || baud > UART_CLOCK)
+        return false;
+
+    s = ports + port;
+    divisor = UART_CLOCK / baud;
+
+    irqs_save(&irq_status);
+    outb(s->base + UART_LCR, LCR_DLAB);
+    outb(s->base + UART_DATA, divisor);
+    outb(s->base + UART_IER, divisor >> 8);
+    outb(s->base + UART_LCR, LCR_8N1);
+    set_ier(s);
+    irqs_restore(irq_status);
+
+    return true;
+}
+
+size_t serial_write(int port, const char* buf, size_t len)
+{
+    bool irq_status;
+    serial_t* s;
+    size_t i = 0;
+
+    if (!valid(port))
+        return 0;
+
+    s = ports + port;
+    irqs_save(&irq_status);
+
+    for (;;)
+    {
+        i += ringbuf_write(&s->tx, buf + i, len - i);
+        if (i == len)
+            break;
+        ++s->stats.tx_waits;
+        tx_wait(s);
+    }
+
+    if (polled)
+    {
+        while (ringbuf_used(&s->tx))
+            tx_wait(s);
+    }
+    else
+    {
+        tx_fill(s);
+        set_ier(s);
+    }
+
+    irqs_restore(irq_status);
+    return len;
+}
+
+size_t serial_read(int port, char* buf, size_t len)
+{
+    if (!valid(port))
+        return 0;
+
+    // Single reader, no locking needed
+    return ringbuf_read(&ports[port].rx, buf, len);
+}
+
+// Console sink: LF as CR LF
+static void console_write(const char* buf, size_t len)
+{
+    const char *p = buf, *end = buf + len, *q;
+
+    while (p < end)
+    {
+        q = memchr(p, '\n', end - p);
+        if (!q)
+        {
+            serial_write(console_port, p, end - p);
+            break;
+        }
+        serial_write(console_port, p, q - p);
+        serial_write(console_port, "\r\n", 2);
+        p = q + 1;
+    }
+}
+
+void serial_console(int port, int vc)
+{
+    if (!valid(port))
+        return;
+    console_port = port;
+    con_set_sink(vc, console_write);
+}
+
+void serial_sync()
+{
+    serial_t* s;
+    int i;
+
+    polled = true;
+    for (i = 0; i < SERIAL_PORTS; ++i)
+    {
+        s = ports + i;
+        if (!s->present)
+            continue;
+        set_ier(s);
+        while (ringbuf_used(&s->tx))
+            tx_wait(s);
+    }
+}
+
+const serial_stats_t* serial_get_stats(int port)
+{
+    return &ports[clamp(port, 0, SERIAL_PORTS - 1)].stats;
+}
+
+void serial_dump_stats(const serial_stats_t* stats)
+{
+    printf("Serial Statistics:\n"
+           " Transmitted: %u bytes (%u waits)\n"
+           " Received:    %u bytes (%u dropped, %u overruns)\n",
+           stats->tx, stats->tx_waits,
+           stats->rx, stats->rx_dropped, stats->overruns);
+}
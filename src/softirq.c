@@ -0,0 +1,179 @@
+/*
+ * Softirqs, tasklets and work queue
+ */
+#include <softirq.h>
+#include <thread.h>
+#include <stdio.h>
+#include <debug.h>
+#include <asm.h>
+
+static void run_tasklets();
+
+static softirq_func_t handlers[SOFTIRQS] =
+{
+    [SOFTIRQ_TASKLET] = run_tasklets,
+};
+
+static volatile uint32_t pending = 0;
+static bool in_softirq = false;
+
+static list_t tasklet_list = LIST_INIT(tasklet_list);
+static list_t work_list = LIST_INIT(work_list);
+static waitqueue_t work_wait = WAITQUEUE_INIT(work_wait);
+
+static softirq_stats_t stats;
+
+void softirq_register(int nr, softirq_func_t func)
+{
+    ASSERT(nr >= 0 && nr < SOFTIRQS);
+    handlers[nr] = func;
+}
+
+void softirq_raise(int nr)
+{
+    bool irq_status;
+
+    irqs_save(&irq_status);
+    pending |= 1 << nr;
+    irqs_restore(irq_status);
+}
+
+// Run the pending softirqs with irqs enabled (called with irqs disabled)
+static void run_softirqs()
+{
+    uint32_t mask;
+    int nr, rounds = 0;
+
+    in_softirq = true;
+    while (pending && rounds++ < SOFTIRQ_RESTARTS)
+    {
+        mask = pending;
+        pending = 0;
+        irqs_enable();
+
+        for (nr = 0; nr < SOFTIRQS; ++nr)
+        {
+            if (mask & (1 << nr))
+            {
+                ++stats.runs[nr];
+                handlers[nr]();
+            }
+        }
+
+        irqs_disable();
+    }
+    in_softirq = false;
+
+    if (pending)
+        ++stats.deferred;
+}
+
+/*
+ * End of an interrupt
+ *    - Softirqs are run only if the interrupted code had
+ *      irqs enabled and wasn't a softirq itself
+ *    - The thread is switched afterwards, a nested irq
+ *      leaves this to the softirq it interrupted
+ */
+void irq_exit(const regs_t regs)
+{
+    if (in_softirq)
+        return;
+    if (pending && (regs.eflags & EFLAGS_IF))
+        run_softirqs();
+    thread_preempt();
+}
+
+bool softirq_running()
+{
+    return in_softirq;
+}
+
+void tasklet_schedule(tasklet_t* t)
+{
+    bool irq_status;
+
+    irqs_save(&irq_status);
+    if (!t->queued)
+    {
+        t->queued = true;
+        list_add(&tasklet_list, &t->list_entry);
+        pending |= 1 << SOFTIRQ_TASKLET;
+    }
+    irqs_restore(irq_status);
+}
+
+// Tasklet softirq, a tasklet may queue itself again
+static void run_tasklets()
+{
+    tasklet_t* t;
+
+    irqs_disable();
+    while (!list_empty(&tasklet_list))
+    {
+        t = LIST_OBJECT(tasklet_list.next, tasklet_t, list_entry);
+        list_delete(&t->list_entry);
+        t->queued = false;
+        irqs_enable();
+
+        ++stats.tasklets;
+        t->func(t->arg);
+
+        irqs_disable();
+    }
+    irqs_enable();
+}
+
+bool queue_work(work_t* w)
+{
+    bool irq_status, queued;
+
+    irqs_save(&irq_status);
+    queued = !w->queued;
+    if (queued)
+    {
+        w->queued = true;
+        list_add(&work_list, &w->list_entry);
+        thread_wakeup(&work_wait);
+    }
+    irqs_restore(irq_status);
+
+    return queued;
+}
+
+// Worker thread, runs the queued work in order
+void __noreturn workqueue_thread()
+{
+    work_t* w;
+
+    for (;;)
+    {
+        irqs_disable();
+        while (list_empty(&work_list))
+            thread_wait(&work_wait, 0);
+        w = LIST_OBJECT(work_list.next, work_t, list_entry);
+        list_delete(&w->list_entry);
+        w->queued = false;
+        irqs_enable();
+
+        ++stats.works;
+        w->func(w->arg);
+    }
+}
+
+const softirq_stats_t* softirq_get_stats()
+{
+    return &stats;
+}
+
+void softirq_dump_stats(const softirq_stats_t* s)
+{
+    printf("Softirq Statistics:\n"
+           " Timer:    %u runs\n"
+           " Tasklet:  %u runs (%u tasklets)\n"
+           " Works:    %u\n"
+           " Deferred: %u irq exits\n",
+           s->runs[SOFTIRQ_TIMER],
+           s->runs[SOFTIRQ_TASKLET], s->tasklets,
+           s->works, s->deferred);
+}
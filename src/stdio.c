@@ -3,16 +3,9 @@
 #include <ctype.h>
 #include <string.h>
 #include <console.h>
-
-// printf states
-enum
-{
-    STATE_NORMAL,    
-    STATE_FLAG,      
-    STATE_WIDTH,
-    STATE_MODIFIER,
-    STATE_TYPE,
-};
+#include <section.h>
+#include <math.h>
+#include <asm.h>
 
 // printf length modifier 
 enum
@@ -21,6 +14,7 @@ enum
     MOD_CHAR,
     MOD_SHORT,
     MOD_LONG,
+    MOD_LLONG,
 };
 
 // printf flags
@@ -34,52 +28,158 @@ enum
     // Internal flags
     FLAG_UNSIGNED  = 0x20,
     FLAG_UPPERCASE = 0x40,
+    FLAG_ARGWIDTH  = 0x80, // Width from the argument list
 };
 
-static char* append_number(char* p, char* end, uint value, int flags, int width, int radix)
+enum
 {
-    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
-    int len = 0, sign = 0;
-    char buf[32], *bufend = buf;
+    FMT_SPECS = 12, // Conversions per compiled chunk
+    FMT_CACHE = 32, // Cached formats (by address)
+};
 
-    ASSERT(radix >= 2 && radix <= 36);
-   
-    if (p >= end)
-        return p;
-    
-    if (flags & FLAG_UNSIGNED)
+/*
+ * Compiled conversion
+ *    - The literal text in front is copied as one run
+ *    - type 0: only the literal (end of the format)
+ */
+typedef struct fmt_spec_s
+{
+    const char* literal;
+    uint16_t    length;
+    char        type;
+    uint8_t     flags;
+    uint8_t     mod;
+    uint8_t     radix;
+    int16_t     width;
+} fmt_spec_t;
+
+/*
+ * Format cache
+ *    - Formats in the kernel text (string constants) are
+ *      compiled once, if they fit into one chunk
+ *    - An entry in use is skipped by nested calls (irqs)
+ */
+typedef struct fmt_cache_s
+{
+    const char* format;
+    bool        busy;
+    int         count;
+    fmt_spec_t  spec[FMT_SPECS];
+} fmt_cache_t;
+
+static fmt_cache_t fmt_cache[FMT_CACHE];
+
+static const char lower_digits[] = "0123456789abcdef";
+static const char upper_digits[] = "0123456789ABCDEF";
+
+// Two decimal digits at once
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Decimal digits in front of q (division by constants is a multiplication)
+static char* format_dec32(char* q, uint32_t value)
+{
+    uint32_t r;
+
+    while (value >= 100)
     {
-        do
-        {
-	    *bufend++ = digits[value % radix];
-            ++len;
-            value /= radix;
-        }
-        while (value);
+        r = (value % 100) * 2;
+        value /= 100;
+        *--q = digit_pairs[r + 1];
+        *--q = digit_pairs[r];
+    }
 
-        if (flags & FLAG_SIGN)
-            sign = '+', ++len;
-        else if (flags & FLAG_SIGNBLANK)
-            sign = ' ', ++len;
+    if (value >= 10)
+    {
+        *--q = digit_pairs[value * 2 + 1];
+        *--q = digit_pairs[value * 2];
     }
     else
+        *--q = '0' + value;
+
+    return q;
+}
+
+// value / 10^9 by two 32 bit divisions, returns the remainder
+static uint32_t div_1e9(uint64_t* value)
+{
+    uint32_t hi = *value >> 32, lo = (uint32_t)*value, rem;
+
+    rem = hi % 1000000000U;
+    hi /= 1000000000U;
+    __asm__ ("divl %4" : "=a" (lo), "=d" (rem) : "0" (lo), "1" (rem), "rm" (1000000000U));
+    *value = ((uint64_t)hi << 32) | lo;
+    return rem;
+}
+
+static char* format_dec(char* q, uint64_t value)
+{
+    char* chunk;
+
+    // Chunks of 9 digits with leading zeros
+    while (value >> 32)
     {
-        if ((int)value < 0)
-            sign = '-', ++len, value = -value;
-        else if (flags & FLAG_SIGN)
-            sign = '+', ++len;
-        else if (flags & FLAG_SIGNBLANK)
-            sign = ' ', ++len;
-        
-        do
-        {
-            *bufend++ = digits[value % radix];
-            ++len;
-            value /= radix;
-        }
-        while (value);
+        chunk = q - 9;
+        q = format_dec32(q, div_1e9(&value));
+        while (q > chunk)
+            *--q = '0';
+    }
+    return format_dec32(q, (uint32_t)value);
+}
+
+// Radix 2, 8 or 16 by shifts
+static char* format_pow2(char* q, uint64_t value, int radix, const char* digits)
+{
+    int shift = (radix == 16 ? 4 : radix == 8 ? 3 : 1);
+    uint32_t v;
+
+    while (value >> 32)
+    {
+        *--q = digits[(uint32_t)value & (radix - 1)];
+        value >>= shift;
+    }
+
+    v = (uint32_t)value;
+    do
+    {
+        *--q = digits[v & (radix - 1)];
+        v >>= shift;
     }
- 
+    while (v);
+
+    return q;
+}
+
+static char* append_number(char* p, char* end, uint64_t value, bool negative, int flags, int width, int radix)
+{
+    char buf[72], *q, *bufend = buf + sizeof (buf);
+    int len, sign = 0, n;
+
+    if (p >= end)
+        return p;
+
+    if (radix == 10)
+        q = format_dec(bufend, value);
+    else
+        q = format_pow2(bufend, value, radix, flags & FLAG_UPPERCASE ? upper_digits : lower_digits);
+    len = bufend - q;
+
+    if (negative)
+        sign = '-', ++len;
+    else if (flags & FLAG_SIGN)
+        sign = '+', ++len;
+    else if (flags & FLAG_SIGNBLANK)
+        sign = ' ', ++len;
+
     if ((flags & FLAG_ZEROPAD) && sign)
         *p++ = sign;
           
@@ -92,17 +192,10 @@ static char* append_number(char* p, char* end, uint value, int flags, int width,
     
     if ((~flags & FLAG_ZEROPAD) && sign && p < end)
         *p++ = sign;
-    
-    if (flags & FLAG_UPPERCASE)
-    {
-        while (p < end && --bufend >= buf)
-            *p++ = toupper(*bufend);
-    }
-    else
-    {
-        while (p < end && --bufend >= buf)
-            *p++ = *bufend;    
-    }
+
+    n = min(bufend - q, end - p);
+    memcpy(p, q, n);
+    p += n;
 
     if (flags & FLAG_LEFT)
     {
@@ -150,190 +243,274 @@ static char* append_char(char* p, char* end, int ch, int flags, int width)
     return p;
 }
 
+// Parse conversion after '%', returns the rest of the format
+static const char* parse_spec(const char* format, fmt_spec_t* spec)
+{
+    spec->flags = 0;
+    spec->width = 0;
+    spec->mod   = MOD_INT;
+    spec->radix = 10;
+
+    for (;; ++format)
+    {
+        switch (*format)
+        {
+        case '-': spec->flags |= FLAG_LEFT;      continue;
+        case '+': spec->flags |= FLAG_SIGN;      continue;
+        case ' ': spec->flags |= FLAG_SIGNBLANK; continue;
+        case '0': spec->flags |= FLAG_ZEROPAD;   continue;
+        default: break;
+        }
+        break;
+    }
+
+    if (*format == '*')
+    {
+        spec->flags |= FLAG_ARGWIDTH;
+        ++format;
+    }
+    else
+    {
+        for (; isdigit(*format); ++format)
+            spec->width = spec->width * 10 + todigit(*format);
+    }
+
+    for (;; ++format)
+    {
+        if (*format == 'l')
+            spec->mod = (spec->mod == MOD_LONG ? MOD_LLONG : MOD_LONG);
+        else if (*format == 'h')
+            spec->mod = (spec->mod == MOD_SHORT ? MOD_CHAR : MOD_SHORT);
+        else if (*format != 'z')
+            break;
+    }
+
+    spec->type = *format;
+    switch (spec->type)
+    {
+    case 'b':
+        spec->radix = 2;
+        spec->flags |= FLAG_UNSIGNED;
+        break;
+
+    case 'o':
+        spec->radix = 8;
+        spec->flags |= FLAG_UNSIGNED;
+        break;
+
+    case 'u':
+        spec->flags |= FLAG_UNSIGNED;
+        break;
+
+    case 'p':
+        spec->flags |= FLAG_ZEROPAD;
+        spec->mod = MOD_INT;
+        // fall through
+
+    case 'X':
+        spec->flags |= FLAG_UPPERCASE;
+        // fall through
+
+    case 'x':
+        spec->radix = 16;
+        spec->flags |= FLAG_UNSIGNED;
+        break;
+
+    case '\0':
+        return format;
+    }
+
+    return format + 1;
+}
+
 /*
- * Simple vsnprintf implementation
- *
- * Supported types: d, i, x, X, p, c, s, o (octal int) and b (binary int)
- * Supported flags: -, +, _blank_, 0
- * Width and length qualifiers are also supported. That's everything.
+ * Compile up to FMT_SPECS conversions, returns the rest
+ * of the format or NULL at the end
  */
+static const char* compile(const char* format, fmt_spec_t* spec, int* count)
+{
+    const char* q;
+    int n = 0;
 
-int vsnprintf(char *buffer, size_t size, const char *format, va_list argptr)
+    while (n < FMT_SPECS)
+    {
+        spec[n].literal = format;
+
+        q = strchr(format, '%');
+        if (!q)
+        {
+            spec[n].length = strlen(format);
+            spec[n].type = '\0';
+            *count = n + 1;
+            return NULL;
+        }
+
+        spec[n].length = q - format;
+        format = parse_spec(q + 1, spec + n);
+        ++n;
+
+        if (!*format)
+            break;
+    }
+
+    *count = n;
+    return (*format ? format : NULL);
+}
+
+// Cached compiled format (locked) or NULL
+static fmt_cache_t* cache_get(const char* format)
 {
-    char *p = buffer, *end = buffer + size;
-    int state = STATE_NORMAL;
-    int flags = 0, width = 0, mod = MOD_INT;
-    char ch;
-    
-    while ((ch = *format++) && p < end)
+    fmt_cache_t* cache = fmt_cache + ((uint32_t)format >> 2) % FMT_CACHE;
+    bool irq_status;
+
+    // Only constant formats, other addresses may be reused
+    if ((uint32_t)format - TEXT_START >= TEXT_SIZE)
+        return NULL;
+
+    irqs_save(&irq_status);
+    if (cache->busy)
+        cache = NULL;
+    else
+        cache->busy = true;
+    irqs_restore(irq_status);
+
+    if (!cache || cache->format == format)
+        return cache;
+
+    // Formats with too many conversions aren't cached
+    cache->format = NULL;
+    if (compile(format, cache->spec, &cache->count))
     {
-        switch (state)
+        cache->busy = false;
+        return NULL;
+    }
+    cache->format = format;
+    return cache;
+}
+
+static char* execute(char* p, char* end, const fmt_spec_t* spec, int count, va_list* args)
+{
+    const fmt_spec_t* last = spec + count;
+    uint64_t value;
+    bool negative;
+    int width, flags, n;
+
+    for (; spec < last && p < end; ++spec)
+    {
+        n = min(spec->length, end - p);
+        memcpy(p, spec->literal, n);
+        p += n;
+        if (p >= end)
+            break;
+
+        flags = spec->flags;
+        width = spec->width;
+        if (flags & FLAG_ARGWIDTH)
         {
-        /*
-         * Normal string processing
-         */
-        case STATE_NORMAL:
-            if (ch != '%')
-            {
-                *p++ = ch;
-                break;
-            }
-            flags = width = 0;
-            mod = MOD_INT;
-            state = STATE_FLAG;
+            width = va_arg(*args, int);
+            if (width < 0)
+                width = -width, flags |= FLAG_LEFT;
+        }
+
+        switch (spec->type)
+        {
+        case 's':
+            p = append_string(p, end, va_arg(*args, const char*), flags, width);
+            continue;
+
+        case 'c':
+            p = append_char(p, end, va_arg(*args, int), flags, width);
+            continue;
+
+        case '%':
+            *p++ = '%';
+            continue;
+
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'b':
+        case 'o':
+        case 'p':
+        case 'X':
+        case 'x':
             break;
-        
-        /*
-         * Process flags
-         */
-        case STATE_FLAG:
-            switch (ch)
-            {
-            case '-': flags |= FLAG_LEFT; continue;
-            case '+': flags |= FLAG_SIGN; continue;
-            case ' ': flags |= FLAG_SIGNBLANK; continue;
-            case '0': flags |= FLAG_ZEROPAD; continue;
-            default: break;
-            }
-            state = STATE_WIDTH;
-            // fall through
 
-        /*
-         * Process width field
-         */
-        case STATE_WIDTH:
-            if (isdigit(ch))
-            {
-                width = width * 10 + todigit(ch);
-                break;
-            }
-            if (ch == '*')
-            {
-                width = va_arg(argptr, int);
-                if (width < 0)
-                {
-                    width = -width;
-                    flags |= FLAG_LEFT;
-                }
-                state = STATE_TYPE;
-                break;
-            }
-            state = STATE_MODIFIER;
-            // fall through
+        default:
+            continue;
+        }
 
         /*
-         * Process length modifier
+         * Numeric types
          */
-        case STATE_MODIFIER:
-            switch (ch)
-            {
-            case 'l':
-                mod = MOD_LONG;
-                continue;
-
-            case 'h':
-                mod = mod == MOD_SHORT ? MOD_CHAR : MOD_SHORT;
-                continue;
-
-            default:
-                break;
-            }       
-            state = STATE_TYPE;
-            // fall through     
-     
-        /*
-         * Process type
-         */       
-        case STATE_TYPE:
-        {
-            int value;
-            int radix;
 
-            state = STATE_NORMAL;
-            
-            /*
-             * All types
-             */
-            
-            switch (ch)
-            {
-            case 'd':
-            case 'i':
-                radix = 10;
-                break;
-                
-            case 'b':
-                radix = 2;
-                flags |= FLAG_UNSIGNED;
-                break;
-
-            case 'o':
-                radix = 8;
-                flags |= FLAG_UNSIGNED;
-                break;
-                
-            case 'u':
-                radix = 10;
-                flags |= FLAG_UNSIGNED;
-                break;
-                
-            case 'p':
-                flags |= FLAG_ZEROPAD;
-                mod = MOD_INT;
-                // fall through
-            
-            case 'X':
-                flags |= FLAG_UPPERCASE;
-                
-            case 'x':
-                radix = 16;
-                flags |= FLAG_UNSIGNED;
-                break;
-                
-            case 's':
-                p = append_string(p, end, va_arg(argptr, const char*), flags, width); 
-                continue;
-               
-            case 'c':
-                p = append_char(p, end, va_arg(argptr, int), flags, width);
-                continue;
-            
-            case '%':
-                *p++ = '%';
-                continue;
-            
-            default:
-                continue;
-            }
-            
-            /*
-             * Numeric type
-             */
-             
-            switch (mod)
-            {
-            case MOD_CHAR:
-                value = (char)va_arg(argptr, int);
-                break;
-                
-            case MOD_SHORT:
-                value = (short)va_arg(argptr, int);
-                break;
-                
-            default:
-                value = va_arg(argptr, int);
-                break;
-            }
-            
-            p = append_number(p, end, value, flags, width, radix);
-            break;
+        negative = false;
+        if (spec->mod == MOD_LLONG)
+        {
+            value = va_arg(*args, uint64_t);
+            if ((~flags & FLAG_UNSIGNED) && (llong)value < 0)
+                value = -value, negative = true;
+        }
+        else
+        {
+            uint32_t v = va_arg(*args, uint32_t);
+            if (spec->mod == MOD_CHAR)
+                v = (flags & FLAG_UNSIGNED ? (uint8_t)v : (uint32_t)(char)v);
+            else if (spec->mod == MOD_SHORT)
+                v = (flags & FLAG_UNSIGNED ? (uint16_t)v : (uint32_t)(short)v);
+            if ((~flags & FLAG_UNSIGNED) && (int)v < 0)
+                v = -v, negative = true;
+            value = v;
         }
 
-        default:
-            break;
+        p = append_number(p, end, value, negative, flags, width, spec->radix);
+    }
+
+    return p;
+}
+
+/*
+ * vsnprintf implementation
+ *
+ * Supported types: d, i, u, x, X, p, c, s, o (octal int) and b (binary int)
+ * Supported flags: -, +, _blank_, 0
+ * Width (also *) and length qualifiers (hh, h, l, ll, z) are also supported.
+ *
+ * The format is compiled into literal runs and conversions,
+ * constant formats only once (see fmt_cache_t).
+ */
+
+int vsnprintf(char *buffer, size_t size, const char *format, va_list argptr)
+{
+    char *p = buffer, *end = buffer + size;
+    fmt_spec_t spec[FMT_SPECS];
+    fmt_cache_t* cache;
+    va_list args;
+    int count;
+
+    if (size == 0)
+        return 0;
+
+    va_copy(args, argptr);
+
+    cache = cache_get(format);
+    if (cache)
+    {
+        p = execute(p, end, cache->spec, cache->count, &args);
+        cache->busy = false;
+    }
+    else
+    {
+        do
+        {
+            format = compile(format, spec, &count);
+            p = execute(p, end, spec, count, &args);
         }
+        while (format && p < end);
     }
     
+    va_end(args);
+
     if (p < end)
         *p = 0;
         
@@ -377,11 +554,9 @@ int putchar(int ch)
 
 int con_vprintf(int vc, const char* format, va_list argptr)
 {
-    char buffer[1024], *p;
+    char buffer[1024];
     int n = vsnprintf(buffer, sizeof(buffer), format, argptr);
-    buffer[n >= sizeof (buffer) ? sizeof (buffer) - 1 : n] = 0;
-    for (p = buffer; p < buffer + n; ++p)
-        con_putchar(vc, *p);
+    con_write(vc, buffer, n);
     return n;
 }
 
@@ -397,9 +572,8 @@ int con_printf(int vc, const char* format, ...)
 
 int con_puts(int vc, const char* str)
 {
-    const char*p = str;
-    while (*p) 
-        con_putchar(vc, *p++);
-    con_putchar(vc, '\n');
-    return (p - str);
+    size_t len = strlen(str);
+    con_write(vc, str, len);
+    con_write(vc, "\n", 1);
+    return len;
 }
@@ -3,17 +3,58 @@
 #include <types.h>
 #include <bitmap.h>
 #include <malloc.h>
+#include <math.h>
+
+/*
+ * Word at a time
+ *    - Aligned words never cross a page boundary, so
+ *      reading a whole word past the end of a string
+ *      can't fault
+ *    - has_zero() is non-zero if one of the bytes is zero
+ */
+
+enum
+{
+    WORD_SIZE = sizeof (ulong),
+
+    // Haystacks shorter than this are searched without skip table
+    STRSTR_MIN = 64,
+};
+
+static const ulong ONES  = 0x01010101UL;
+static const ulong HIGHS = 0x80808080UL;
+
+static inline ulong has_zero(ulong w)
+{
+    return (w - ONES) & ~w & HIGHS;
+}
+
+// Byte in every position of a word
+static inline ulong repeat(int c)
+{
+    return (unsigned char)c * ONES;
+}
+
+static inline bool is_aligned(const void *p)
+{
+    return !((ulong)p & (WORD_SIZE - 1));
+}
 
 static inline void map_init(ulong* map, const char* delim)
 {
     memset(map, 0, 32);
     while (*delim)
     {
-        bitmap_setbit(map, *delim);
+        bitmap_setbit(map, (unsigned char)*delim);
         ++delim;
     }
 }
 
+static inline int map_test(const ulong* map, char c)
+{
+    return bitmap_getbit(map, (unsigned char)c);
+}
+
 /*
  * POSIX buffer routines
  */
@@ -32,138 +73,132 @@ void *memccpy(void *dest, const void *src, int c, size_t count)
     return NULL;
 }
 
-int memcmp(const void *a, const void *b, size_t count)
+void *memchr(const void *buf, int c, size_t count)
 {
-    const char *p = (const char *)a, *q = (const char *)b;
-    int res;
-    while (count--)
-        if (res = (*p++ - *q++))
-            return res;
-    return 0;
-}
+    const unsigned char *p = (const unsigned char *)buf;
+    const ulong *w;
+    ulong r = repeat(c);
 
-void *memcpy(void *dest, const void *src, size_t count)
-{
-    char *p = (char *)dest;
-    const char *q = (const char *)src;
-    while (count--)
-        *p++ = *q++;
-    return dest;
-}
+    for (; count > 0 && !is_aligned(p); --count, ++p)
+    {
+        if (*p == (unsigned char)c)
+            return ((void *)p);
+    }
 
-void *memset(void *buf, int c, size_t count)
-{
-    char *p = (char *)buf;
-    while (count--)
-        *p++ = c;
-    return buf;
-}
+    for (w = (const ulong *)p; count >= WORD_SIZE && !has_zero(*w ^ r); count -= WORD_SIZE)
+        ++w;
 
-void *memchr(const void *buf, int c, size_t count)
-{
-    const char *p = (const char *)buf;
-    while (count--)
+    for (p = (const unsigned char *)w; count > 0; --count, ++p)
     {
-        if (*p == (char)c)
-            return ((void*)p);
-        ++p;
+        if (*p == (unsigned char)c)
+            return ((void *)p);
     }
     return NULL;
 }
 
-void *memmove(void *dest, const void *src, size_t count)
-{
-    if (dest < src)
-        return memcpy(dest, src, count);
-    char *p = (char *)dest + count - 1;
-    const char *q = (const char *)src + count - 1;
-    while (count--)
-        *p-- = *q--;
-    return dest;
-}
-
 /*
  * POSIX string routines
  */
 
 char *strcat(char *dest, const char *src)
 {
-    char *p = dest;
-    while (*p)
-        ++p;
-    while (*p++ = *src++);
+    strcpy(dest + strlen(dest), src);
     return dest;
 }
 
 char *strchr(const char *str, int c)
 {
-    while (*str)
+    const ulong *w;
+    ulong r = repeat(c);
+
+    for (; !is_aligned(str); ++str)
     {
         if (*str == (char)c)
             return ((char *)str);
-        ++str;
+        if (!*str)
+            return NULL;
     }
-    return NULL;
+
+    // Word with c or the end
+    for (w = (const ulong *)str; !has_zero(*w) && !has_zero(*w ^ r); ++w);
+
+    for (str = (const char *)w; *str != (char)c; ++str)
+    {
+        if (!*str)
+            return NULL;
+    }
+    return ((char *)str);
 }
 
 int strcmp(const char *a, const char *b)
 {
-    int res = -1;
-    while (*a)
-        if (res = (*a++ - *b++))
-            break;
-    return res;
+    const ulong *p, *q;
+
+    // Words at once if both strings have the same alignment
+    if (is_aligned((const void *)((ulong)a ^ (ulong)b)))
+    {
+        for (; !is_aligned(a); ++a, ++b)
+        {
+            if (*a != *b || !*a)
+                return ((unsigned char)*a - (unsigned char)*b);
+        }
+
+        for (p = (const ulong *)a, q = (const ulong *)b; *p == *q && !has_zero(*p); ++p, ++q);
+        a = (const char *)p;
+        b = (const char *)q;
+    }
+
+    while (*a && *a == *b)
+        ++a, ++b;
+    return ((unsigned char)*a - (unsigned char)*b);
 }
 
 char *strcpy(char *dest, const char *src)
 {
-    char *p = dest;
-    while (*p++ = *src++);
-    return dest;
+    return memcpy(dest, src, strlen(src) + 1);
 }
 
 size_t strcspn(const char *str, const char *delim)
 {
     ulong map[BITS_TO_LONGS(256)];
-    int len = 0;
+    const char *p = str;
     map_init(map, delim);
-    while (*str)
-    {
-        if (bitmap_getbit(map, *str))
-            return len;
-        ++str;
-        ++len;
-    }
-    return 0;
+    while (*p && !map_test(map, *p))
+        ++p;
+    return p - str;
 }
 
 size_t strlen(const char *str)
 {
-    size_t len = 0;
-    while (*str++)
-        ++len;
-    return len;
+    const char *p = str;
+    const ulong *w;
+
+    for (; !is_aligned(p); ++p)
+    {
+        if (!*p)
+            return p - str;
+    }
+
+    for (w = (const ulong *)p; !has_zero(*w); ++w);
+
+    for (p = (const char *)w; *p; ++p);
+    return p - str;
 }
 
 char *strncat(char *dest, const char *src, size_t count)
 {
-    char *p = dest;
-    while (*p)
-        ++p;
-    while (count--)
-        if ((*p++ = *src++) != '\0')
-            return dest;
+    char *p = dest + strlen(dest);
+    while (count-- && *src)
+        *p++ = *src++;
     *p = '\0';
     return dest;
 }
 
 int strncmp(const char *a, const char *b, size_t count)
 {
-    int res = -1;
-    while (--count && *a)
-        if (res = *a++ - *b++)
-            break;
-    return res;
+    for (; count > 0 && *a && *a == *b; --count)
+        ++a, ++b;
+    return (count > 0 ? (unsigned char)*a - (unsigned char)*b : 0);
 }
 
 // Warning!!! Non-standard strncpy which always adds '\0'
@@ -178,64 +213,81 @@ char *strncpy(char *dest, const char *src, size_t count)
 
 char *strpbrk(const char *str, const char *delim)
 {
-    ulong map[BITS_TO_LONGS(256)];
-    map_init(map, delim);
-    while (*str)
-    {
-        if (bitmap_getbit(map, *str))
-            return ((char *)str);
-        ++str;
-    }
-    return NULL;
+    str += strcspn(str, delim);
+    return (*str ? (char *)str : NULL);
 }
 
 char *strrchr(const char *str, int c)
 {
-    while (*str)
-        ++str;
-    do
-    {
-        if (*str == (char)c)
-            return ((char *)str);
-        --str;
-    } while (*str);
-    return NULL;
+    const char *last = NULL;
+    if (!(char)c)
+        return ((char *)str + strlen(str));
+    for (; (str = strchr(str, c)); ++str)
+        last = str;
+    return ((char *)last);
 }
 
 size_t strspn(const char *str, const char *delim)
 {
     ulong map[BITS_TO_LONGS(256)];
-    int len = 0;
+    const char *p = str;
     map_init(map, delim);
-    while (*str)
-    {
-        if (!bitmap_getbit(map, *str))
-            return len;
-        ++str;
-        ++len;
-    }
-    return 0;
+    while (*p && map_test(map, *p))
+        ++p;
+    return p - str;
 }
 
-char *strstr(const char *a, const char *b)
+/*
+ * Boyer-Moore-Horspool search
+ *    - The last byte of the window selects the shift
+ *    - Shifts are limited to 255 (still correct for
+ *      longer patterns, only slower)
+ *    - Short haystacks are searched from the candidates
+ *      of strchr(), the skip table isn't worth it
+ */
+char *strstr(const char *str, const char *pattern)
 {
-    // FIXME: Replace this fucking slow brute-force version with boyer-more
-    while (*a)
+    const unsigned char *p, *end;
+    size_t len = strlen(pattern), size, i;
+    unsigned char skip[256], last;
+
+    if (len <= 1)
+        return (len ? strchr(str, *pattern) : (char *)str);
+
+    size = strlen(str);
+    if (size < len)
+        return NULL;
+
+    if (size < STRSTR_MIN)
     {
-        const char *p = a, *q = b;
-        while (*p && *q && *p == *q)
-            ++p, ++q;
-        if (*q == '\0')
-            return ((char *)a);
-        ++a;
+        for (; (str = strchr(str, *pattern)) && strlen(str) >= len; ++str)
+        {
+            if (!memcmp(str, pattern, len))
+                return ((char *)str);
+        }
+        return NULL;
+    }
+
+    memset(skip, min(len, 255), sizeof (skip));
+    for (i = 0; i < len - 1; ++i)
+        skip[(unsigned char)pattern[i]] = min(len - 1 - i, 255);
+
+    last = pattern[len - 1];
+    end  = (const unsigned char *)str + size - len;
+    for (p = (const unsigned char *)str; p <= end; p += skip[p[len - 1]])
+    {
+        if (p[len - 1] == last && !memcmp(p, pattern, len - 1))
+            return ((char *)p);
     }
     return NULL;
 }
 
 char* strdup(const char* s)
 {
-    char* s2 = malloc(strlen(s));
-    strcpy(s2, s);
+    size_t len = strlen(s) + 1;
+    char* s2 = malloc(len);
+    if (s2)
+        memcpy(s2, s, len);
     return s2;
 }
 
@@ -245,11 +297,9 @@ char* strdup(const char* s)
 
 int stricmp(const char *a, const char *b)
 {
-    int res = -1;
-    while (*a)
-        if (res = tolower(*a++) - tolower(*b++))
-            break;
-    return res;
+    while (*a && tolower(*a) == tolower(*b))
+        ++a, ++b;
+    return (tolower(*a) - tolower(*b));
 }
 
 char *strlwr(char *str)
@@ -265,11 +315,9 @@ char *strlwr(char *str)
 
 int strnicmp(const char *a, const char *b, size_t count)
 {
-    int res = -1;
-    while (--count && *a)
-        if (res = tolower(*a++) - tolower(*b++))
-            break;
-    return res;
+    for (; count > 0 && *a && tolower(*a) == tolower(*b); --count)
+        ++a, ++b;
+    return (count > 0 ? tolower(*a) - tolower(*b) : 0);
 }
 
 char *strsep(char **str, const char *delim)
@@ -281,7 +329,7 @@ char *strsep(char **str, const char *delim)
     {
         if (*token == '\0')
             return NULL;
-        if (!bitmap_getbit(map, *token))
+        if (!map_test(map, *token))
             break;
         ++token;
     }
@@ -290,7 +338,7 @@ char *strsep(char **str, const char *delim)
     {
         if (**str == '\0')
             return token;
-        if (bitmap_getbit(map, **str))
+        if (map_test(map, **str))
             break;
         ++(*str);
     }
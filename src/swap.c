@@ -0,0 +1,340 @@
+#include <swap.h>
+#include <blkdev.h>
+#include <reclaim.h>
+#include <vmem.h>
+#include <pmem.h>
+#include <bitmap.h>
+#include <malloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <debug.h>
+#include <thread.h>
+#include <asm.h>
+
+enum
+{
+    SECTORS_PER_PAGE = PAGE_SIZE / BLKDEV_SECTOR_SIZE,
+
+    // Adjacent pages written and read at once
+    SWAP_CLUSTER   = 8,
+    SWAP_READAHEAD = 8,
+
+    // Signature at the end of the first page
+    SWAP_SIG_OFFSET = PAGE_SIZE - 10,
+};
+
+// Swap statistics
+static swap_stats_t stats;
+
+static blkdev_t* swap_dev = NULL;
+
+/*
+ * Slot map
+ *    - One bit for each page of the swap area
+ *    - 1 if slot is free
+ *    - Slot n is stored in page n + 1 (page 0 is the header)
+ *    - Searched from the last allocation, so clusters
+ *      of following pageouts are adjacent too
+ */
+
+static ulong* slot_map;
+static int    next_slot = 0;
+
+// Faults on locked entries wait for the swap-in
+static waitqueue_t swapin_wait = WAITQUEUE_INIT(swapin_wait);
+
+static int swap_pageout(pmem_page_t*);
+static int alloc_slots(int);
+static pmem_page_t* cluster_page(uint32_t);
+
+static inline uint32_t slot_to_sector(uint32_t slot)
+{
+    return (slot + 1) * SECTORS_PER_PAGE;
+}
+
+void __init swap_init()
+{
+    char sector[BLKDEV_SECTOR_SIZE];
+    blkdev_t* dev;
+    int i;
+
+    for (i = 0; (dev = blkdev_get(i)) != NULL; ++i)
+    {
+        if (dev->sectors < 2 * SECTORS_PER_PAGE)
+            continue;
+        if (!blkdev_read(dev, SWAP_SIG_OFFSET / BLKDEV_SECTOR_SIZE, 1, sector))
+            continue;
+        if (!memcmp(sector + SWAP_SIG_OFFSET % BLKDEV_SECTOR_SIZE, "SWAPSPACE2", 10))
+            break;
+    }
+
+    if (!dev)
+    {
+        puts(" No swap device");
+        return;
+    }
+
+    stats.total = dev->sectors / SECTORS_PER_PAGE - 1;
+    slot_map = (ulong*)malloc(BITS_TO_LONGS(stats.total) * sizeof (ulong));
+    bitmap_setbits(slot_map, 0, stats.total);
+
+    swap_dev = dev;
+    reclaim_set_pageout(swap_pageout);
+    printf(" Swap on %s: %dK\n", dev->name, stats.total << 2);
+}
+
+const swap_stats_t* swap_get_stats()
+{
+    return &stats;
+}
+
+// Swap statistics
+void swap_dump_stats(const swap_stats_t* stats)
+{
+    printf("Swap Statistics:\n"
+           " Total:     %dK\n"
+           " Used:      %dK\n"
+           " Pageouts:  %d\n"
+           " Pageins:   %d (%d readahead)\n"
+           " Errors:    %d\n",
+           stats->total << 2, stats->used << 2,
+           stats->pageouts, stats->pageins, stats->readahead,
+           stats->errors);
+}
+
+/*
+ * Read swapped page back. Following pages which were swapped
+ * out to the following slots (by clustering) are read too.
+ *    - The entries are locked (PAGE_LOCKED) during the I/O,
+ *      which runs with the irqs of the caller
+ *    - Faults on locked entries wait until the reader is done
+ *    - Entries which were unmapped meanwhile aren't mapped again
+ */
+bool swap_in(uint32_t addr)
+{
+    uint32_t slot, next;
+    int i, n, flags, done = 0;
+    bool irq_status, ok;
+    paddr_t page;
+    void* map;
+
+    irqs_save(&irq_status);
+
+    if (!vmem_get_swap(addr, &slot, &flags))
+    {
+        irqs_restore(irq_status);
+        return false;
+    }
+
+    // Read by another thread --> retry the access afterwards
+    if (flags & PAGE_LOCKED)
+    {
+        thread_wait(&swapin_wait, 0);
+        irqs_restore(irq_status);
+        return true;
+    }
+
+    // Readahead window
+    vmem_lock_swap(addr, true);
+    for (n = 1; n < SWAP_READAHEAD && addr + n * PAGE_SIZE != 0; ++n)
+    {
+        if (!vmem_get_swap(addr + n * PAGE_SIZE, &next, &flags) ||
+            next != slot + n || (flags & PAGE_LOCKED))
+            break;
+        vmem_lock_swap(addr + n * PAGE_SIZE, true);
+    }
+
+    irqs_restore(irq_status);
+
+    for (i = 0; i < n; ++i)
+    {
+        page = pmem_alloc_page();
+        if (page == BAD_PAGE)
+            break;
+
+        map = vmem_kmap(page);
+        ok = blkdev_read(swap_dev, slot_to_sector(slot + i), SECTORS_PER_PAGE, map);
+        vmem_kunmap(map);
+
+        if (!ok)
+        {
+            ++stats.errors;
+            pmem_free_page(page);
+            break;
+        }
+
+        irqs_save(&irq_status);
+        if (vmem_get_swap(addr + i * PAGE_SIZE, &next, &flags) &&
+            next == slot + i && (flags & PAGE_LOCKED))
+        {
+            vmem_swap_in(addr + i * PAGE_SIZE, page);
+            swap_free(slot + i);
+            ++done;
+        }
+        else
+            pmem_free_page(page);
+        irqs_restore(irq_status);
+    }
+
+    // Entries which weren't read stay swapped
+    irqs_save(&irq_status);
+    for (; i < n; ++i)
+    {
+        if (vmem_get_swap(addr + i * PAGE_SIZE, &next, &flags) &&
+            next == slot + i && (flags & PAGE_LOCKED))
+            vmem_lock_swap(addr + i * PAGE_SIZE, false);
+    }
+    stats.pageins += done;
+    stats.readahead += max(done - 1, 0);
+    thread_wakeup(&swapin_wait);
+    irqs_restore(irq_status);
+
+    return (done > 0);
+}
+
+void swap_free(uint32_t slot)
+{
+    bool irq_status;
+
+    ASSERT(!bitmap_getbit(slot_map, slot));
+
+    irqs_save(&irq_status);
+    bitmap_setbit(slot_map, slot);
+    --stats.used;
+    irqs_restore(irq_status);
+}
+
+// Page still mapped at addr (besides the reference of the reclaim)?
+static bool mapped(const pmem_page_t* desc, uint32_t addr, int mask)
+{
+    int flags;
+
+    return (desc->count == 2 &&
+            vmem_get_page(addr, &flags) == pmem_page_address(desc) &&
+            (flags & (PAGE_ANON | PAGE_KSM | mask)) == PAGE_ANON);
+}
+
+/*
+ * Pageout function of the reclaim scanner. Following inactive
+ * pages are isolated too and written to adjacent slots.
+ *    - The dirty bits are cleared before the I/O, pages which
+ *      are written or unmapped meanwhile aren't swapped out
+ *    - Each page is written from a temporary mapping, the
+ *      virtual range may be freed during the I/O
+ */
+static int swap_pageout(pmem_page_t* desc)
+{
+    pmem_page_t* pages[SWAP_CLUSTER];
+    uint32_t addr = desc->vaddr;
+    int i, n = 1, slot = -1, freed = 0;
+    bool irq_status, ok = true;
+    void* map;
+
+    irqs_save(&irq_status);
+
+    pages[0] = desc;
+    if (mapped(desc, addr, 0))
+    {
+        for (; n < SWAP_CLUSTER && (pages[n] = cluster_page(addr + n * PAGE_SIZE)); ++n)
+            reclaim_isolate(pages[n]);
+
+        slot = alloc_slots(n);
+        if (slot < 0 && n > 1)
+        {
+            while (n > 1)
+                freed += reclaim_putback(pages[--n]);
+            slot = alloc_slots(1);
+        }
+    }
+
+    if (slot < 0)
+    {
+        freed += reclaim_putback(desc);
+        irqs_restore(irq_status);
+        return freed;
+    }
+
+    for (i = 0; i < n; ++i)
+        vmem_clear_dirty(addr + i * PAGE_SIZE);
+
+    irqs_restore(irq_status);
+
+    for (i = 0; i < n && ok; ++i)
+    {
+        map = vmem_kmap(pmem_page_address(pages[i]));
+        ok = blkdev_write(swap_dev, slot_to_sector(slot + i), SECTORS_PER_PAGE, map);
+        vmem_kunmap(map);
+    }
+    if (!ok)
+        ++stats.errors;
+
+    // The pages are freed by reclaim_putback() after the swap out
+    irqs_save(&irq_status);
+    for (i = 0; i < n; ++i)
+    {
+        if (ok && mapped(pages[i], addr + i * PAGE_SIZE, PAGE_DIRTY))
+        {
+            vmem_swap_out(addr + i * PAGE_SIZE, slot + i);
+            ++stats.pageouts;
+        }
+        else
+            swap_free(slot + i);
+        freed += reclaim_putback(pages[i]);
+    }
+    irqs_restore(irq_status);
+
+    return freed;
+}
+
+// Allocate n adjacent slots (-1 if there are none)
+static int alloc_slots(int n)
+{
+    int slot = next_slot, tries, run = 0;
+
+    for (tries = 0; tries < stats.total; ++tries, ++slot)
+    {
+        // Runs don't wrap around
+        if (slot == stats.total)
+        {
+            slot = 0;
+            run = 0;
+        }
+
+        if (!bitmap_getbit(slot_map, slot))
+        {
+            run = 0;
+            continue;
+        }
+
+        if (++run == n)
+        {
+            slot -= n - 1;
+            bitmap_clearbits(slot_map, slot, n);
+            next_slot = slot + n;
+            stats.used += n;
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// Page at addr which can join a cluster (cold, inactive and pageable)
+static pmem_page_t* cluster_page(uint32_t addr)
+{
+    pmem_page_t* desc;
+    paddr_t page;
+    int flags;
+
+    if (addr == 0)
+        return NULL;
+
+    page = vmem_get_page(addr, &flags);
+    if (page == BAD_PAGE || (flags & (PAGE_ANON | PAGE_ACCESSED)) != PAGE_ANON)
+        return NULL;
+
+    desc = pmem_get_page(page);
+    if (desc && desc->count == 1 && desc->vaddr == addr &&
+        (desc->flags & (PMEM_LRU | PMEM_ACTIVE)) == PMEM_LRU)
+        return desc;
+    return NULL;
+}
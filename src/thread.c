@@ -4,6 +4,8 @@
 #include <regs.h>
 #include <asm.h>
 #include <malloc.h>
+#include <vmalloc.h>
+#include <memgroup.h>
 #include <string.h>
 #include <section.h>
 #include <console.h>
@@ -33,13 +35,17 @@ static runqueue_t runqueue[2],
 thread_t *curr_thread = NULL,
          *last_fp_thread = NULL;
 
+// Set by thread_tick(), the switch is done by thread_preempt()
+static bool need_resched = false;
+
 // System TSS (for task switches over privilege boundaries)
 tss_t system_tss;
 
-void thread_restore();
+void thread_restore() __noreturn;
 void thread_switch(thread_t*);
 static thread_t* thread_schedule();
 static void wakeup_thread(void*);
+static void wait_timeout(void*);
 
 static inline list_t* get_pid_list(int pid)
 {
@@ -97,8 +103,9 @@ void __init thread_init()
 
 void thread_create(func_t addr, const char* name)
 {
+    void* stack = vmalloc(THREAD_STACK_SIZE);
+    uint32_t* esp = (uint32_t*)((char*)stack + THREAD_STACK_SIZE);
     thread_t* t;
-    uint32_t* esp = (uint32_t*)((char*)malloc(4096) + 4096);
 
     *(--esp) = EFLAGS_IF;
     *(--esp) = KERNEL_CS; // cs
@@ -106,7 +113,8 @@ void thread_create(func_t addr, const char* name)
     esp -= 13;            // error_code, int_nr, eax, ebx, ecx, edx, ebp, esi, edi, ds, es, fs, gs
 
     t = calloc(sizeof (thread_t));
-    t->esp  = esp;
+    t->stack = stack;
+    t->esp   = esp;
     t->esp0 = 42; // No kernel stack used. Thread running with level 0.
                   // So this value is never used.
                   // This value is written to system tss and and
@@ -121,6 +129,9 @@ void thread_create(func_t addr, const char* name)
     list_init(&t->children_list);
     t->parent = curr_thread;
 
+    if (curr_thread->memgroup)
+        memgroup_attach(t, curr_thread->memgroup);
+
     critical_enter();
 
     // Add new thread
@@ -163,9 +174,60 @@ void thread_sleep2(int ticks)
     critical_leave();
 }
 
-// TODO: Stack freen
+// Wait in the queue until thread_wakeup() or
+// until the ticks expire (0 waits forever)
+void thread_wait(waitqueue_t* q, int ticks)
+{
+    bool irq_status;
+
+    ASSERT(curr_thread != &idle_thread);
+
+    irqs_save(&irq_status);
+
+    list_add(&q->list, &curr_thread->wait_entry);
+    curr_thread->wait_timer = (ticks > 0 ? timer_add(wait_timeout, curr_thread, ticks) : NULL);
+
+    dequeue_thread(active, curr_thread);
+    curr_thread->state = THREAD_STATE_SLEEP;
+
+    thread_switch(thread_schedule());
+
+    irqs_restore(irq_status);
+}
+
+// Wake up all threads in the queue
+void thread_wakeup(waitqueue_t* q)
+{
+    bool irq_status;
+    thread_t* t;
+
+    irqs_save(&irq_status);
+    while (!list_empty(&q->list))
+    {
+        t = LIST_OBJECT(q->list.next, thread_t, wait_entry);
+        list_delete(&t->wait_entry);
+        if (t->wait_timer)
+            timer_remove(t->wait_timer);
+        t->wait_timer = NULL;
+        wakeup_thread(t);
+    }
+    irqs_restore(irq_status);
+}
+
 void thread_exit()
 {
+    // Stack of the last exited thread
+    static void* dead_stack = NULL;
+    void* stack;
+
+    // Own stack is still in use, it's freed by the next exit
+    critical_enter();
+    stack = dead_stack;
+    dead_stack = curr_thread->stack;
+    critical_leave();
+    if (stack)
+        vfree(stack);
+
     // IRQs will be restored during task switch
     critical_enter();
 
@@ -178,6 +240,9 @@ void thread_exit()
     // Remove from PID hash
     list_delete(&curr_thread->hash_entry);
 
+    if (curr_thread->memgroup)
+        --curr_thread->memgroup->threads;
+
     free(curr_thread);
 
     if (last_fp_thread == curr_thread)
@@ -229,7 +294,7 @@ void thread_tick()
     }
 
     if (unlikely(curr_thread == &idle_thread))
-        curr_thread = thread_schedule();
+        need_resched = true;
     else
     {
 	--curr_thread->timeslice;
@@ -244,11 +309,21 @@ void thread_tick()
 		dequeue_thread(active, curr_thread);
 		enqueue_thread(expired, curr_thread, curr_thread->priority);
 	    }
-	    curr_thread = thread_schedule();
+	    need_resched = true;
 	}
     }
 }
 
+// Switch the thread at the end of the irq (irq_exit())
+void thread_preempt()
+{
+    if (unlikely(need_resched))
+    {
+        need_resched = false;
+        curr_thread = thread_schedule();
+    }
+}
+
 // Switch floating point state
 void switch_fp_state(const regs_t regs)
 {
@@ -269,6 +344,26 @@ void switch_fp_state(const regs_t regs)
     last_fp_thread = curr_thread;
 }
 
+void kernel_fpu_begin(bool* irq_status)
+{
+    irqs_save(irq_status);
+    set_reg(cr0, get_reg(cr0) & ~CR0_EM);
+
+    if (last_fp_thread)
+    {
+        fp_save(last_fp_thread->fp_state);
+        last_fp_thread = NULL;
+    }
+}
+
+void kernel_fpu_end(bool irq_status)
+{
+    // Next FPU use of a thread traps (not before threading is initialized)
+    if (curr_thread)
+        set_reg(cr0, get_reg(cr0) | CR0_EM);
+    irqs_restore(irq_status);
+}
+
 static void wakeup_thread(void* arg)
 {
     thread_t* t = (thread_t*)arg;
@@ -278,6 +373,16 @@ static void wakeup_thread(void* arg)
     t->state = THREAD_STATE_RUNNING;
 }
 
+// Timer callback of thread_wait()
+static void wait_timeout(void* arg)
+{
+    thread_t* t = (thread_t*)arg;
+
+    list_delete(&t->wait_entry);
+    t->wait_timer = NULL;
+    wakeup_thread(t);
+}
+
 // Simple round-robin scheduler
 static thread_t* thread_schedule()
 {
@@ -303,6 +408,7 @@ static thread_t* thread_schedule()
 
 void thread_dump()
 {
+    const memgroup_t* g;
     list_t* p;
     int idle_time, total_time = 0;
 
@@ -317,12 +423,21 @@ void thread_dump()
         t->curr_usertime = t->curr_systime = 0;
     }
 
-    con_printf(1, CLRSCR "%d Threads, %d%% Usage\n  Name   Pid   Usertime   Systime   Priority   State\n",
+    con_printf(1, CLRSCR "%d Threads, %d%% Usage\n  Name   Pid   Usertime   Systime   Priority   State   Group\n",
 	       num_threads, 100 - 100 * idle_time / total_time);
     for (p = thread_list.next; p != &thread_list; p = p->next)
     {
 	thread_t* t = LIST_OBJECT(p, thread_t, thread_entry);
-	con_printf(1, "%6s %5d %10d %9d %10d %7d\n", t->name, t->pid, t->usertime, t->systime, t->priority, t->state);
+	con_printf(1, "%6s %5d %10d %9d %10d %7d   %s\n", t->name, t->pid, t->usertime, t->systime, t->priority, t->state,
+                   t->memgroup ? t->memgroup->name : "-");
+    }
+
+    con_printf(1, "\n Group   Threads   Memory     Max   Heap   Soft/Hard   Reclaimed   Failed\n");
+    for (g = memgroup_next(NULL); g; g = memgroup_next(g))
+    {
+        con_printf(1, "%6s %9d %7dK %6dK %5dK %5dK/%dK %11d %8d\n", g->name, g->threads,
+                   g->pages << 2, g->max_pages << 2, g->heap >> 10,
+                   g->soft_limit << 2, g->hard_limit << 2, g->reclaimed, g->failed);
     }
 
     critical_leave();
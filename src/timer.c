@@ -5,6 +5,7 @@
 #include <pool.h>
 #include <regs.h>
 #include <thread.h>
+#include <softirq.h>
 #include <irq.h>
 #include <desc.h>
 #include <thread.h>
@@ -19,13 +20,14 @@ static void trigger_expired();
 void __init timer_init()
 {
     pool_init(&timer_pool, 20, sizeof (timer_t));
+    softirq_register(SOFTIRQ_TIMER, trigger_expired);
 
     idt_set(PIC_INTBASE + IRQ_TIMER, irq_timer, DESC_TYPE_INT | DESC_PRESENT);
     pit_set(PIT_CHANNEL_TIMER, PIT_MODE_RATEGEN, 1000);
     pic_irq_enable(IRQ_TIMER);
 }
 
-void timer_add(callback_t call, void* arg, int interval)
+timer_t* timer_add(callback_t call, void* arg, int interval)
 {
     ullong expires = ticks + interval;
     list_t* p;
@@ -48,32 +50,60 @@ void timer_add(callback_t call, void* arg, int interval)
     list_add(p, &t->list_entry);
 
     irqs_restore(irq_status);
+    return t;
+}
+
+// Remove timer which hasn't expired yet
+void timer_remove(timer_t* t)
+{
+    bool irq_status;
+
+    irqs_save(&irq_status);
+    list_delete(&t->list_entry);
+    pool_release(&timer_pool, t);
+    irqs_restore(irq_status);
 }
 
 // Timer handler
 void do_irq_timer(const regs_t regs)
 {
+    const timer_t* next;
+
     pic_irq_end(IRQ_TIMER);
     
     ++ticks;
-    trigger_expired();
+    if (!list_empty(&timer_list))
+    {
+        next = LIST_OBJECT(timer_list.next, timer_t, list_entry);
+        if (next->expires < ticks)
+            softirq_raise(SOFTIRQ_TIMER);
+    }
     thread_tick();
 }
 
-// Trigger expired timers
+// Trigger expired timers (timer softirq)
+// The timer is removed before the call, so the callback
+// may add or remove other timers. Callbacks run with irqs
+// disabled, but irqs are taken between them.
 static void trigger_expired()
 {
-    list_t* p = timer_list.next;
-    while (p != &timer_list)
+    irqs_disable();
+    while (!list_empty(&timer_list))
     {
-	timer_t* t = LIST_OBJECT(p, timer_t, list_entry);
+	timer_t* t = LIST_OBJECT(timer_list.next, timer_t, list_entry);
+	callback_t call = t->call;
+	void* arg = t->arg;
+
         if (t->expires >= ticks)
 	    break;
-	t->call(t->arg);
 
-	p = p->next;
-	
 	list_delete(&t->list_entry);
 	pool_release(&timer_pool, t);
+
+	call(arg);
+
+        irqs_enable();
+        irqs_disable();
     }
+    irqs_enable();
 }
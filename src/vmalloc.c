@@ -0,0 +1,289 @@
+/*
+ * Kernel virtual area allocator
+ */
+#include <vmalloc.h>
+#include <vmem.h>
+#include <pool.h>
+#include <list.h>
+#include <math.h>
+#include <stdio.h>
+#include <debug.h>
+#include <asm.h>
+
+enum
+{
+    VMAP_POOL = 32,
+};
+
+/*
+ * Virtual area
+ *    - Free areas are sorted by address and never adjacent
+ *    - Busy areas include their guard pages
+ */
+typedef struct vmap_area_s
+{
+    list_t   list_entry;
+    uint32_t start, end;
+    int      guard;
+} vmap_area_t;
+
+static list_t free_list = LIST_INIT(free_list);
+static list_t busy_list = LIST_INIT(busy_list);
+static pool_t area_pool;
+
+/*
+ * pool_get() may grow the pool with malloc() which enables irqs,
+ * so areas are taken before the lists are used and unused ones
+ * are released afterwards
+ */
+static vmap_area_t* get_area()
+{
+    vmap_area_t* area;
+    bool irq_status;
+
+    irqs_save(&irq_status);
+    area = pool_get(&area_pool);
+    irqs_restore(irq_status);
+    return area;
+}
+
+static void put_area(vmap_area_t* area)
+{
+    bool irq_status;
+
+    irqs_save(&irq_status);
+    pool_release(&area_pool, area);
+    irqs_restore(irq_status);
+}
+
+static vmap_area_t* init_area(vmap_area_t* area, uint32_t start, uint32_t end)
+{
+    area->start = start;
+    area->end   = end;
+    area->guard = 0;
+    return area;
+}
+
+void __init vmalloc_init()
+{
+    vmap_area_t* area;
+
+    pool_init(&area_pool, VMAP_POOL, sizeof (vmap_area_t));
+    area = init_area(get_area(), VMALLOC_START, VMALLOC_END);
+    list_add(&free_list, &area->list_entry);
+}
+
+uint32_t vmap_area_alloc(size_t size, size_t align, int guard)
+{
+    vmap_area_t *area, *best = NULL, *rest, *gap;
+    uint32_t start, best_start = 0;
+    bool irq_status;
+    list_t* entry;
+
+    ASSERT(size > 0);
+    ASSERT(!(align & (align - 1)));
+
+    size  = ceil(size, PAGE_SIZE) + guard * PAGE_SIZE;
+    align = max(align, PAGE_SIZE);
+
+    // Areas for the split
+    rest = get_area();
+    gap  = get_area();
+    if (!rest || !gap)
+    {
+        if (rest)
+            put_area(rest);
+        if (gap)
+            put_area(gap);
+        return 0;
+    }
+
+    irqs_save(&irq_status);
+
+    // Best-fit: smallest free area which fits with alignment
+    for (entry = free_list.next; entry != &free_list; entry = entry->next)
+    {
+        area  = LIST_OBJECT(entry, vmap_area_t, list_entry);
+        start = (area->start + align - 1) & ~(align - 1);
+        if (start < area->start || start >= area->end || area->end - start < size)
+            continue;
+        if (!best || area->end - area->start < best->end - best->start)
+        {
+            best = area;
+            best_start = start;
+        }
+    }
+
+    if (!best)
+    {
+        irqs_restore(irq_status);
+        put_area(rest);
+        put_area(gap);
+        return 0;
+    }
+
+    // Rest behind the area stays free
+    if (best_start + size < best->end)
+    {
+        init_area(rest, best_start + size, best->end);
+        list_add(best->list_entry.next, &rest->list_entry);
+        rest = NULL;
+    }
+
+    // Alignment gap in front stays free
+    if (best_start > best->start)
+    {
+        best->end = best_start;
+        best = init_area(gap, best_start, best_start + size);
+        gap = NULL;
+    }
+    else
+    {
+        list_delete(&best->list_entry);
+        best->end = best_start + size;
+    }
+
+    best->guard = guard;
+    list_add(&busy_list, &best->list_entry);
+
+    irqs_restore(irq_status);
+
+    if (rest)
+        put_area(rest);
+    if (gap)
+        put_area(gap);
+    return best_start;
+}
+
+// Busy area starting at addr
+static vmap_area_t* find_area(uint32_t addr)
+{
+    vmap_area_t* area;
+    list_t* entry;
+
+    for (entry = busy_list.next; entry != &busy_list; entry = entry->next)
+    {
+        area = LIST_OBJECT(entry, vmap_area_t, list_entry);
+        if (area->start == addr)
+            return area;
+    }
+    return NULL;
+}
+
+void vmap_area_free(uint32_t addr)
+{
+    vmap_area_t *area, *prev = NULL, *next = NULL;
+    bool irq_status;
+    list_t* entry;
+
+    irqs_save(&irq_status);
+
+    area = find_area(addr);
+    if (!area)
+        panic("vmap_area_free: Invalid address 0x%08X", addr);
+    list_delete(&area->list_entry);
+
+    // Neighbours in the sorted free list
+    for (entry = free_list.next; entry != &free_list; entry = entry->next)
+    {
+        next = LIST_OBJECT(entry, vmap_area_t, list_entry);
+        if (next->start >= area->end)
+            break;
+        prev = next;
+        next = NULL;
+    }
+
+    // Merge with neighbours
+    if (prev && prev->end == area->start)
+    {
+        prev->end = area->end;
+        pool_release(&area_pool, area);
+        area = prev;
+    }
+    else
+        list_add(next ? &next->list_entry : &free_list, &area->list_entry);
+
+    if (next && next->start == area->end)
+    {
+        area->end = next->end;
+        list_delete(&next->list_entry);
+        pool_release(&area_pool, next);
+    }
+
+    irqs_restore(irq_status);
+}
+
+void* vmalloc(size_t size)
+{
+    uint32_t addr;
+
+    size = ceil(size, PAGE_SIZE);
+    addr = vmap_area_alloc(size, PAGE_SIZE, VMALLOC_GUARD);
+    if (!addr)
+        return NULL;
+
+    if (!vmem_alloc(addr, addr + size, PAGE_RW | PAGE_NX))
+    {
+        vmap_area_free(addr);
+        return NULL;
+    }
+
+    return (void*)addr;
+}
+
+void vfree(void* p)
+{
+    size_t size = vmalloc_size(p);
+
+    vmem_free((uint32_t)p, (uint32_t)p + size);
+    vmap_area_free((uint32_t)p);
+}
+
+// Mapped size of the area (without guard pages)
+size_t vmalloc_size(const void* p)
+{
+    const vmap_area_t* area;
+    bool irq_status;
+    size_t size;
+
+    irqs_save(&irq_status);
+    area = find_area((uint32_t)p);
+    if (!area)
+        panic("vmalloc: Invalid address %p", p);
+    size = area->end - area->start - area->guard * PAGE_SIZE;
+    irqs_restore(irq_status);
+
+    return size;
+}
+
+// Busy and free areas
+void vmalloc_dump()
+{
+    const vmap_area_t* area;
+    bool irq_status;
+    list_t* entry;
+    int busy = 0, free = 0, largest = 0;
+
+    irqs_save(&irq_status);
+
+    printf("Virtual areas:\n");
+    for (entry = busy_list.next; entry != &busy_list; entry = entry->next)
+    {
+        area = LIST_OBJECT(entry, vmap_area_t, list_entry);
+        printf(" 0x%08X - 0x%08X %6dK (%d guard)\n",
+               area->start, area->end - 1, (area->end - area->start) >> 10, area->guard);
+        busy += area->end - area->start;
+    }
+
+    for (entry = free_list.next; entry != &free_list; entry = entry->next)
+    {
+        area = LIST_OBJECT(entry, vmap_area_t, list_entry);
+        free += area->end - area->start;
+        if ((int)(area->end - area->start) > largest)
+            largest = area->end - area->start;
+    }
+
+    irqs_restore(irq_status);
+
+    printf(" Used: %dK, Free: %dK (largest %dK)\n", busy >> 10, free >> 10, largest >> 10);
+}
@@ -10,65 +10,237 @@
 #include <debug.h>
 #include <stdio.h>
 #include <thread.h>
+#include <bitmap.h>
+#include <cpu.h>
+#include <reclaim.h>
+#include <swap.h>
+#include <ksm.h>
+#include <memblock.h>
 
 enum {
-    // Address masks
-    _PDE_MASK   = 0xFFC00000,
-    _PTE_MASK   = 0x003FF000,
-    //_OFF_MASK = 0x00000FFF,
-    
     // Address shifts
-    _PDE_SHIFT  = 22,
-    _PTE_SHIFT  = 12,
+    _PDE_SHIFT     = 22,
+    _PAE_PDE_SHIFT = 21,
+    _PTE_SHIFT     = 12,
 
     // Mappings of page directory and tables
-    _PDE_START  = 0xFFFFF000,
-    _PTE_START  = 0xFFC00000,
+    _PDE_START     = 0xFFFFF000,
+    _PTE_START     = 0xFFC00000,
+
+    // First of the four self-mapping entries with PAE
+    _PAE_SELF_PDE  = 508,
+
+    // Page directories referenced by the PDPT
+    PAE_DIRS       = 4,
+
+    // More TLB entries are flushed by reloading cr3
+    TLB_BATCH_SIZE = 32,
+
+    // Window for temporary kernel mappings (below the kernel heap)
+    KMAP_START  = 0xF9000000,
+    KMAP_PAGES  = BITS_PER_LONG,
 };
 
+// Mappings with PAE (four directories mapped into the last one)
+#define _PAE_PDE_START 0xFFFFC000
+#define _PAE_PTE_START 0xFF800000
+
+/*
+ * TLB flush batching
+ *
+ * The range functions collect the addresses which must be
+ * invalidated and flush them at the end. If there are too many,
+ * one reload of cr3 is cheaper than single invlpg's. Pages and
+ * page tables which become unused are freed only after the flush,
+ * until then stale TLB entries may still reference them. They are
+ * kept on a list, so a range is flushed only once regardless of
+ * its size.
+ */
+
+typedef struct tlb_batch_s
+{
+    int      count;
+    uint32_t addr[TLB_BATCH_SIZE];
+
+    // Unused pages and page tables (linked by lru), freed after the flush
+    list_t   free_list;
+} tlb_batch_t;
+
+/*
+ * Paging mode
+ *
+ * Without PAE the entries are 32 bit and a page table maps 4M.
+ * With PAE the entries are 64 bit, a page table maps 2M and the
+ * PDPT references four page directories (1G each). The PDPT
+ * is loaded into cr3, so it must be below 4G.
+ */
+
+static bool     pae       = false;
+static int      pde_shift = _PDE_SHIFT;
+static uint32_t pde_start = _PDE_START;
+static uint32_t pte_start = _PTE_START;
+static int      nx_mask   = ~PAGE_NX; // PAGE_NX is dropped if not supported
+
+static uint64_t pdpt[PAE_DIRS] __attribute__ ((aligned (32)));
+
+// Physical page directories (only the first one without PAE)
+static paddr_t  pgdir[PAE_DIRS];
+
 /*
  * Functions to access PDE, PTE and page tables
  *
- * PTEs: 0xFFC00000 - 0xFFFFEFFF
- * PDEs: 0xFFFFF000 - 0xFFFFFFFF
+ *          PTEs                      PDEs
+ * 2-level: 0xFFC00000 - 0xFFFFEFFF  0xFFFFF000 - 0xFFFFFFFF
+ * PAE:     0xFF800000 - 0xFFFFBFFF  0xFFFFC000 - 0xFFFFFFFF
  */                     
 
+// Read entry i of a table
+static inline page_t entry_get(uint32_t table, int i)
+{
+    if (pae)
+        return ((volatile page_t*)table)[i];
+    return ((volatile uint32_t*)table)[i];
+}
+
+// Write entry i of a table. PAE entries are written in two
+// halves, the present bit must be set last and cleared first.
+static inline void entry_set(uint32_t table, int i, page_t entry)
+{
+    volatile uint32_t* e;
+
+    if (pae)
+    {
+        e = (volatile uint32_t*)((page_t*)table + i);
+        if (entry & PAGE_PRESENT)
+        {
+            e[1] = entry >> 32;
+            e[0] = entry;
+        }
+        else
+        {
+            e[0] = entry;
+            e[1] = entry >> 32;
+        }
+    }
+    else
+        ((volatile uint32_t*)table)[i] = entry;
+}
+
+// Create entry, NX is only used if the cpu supports it
+static inline page_t make_entry(paddr_t page, int flags)
+{
+    return page_init(page, flags & nx_mask);
+}
+
 // Get page directory entry by virtual address (points to page table)
-static inline page_t* get_pde(uint32_t addr)
+static inline page_t pde_get(uint32_t addr)
 {
-    return (page_t*)_PDE_START + (addr >> _PDE_SHIFT);
+    return entry_get(pde_start, addr >> pde_shift);
+}
+
+static inline void pde_set(uint32_t addr, page_t entry)
+{
+    entry_set(pde_start, addr >> pde_shift, entry);
 }
 
 // Get page table entry by virtual address (points to page)
-static inline page_t* get_pte(uint32_t addr)
+static inline page_t pte_get(uint32_t addr)
 {
-    return (page_t*)_PTE_START + (addr >> _PTE_SHIFT);
+    return entry_get(pte_start, addr >> _PTE_SHIFT);
 }
 
-// Get page table by virtual address (points to page)
-// Similar to get_pte(), but it returns always the first pte!!!
-static inline page_t* get_pgtable(uint32_t addr)
+static inline void pte_set(uint32_t addr, page_t entry)
 {
-    return get_pte(addr & _PDE_MASK);
+    entry_set(pte_start, addr >> _PTE_SHIFT, entry);
 }
 
-// Virtual address to page directory index
-static inline int get_pde_index(uint32_t addr)
+// Mapping of the page table for addr
+static inline uint32_t get_pgtable(uint32_t addr)
 {
-    return (addr & _PDE_MASK) >> _PDE_SHIFT;
+    return pte_start + ((addr >> pde_shift) << _PTE_SHIFT);
 }
 
 // Virtual address to page table index
 static inline int get_pte_index(uint32_t addr)
 {
-    return (addr & _PTE_MASK) >> _PTE_SHIFT;
+    return (addr >> _PTE_SHIFT) & ((1 << (pde_shift - _PTE_SHIFT)) - 1);
+}
+
+// Physical page of the page table for addr
+static inline paddr_t get_pgtable_page(uint32_t addr)
+{
+    return page_get_address(pde_get(addr));
+}
+
+// End of the span (one page table) containing addr, limited to end
+static inline uint32_t get_span_end(uint32_t addr, uint32_t end)
+{
+    uint32_t next = ((addr >> pde_shift) + 1) << pde_shift;
+
+    // next is 0 if the span is the last one
+    return (next - 1 < end - 1 ? next : end);
 }
 
 /*
  * Prototypes
  */
  
+static paddr_t boot_alloc_table() __init;
+static paddr_t boot_pgtable(uint32_t) __init;
+static void boot_map(uint32_t, paddr_t, int) __init;
 static bool alloc_pgtable(uint32_t, int);
+static bool get_pgtable_alloc(uint32_t, int);
+static void put_pgtable(uint32_t, int, tlb_batch_t*);
+static void unmap_range(uint32_t, uint32_t, bool);
+static pmem_page_t* unref_page(paddr_t);
+static void put_page(paddr_t);
+
+static inline void tlb_batch_init(tlb_batch_t* batch)
+{
+    batch->count = 0;
+    list_init(&batch->free_list);
+}
+
+static inline void tlb_batch_add(tlb_batch_t* batch, uint32_t addr)
+{
+    if (batch->count < TLB_BATCH_SIZE)
+        batch->addr[batch->count] = addr;
+    ++batch->count;
+}
+
+static void tlb_batch_flush(tlb_batch_t* batch)
+{
+    pmem_page_t* desc;
+    int i;
+
+    if (batch->count > TLB_BATCH_SIZE)
+        flush_tlb();
+    else
+    {
+        for (i = 0; i < batch->count; ++i)
+            invalidate_tlb(batch->addr[i]);
+    }
+    batch->count = 0;
+
+    while (!list_empty(&batch->free_list))
+    {
+        desc = LIST_OBJECT(batch->free_list.next, pmem_page_t, lru);
+        list_delete(&desc->lru);
+        pmem_free_page(pmem_page_address(desc));
+    }
+}
+
+// Release the page, it's freed after the flush if it became unused
+static void tlb_batch_put_page(tlb_batch_t* batch, paddr_t page)
+{
+    pmem_page_t* desc = unref_page(page);
+
+    if (desc)
+        list_add(&batch->free_list, &desc->lru);
+}
+
+// Free slots in the kmap window
+static ulong kmap_free = ~0UL;
 
 /*
  * Initialize memory management
@@ -76,63 +248,109 @@ static bool alloc_pgtable(uint32_t, int);
 
 void __init vmem_init()
 {
-    int n, tmp;
-    uint32_t pgd_page, pgt_page;
-    page_t *pgd, *pgt;
-        
+    const memblock_range_t* alloc;
+    uint32_t addr, dir;
+    paddr_t page;
+    int n, flags;
+
     /*
-     * Create page directory
+     * PAE is used if it's supported, NX only with PAE.
+     * pmem_init() did already take the decision into account.
      */
 
-    pgd_page = pmem_alloc_page();
-    ASSERT(pgd_page != BAD_PAGE);
-    pgd = (page_t*)PHYS_TO_VIRT(pgd_page);
-    memset(pgd, 0, PAGE_SIZE);
+    if (CPU_HAS_FEATURE(PAE))
+    {
+        pae       = true;
+        pde_shift = _PAE_PDE_SHIFT;
+        pde_start = _PAE_PDE_START;
+        pte_start = _PAE_PTE_START;
+        if (CPU_HAS_FEATURE(NX))
+            nx_mask = ~0;
+    }
+    
+    /*
+     * Create page directories and map them into themselves
+     * to allow direct access to the PTEs and PDEs (see above).
+     */
 
-    /* Map page directory into itself
-     * to allow direct access to:
-     *
-     * PTEs: 0xFFC00000 - 0xFFFFEFFF
-     * PDEs: 0xFFFFF000 - 0xFFFFFFFF
-     */    
+    if (pae)
+    {
+        for (n = 0; n < PAE_DIRS; ++n)
+        {
+            pgdir[n] = boot_alloc_table();
+            pdpt[n] = page_init(pgdir[n], PAGE_PRESENT);
+        }
 
-    pgd[PAGE_ENTRIES - 1] = page_init(pgd_page, PAGE_RW | PAGE_PRESENT);
+        dir = PHYS_TO_VIRT((uint32_t)pgdir[PAE_DIRS - 1]);
+        for (n = 0; n < PAE_DIRS; ++n)
+            entry_set(dir, _PAE_SELF_PDE + n, page_init(pgdir[n], PAGE_RW | PAGE_PRESENT));
+    }
+    else
+    {
+        pgdir[0] = boot_alloc_table();
+        dir = PHYS_TO_VIRT((uint32_t)pgdir[0]);
+        entry_set(dir, PAGE_ENTRIES - 1, page_init(pgdir[0], PAGE_RW | PAGE_PRESENT));
+    }
 
     /*
      * Map kernel memory to 0xC0000000
-     * vmem_map can not be used yet due to odd segmentation
+     * vmem_map can not be used yet due to odd segmentation.
+     * Only .text and .init.text are executable and read-only.
      */
      
-    pgt_page = pmem_alloc_page();
-    ASSERT(pgt_page != BAD_PAGE);
-    pgt = (page_t*)PHYS_TO_VIRT(pgt_page); 
-    memset(pgt, 0, PAGE_SIZE);
-    
-    // Write page table entries
-    tmp = get_pte_index(KERNEL_START);
-    for (n = 0; n < pmem_get_stats()->kernel; ++n)
+    for (n = 0; n < SIZE_TO_PAGES(KERNEL_SIZE); ++n)
     {
-        pgt[tmp + n] = page_init(KERNEL_START_PHYS + n * PAGE_SIZE, PAGE_PRESENT | PAGE_RW);
-        pmem_inc(pgt_page);
+        addr = KERNEL_START + n * PAGE_SIZE;
+        if ((addr >= TEXT_START && addr < TEXT_START + TEXT_SIZE) ||
+            (addr >= INIT_TEXT_START && addr < INIT_TEXT_START + INIT_TEXT_SIZE))
+            flags = 0;
+        else
+            flags = PAGE_RW | PAGE_NX;
+        boot_map(addr, KERNEL_START_PHYS + n * PAGE_SIZE, flags);
+        ++pmem_get_page(KERNEL_START_PHYS + n * PAGE_SIZE)->mapcount;
     }
 
-    // .text read-only section
-    tmp = get_pte_index(TEXT_START);
-    for (n = 0; n < SIZE_TO_PAGES(TEXT_SIZE); ++n)
-        pgt[tmp + n] &= ~PAGE_RW;
+    /*
+     * Boot memory (frame metadata, page tables) at the same offset.
+     * Page tables allocated meanwhile are appended to the allocations.
+     */
 
-    // .init.text read-only section
-    tmp = get_pte_index(INIT_TEXT_START);
-    for (n = 0; n < SIZE_TO_PAGES(INIT_TEXT_SIZE); ++n)
-        pgt[tmp + n] &= ~PAGE_RW;
- 
-    pgd[get_pde_index(VIRT_OFFSET)] = page_init(pgt_page, PAGE_RW | PAGE_PRESENT);
+    for (n = 0; (alloc = memblock_get_alloc(n)) != NULL; ++n)
+    {
+        for (page = alloc->start; page < alloc->end; page += PAGE_SIZE)
+        {
+            boot_map(PHYS_TO_VIRT((uint32_t)page), page, PAGE_RW | PAGE_NX);
+            ++pmem_get_page(page)->mapcount;
+        }
+    }
+
+    /*
+     * Page table of the kmap window. It's never freed, so it gets
+     * one extra usage count.
+     */
+
+    pmem_inc(boot_pgtable(KMAP_START));
 
     /*
      * Identity mapping to set-up paging
      */
-    pgd[0] = pgd[get_pde_index(VIRT_OFFSET)];    
-    enable_paging(pgd_page);
+
+    if (pae)
+    {
+        // 0xC0000000 is exactly 3G, so the kernel directory
+        // can be used for the first gigabyte too
+        set_reg(cr4, get_reg(cr4) | CR4_PAE);
+        if (nx_mask == ~0)
+            wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+        pdpt[0] = pdpt[3];
+        enable_paging(VIRT_TO_PHYS((uint32_t)pdpt));
+    }
+    else
+    {
+        for (n = VIRT_OFFSET >> _PDE_SHIFT; n <= (KERNEL_START + KERNEL_SIZE) >> _PDE_SHIFT; ++n)
+            entry_set(dir, n - (VIRT_OFFSET >> _PDE_SHIFT), entry_get(dir, n));
+        enable_paging(pgdir[0]);
+    }
 
     /* 
      * Reload gdt to set-up new flat segmentation
@@ -142,9 +360,64 @@ void __init vmem_init()
 
     gdt_setup_flat();
  
-    // Remove identity mapping (pgd is invalid now, use mapped pde!)
-    *get_pde(0) = 0;
-    invalidate_tlb(0);
+    // Remove identity mapping (dir is invalid now, use mapped pde!)
+    if (pae)
+        pdpt[0] = page_init(pgdir[0], PAGE_PRESENT);
+    else
+    {
+        for (n = VIRT_OFFSET >> _PDE_SHIFT; n <= (KERNEL_START + KERNEL_SIZE) >> _PDE_SHIFT; ++n)
+            pde_set((n - (VIRT_OFFSET >> _PDE_SHIFT)) << _PDE_SHIFT, 0);
+    }
+
+    // Reloading cr3 reloads the PDPT too
+    flush_tlb();
+
+    // Read-only pages are protected in the kernel too (copy on write)
+    set_reg(cr0, get_reg(cr0) | CR0_WP);
+}
+
+// Allocate cleared table before paging is enabled
+static paddr_t __init boot_alloc_table()
+{
+    paddr_t page = memblock_alloc(PAGE_SIZE, PAGE_SIZE);
+    pmem_get_page(page)->flags |= PMEM_PGTABLE;
+    return page;
+}
+
+/*
+ * Get page table before paging is enabled.
+ * The page table is allocated if it doesn't exist.
+ */
+static paddr_t __init boot_pgtable(uint32_t addr)
+{
+    uint32_t dir;
+    int i;
+
+    if (pae)
+    {
+        dir = PHYS_TO_VIRT((uint32_t)pgdir[addr >> 30]);
+        i = (addr >> _PAE_PDE_SHIFT) & (PAGE_SIZE / sizeof (page_t) - 1);
+    }
+    else
+    {
+        dir = PHYS_TO_VIRT((uint32_t)pgdir[0]);
+        i = addr >> _PDE_SHIFT;
+    }
+
+    if (~page_get_flags(entry_get(dir, i)) & PAGE_PRESENT)
+        entry_set(dir, i, page_init(boot_alloc_table(), PAGE_RW | PAGE_PRESENT));
+
+    return page_get_address(entry_get(dir, i));
+}
+
+// Map page before paging is enabled
+static void __init boot_map(uint32_t addr, paddr_t page, int flags)
+{
+    paddr_t pgt_page = boot_pgtable(addr);
+
+    entry_set(PHYS_TO_VIRT((uint32_t)pgt_page), get_pte_index(addr),
+              make_entry(page, flags | PAGE_PRESENT));
+    pmem_inc(pgt_page);
 }
 
 /*
@@ -153,42 +426,73 @@ void __init vmem_init()
 
 bool vmem_alloc(uint32_t start, uint32_t end, int flags)
 {
-    uint32_t addr;
+    uint32_t addr, last;
+    pmem_page_t* desc;
+    paddr_t page;
+    int i, count;
     
     ASSERT(is_page_aligned(start));
     ASSERT(is_page_aligned(end));
    
-    addr = start;
-    while (addr < end)
+    for (addr = start; addr < end; addr = last)
     {
-        if (!vmem_alloc_page(addr, flags))
-	{
-	    vmem_free(start, addr);
-	    return false;
-	}
-        addr += PAGE_SIZE;
+        last  = get_span_end(addr, end);
+        count = (last - addr) / PAGE_SIZE;
+
+        if (!get_pgtable_alloc(addr, flags))
+        {
+            unmap_range(start, addr, true);
+            return false;
+        }
+
+        // Fill page table entries of this span
+        for (i = 0; i < count; ++i)
+        {
+            if (page_get_flags(pte_get(addr + i * PAGE_SIZE)) & PAGE_PRESENT)
+                panic("Virtual address 0x%X already allocated", addr + i * PAGE_SIZE);
+
+            page = pmem_alloc_zeroed_page();
+            if (page == BAD_PAGE)
+            {
+                // Account entries of this span and roll back
+                pmem_add(get_pgtable_page(addr), i);
+                put_pgtable(addr, 0, NULL);
+                unmap_range(start, addr + i * PAGE_SIZE, true);
+                return false;
+            }
+
+            pte_set(addr + i * PAGE_SIZE, make_entry(page, flags | PAGE_PRESENT));
+            desc = pmem_get_page(page);
+            ++desc->count;
+            ++desc->mapcount;
+
+            if (flags & PAGE_ANON)
+            {
+                desc->vaddr = addr + i * PAGE_SIZE;
+                reclaim_add_page(desc);
+            }
+        }
+
+        // Update page table usage counter once per span
+        pmem_add(get_pgtable_page(addr), count);
     }
+
+    // Entries were not present before, so the TLB needs no flush
     return true;
 }
 
 void vmem_free(uint32_t start, uint32_t end)
 {
-    uint32_t addr;
-    
     ASSERT(is_page_aligned(start));
     ASSERT(is_page_aligned(end));
-    
-    addr = start;
-    while (addr < end)
-    {
-        vmem_free_page(addr);
-        addr += PAGE_SIZE;
-    }
+
+    unmap_range(start, end, true);
 }
 
 bool vmem_alloc_page(uint32_t addr, int flags)
 {
-    uint32_t page = pmem_alloc_page();
+    paddr_t page = pmem_alloc_zeroed_page();
+    pmem_page_t* desc;
     
     if (page == BAD_PAGE)
         return false;
@@ -199,21 +503,35 @@ bool vmem_alloc_page(uint32_t addr, int flags)
         return false;
     }
     
-    pmem_inc(page);
-    
-    memset((void*)addr, 0, PAGE_SIZE);
+    desc = pmem_get_page(page);
+    ++desc->count;
+    ++desc->mapcount;
+
+    if (flags & PAGE_ANON)
+    {
+        desc->vaddr = addr;
+        reclaim_add_page(desc);
+    }
     return true;
 }
 
 void vmem_free_page(uint32_t addr)
 {
-    uint32_t page;
+    uint32_t slot;
+    int flags;
     
     ASSERT(is_page_aligned(addr)); 
+
+    // Only the swap slot is left
+    if (vmem_get_swap(addr, &slot, &flags))
+    {
+        swap_free(slot);
+        pte_set(addr, 0);
+        put_pgtable(addr, 1, NULL);
+        return;
+    }
     
-    page = vmem_unmap_page(addr);
-    if (pmem_dec(page) == 0)
-        pmem_free_page(page);
+    put_page(vmem_unmap_page(addr));
 }
 
 /*
@@ -227,133 +545,498 @@ void vmem_free_page(uint32_t addr)
  *    pmem_reserve(phys_start, phys_start + (end - start));
  */
 
-bool vmem_map(uint32_t start, uint32_t end, uint32_t phys_start, int flags)
+bool vmem_map(uint32_t start, uint32_t end, paddr_t phys_start, int flags)
 {
-    uint32_t addr, page;
+    uint32_t addr, last;
+    paddr_t page;
+    int i, count;
     
     ASSERT(is_page_aligned(start));
     ASSERT(is_page_aligned(end));
     ASSERT(is_page_aligned(phys_start));
     
-    addr = start;
     page = phys_start;
-    while (addr < end)
+    for (addr = start; addr < end; addr = last)
     {
-        if (!vmem_map_page(addr, page, flags))
+        last  = get_span_end(addr, end);
+        count = (last - addr) / PAGE_SIZE;
+
+        if (!get_pgtable_alloc(addr, flags))
         {
-            vmem_unmap(start, addr);
+            unmap_range(start, addr, false);
             return false;
         }
-        addr += PAGE_SIZE;
-        page += PAGE_SIZE;
+
+        for (i = 0; i < count; ++i)
+        {
+            if (page_get_flags(pte_get(addr + i * PAGE_SIZE)) & PAGE_PRESENT)
+                panic("Virtual address 0x%X already allocated", addr + i * PAGE_SIZE);
+            pte_set(addr + i * PAGE_SIZE, make_entry(page, flags | PAGE_PRESENT));
+            page += PAGE_SIZE;
+        }
+
+        pmem_add(get_pgtable_page(addr), count);
     }
+
+    // Entries were not present before, so the TLB needs no flush
     return true;
 }
 
 void vmem_unmap(uint32_t start, uint32_t end)
 {
-    uint32_t addr;
-    
     ASSERT(is_page_aligned(start));
     ASSERT(is_page_aligned(end));
     
-    addr = start;
-    while (addr < end)
-    {
-        vmem_unmap_page(addr);
-        addr += PAGE_SIZE;
-    }
+    unmap_range(start, end, false);
 }
 
-bool vmem_map_page(uint32_t addr, uint32_t page, int flags)
+bool vmem_map_page(uint32_t addr, paddr_t page, int flags)
 {
-    page_t *pde, *pte;
-   
     ASSERT(is_page_aligned(addr));
     ASSERT(is_page_aligned(page));
 
-    pde = get_pde(addr);
-    
     // Table not present?
-    if (~page_get_flags(*pde) & PAGE_PRESENT)
-    {
-        if (!alloc_pgtable(addr, flags))
-            return false;
-    }
+    if (!get_pgtable_alloc(addr, flags))
+        return false;
        
     // Get page table entry
-    pte = get_pte(addr);
-    if (page_get_flags(*pte) & PAGE_PRESENT)
+    if (page_get_flags(pte_get(addr)) & PAGE_PRESENT)
         panic("Virtual address 0x%X already allocated", addr);
     
     // Set page table entry to physical page
-    *pte = page_init(page, flags | PAGE_PRESENT);
+    pte_set(addr, make_entry(page, flags | PAGE_PRESENT));
     
     invalidate_tlb(addr);
     
     // Update page table usage counter
-    pmem_inc(page_get_address(*pde));
+    pmem_inc(get_pgtable_page(addr));
 
     return true;
 }
 
-uint32_t vmem_unmap_page(uint32_t addr)
+paddr_t vmem_unmap_page(uint32_t addr)
 {
-    uint32_t page, pgt_page;
-    page_t *pde, *pte;
+    paddr_t page, pgt_page;
+    page_t pte;
 
     ASSERT(is_page_aligned(addr));
     
-    // Page directory entry --> Page table
-    pde = get_pde(addr);
-    
     // Page table freed?
-    if (~page_get_flags(*pde) & PAGE_PRESENT)
+    if (~page_get_flags(pde_get(addr)) & PAGE_PRESENT)
         panic("Page table for virtual address 0x%X already freed", addr);
     
     // Get page table entry which points to page
-    pte = get_pte(addr);
+    pte = pte_get(addr);
     
     // Is virtual page freed?
-    if (~page_get_flags(*pte) & PAGE_PRESENT)
+    if (~page_get_flags(pte) & PAGE_PRESENT)
         panic("Virtual address 0x%X already freed", addr);
     
     // Unmap page
-    page = page_get_address(*pte);
-    *pte = 0;
+    page = page_get_address(pte);
+    pte_set(addr, 0);
     invalidate_tlb(addr);
 
     // Free page table if unused
-    pgt_page = page_get_address(*pde); 
+    pgt_page = get_pgtable_page(addr); 
     if (pmem_dec(pgt_page) == 0)
     {
-        *pde = 0;
+        pde_set(addr, 0);
         pmem_free_page(pgt_page);
-        invalidate_tlb((uint32_t)pte);
+        invalidate_tlb(get_pgtable(addr));
     }
     
     return page;
 }
 
+paddr_t vmem_get_page(uint32_t addr, int* flags)
+{
+    page_t pte;
+
+    if (~page_get_flags(pde_get(addr)) & PAGE_PRESENT)
+        return BAD_PAGE;
+
+    pte = pte_get(addr);
+    if (~page_get_flags(pte) & PAGE_PRESENT)
+        return BAD_PAGE;
+
+    *flags = page_get_flags(pte);
+    return page_get_address(pte);
+}
+
+bool vmem_get_swap(uint32_t addr, uint32_t* slot, int* flags)
+{
+    page_t pte;
+
+    if (~page_get_flags(pde_get(addr)) & PAGE_PRESENT)
+        return false;
+
+    pte = pte_get(addr);
+    if (~page_get_flags(pte) & PAGE_SWAPPED)
+        return false;
+
+    *flags = page_get_flags(pte);
+    *slot  = page_get_address(pte) >> _PTE_SHIFT;
+    return true;
+}
+
+// Lock swapped entry during the swap-in (or unlock it)
+void vmem_lock_swap(uint32_t addr, bool lock)
+{
+    page_t pte = pte_get(addr);
+    int flags = page_get_flags(pte);
+
+    ASSERT(flags & PAGE_SWAPPED);
+
+    flags = (lock ? flags | PAGE_LOCKED : flags & ~PAGE_LOCKED);
+
+    // Entry isn't present, so the TLB needs no flush
+    pte_set(addr, make_entry(page_get_address(pte), flags));
+}
+
+// Replace mapping of a pageable page by a swap entry
+void vmem_swap_out(uint32_t addr, uint32_t slot)
+{
+    page_t pte = pte_get(addr);
+    int flags = page_get_flags(pte);
+
+    ASSERT((flags & (PAGE_PRESENT | PAGE_ANON)) == (PAGE_PRESENT | PAGE_ANON));
+
+    flags &= ~(PAGE_PRESENT | PAGE_ACCESSED | PAGE_DIRTY);
+    pte_set(addr, make_entry((paddr_t)slot << _PTE_SHIFT, flags | PAGE_SWAPPED));
+    invalidate_tlb(addr);
+
+    // The entry stays used, so the page table count is unchanged
+    put_page(page_get_address(pte));
+}
+
+// Map page instead of the swap entry
+void vmem_swap_in(uint32_t addr, paddr_t page)
+{
+    int flags = page_get_flags(pte_get(addr));
+    pmem_page_t* desc = pmem_get_page(page);
+
+    ASSERT(flags & PAGE_SWAPPED);
+
+    // Entry wasn't present, so the TLB needs no flush
+    pte_set(addr, make_entry(page, (flags & ~(PAGE_SWAPPED | PAGE_LOCKED)) | PAGE_PRESENT));
+
+    ++desc->count;
+    ++desc->mapcount;
+    desc->vaddr = addr;
+    reclaim_add_page(desc);
+}
+
+/*
+ * Merge page: the merged page replaces the current one
+ * (or the current one becomes merged) and is mapped read-only.
+ * Merged pages are never reclaimed.
+ */
+void vmem_merge_page(uint32_t addr, paddr_t page)
+{
+    page_t pte = pte_get(addr);
+    paddr_t old = page_get_address(pte);
+    pmem_page_t* desc = pmem_get_page(page);
+    int flags = page_get_flags(pte);
+
+    ASSERT((flags & (PAGE_PRESENT | PAGE_ANON | PAGE_RW)) == (PAGE_PRESENT | PAGE_ANON | PAGE_RW));
+    ASSERT(desc->flags & PMEM_KSM);
+
+    flags = (flags & ~(PAGE_RW | PAGE_DIRTY)) | PAGE_KSM;
+    pte_set(addr, make_entry(page, flags));
+    invalidate_tlb(addr);
+
+    if (desc->flags & PMEM_LRU)
+        reclaim_remove_page(desc);
+
+    if (old != page)
+    {
+        ++desc->count;
+        ++desc->mapcount;
+        put_page(old);
+    }
+}
+
+/*
+ * Copy on write of a merged page. The last user
+ * gets the page back, the others get a copy.
+ */
+static bool break_ksm(uint32_t addr)
+{
+    page_t pte = pte_get(addr);
+    paddr_t page, old = page_get_address(pte);
+    pmem_page_t* desc = pmem_get_page(old);
+    int flags = page_get_flags(pte);
+    void* map;
+
+    flags = (flags & ~PAGE_KSM) | PAGE_RW;
+
+    if (desc->count == 1)
+    {
+        ksm_remove_page(desc);
+        page = old;
+    }
+    else
+    {
+        page = pmem_alloc_page();
+        if (page == BAD_PAGE)
+            return false;
+
+        map = vmem_kmap(page);
+        memcpy(map, (void*)addr, PAGE_SIZE);
+        vmem_kunmap(map);
+
+        put_page(old);
+        desc = pmem_get_page(page);
+        ++desc->count;
+        ++desc->mapcount;
+    }
+
+    pte_set(addr, make_entry(page, flags));
+    invalidate_tlb(addr);
+
+    desc->vaddr = addr;
+    reclaim_add_page(desc);
+    return true;
+}
+
+// Page fault handler
+void do_page_fault(const regs_t regs)
+{
+    uint32_t addr = get_reg(cr2), page = addr & ~(PAGE_SIZE - 1);
+    int flags;
+    bool ok;
+
+    // Not present: maybe swapped out. The I/O runs with irqs
+    // enabled if the faulting code had them enabled.
+    if (~regs.error_code & PAGE_PRESENT)
+    {
+        if (regs.eflags & EFLAGS_IF)
+            irqs_enable();
+        ok = swap_in(page);
+        irqs_disable();
+        if (ok)
+            return;
+    }
+
+    // Write to merged page
+    if ((regs.error_code & (PAGE_PRESENT | PAGE_RW)) == (PAGE_PRESENT | PAGE_RW) &&
+        vmem_get_page(page, &flags) != BAD_PAGE && (flags & PAGE_KSM) && break_ksm(page))
+        return;
+
+    printf("Page fault at 0x%X (error 0x%X)\n", addr, regs.error_code);
+    dump_regs(&regs);
+    thread_exit();
+}
+
+bool vmem_test_and_clear_accessed(uint32_t addr)
+{
+    volatile uint32_t* pte;
+
+    if (~page_get_flags(pde_get(addr)) & PAGE_PRESENT)
+        return false;
+
+    // Flags are in the low half of PAE entries too
+    pte = (volatile uint32_t*)(pte_start + (addr >> _PTE_SHIFT) * (pae ? sizeof (page_t) : sizeof (uint32_t)));
+    if (~*pte & PAGE_ACCESSED)
+        return false;
+
+    *pte &= ~PAGE_ACCESSED;
+    invalidate_tlb(addr);
+    return true;
+}
+
+void vmem_clear_dirty(uint32_t addr)
+{
+    volatile uint32_t* pte;
+
+    if (~page_get_flags(pde_get(addr)) & PAGE_PRESENT)
+        return;
+
+    pte = (volatile uint32_t*)(pte_start + (addr >> _PTE_SHIFT) * (pae ? sizeof (page_t) : sizeof (uint32_t)));
+    if ((*pte & (PAGE_PRESENT | PAGE_DIRTY)) == (PAGE_PRESENT | PAGE_DIRTY))
+    {
+        *pte &= ~PAGE_DIRTY;
+        invalidate_tlb(addr);
+    }
+}
+
+/*
+ * Temporary kernel mappings
+ */
+
+void* vmem_kmap(paddr_t page)
+{
+    uint32_t addr;
+    bool irq_status;
+    int slot;
+
+    ASSERT(is_page_aligned(page));
+
+    irqs_save(&irq_status);
+
+    slot = bitmap_find1(&kmap_free, KMAP_PAGES);
+    if (slot < 0)
+        panic("No free kmap slot for physical frame 0x%X", (uint32_t)(page / PAGE_SIZE));
+    bitmap_clearbit(&kmap_free, slot);
+
+    // Slot was flushed by vmem_kunmap()
+    addr = KMAP_START + slot * PAGE_SIZE;
+    pte_set(addr, make_entry(page, PAGE_RW | PAGE_NX | PAGE_PRESENT));
+
+    irqs_restore(irq_status);
+    return (void*)addr;
+}
+
+void vmem_kunmap(void* ptr)
+{
+    uint32_t addr = (uint32_t)ptr;
+    bool irq_status;
+
+    ASSERT(addr >= KMAP_START && addr < KMAP_START + KMAP_PAGES * PAGE_SIZE);
+    ASSERT(is_page_aligned(addr));
+
+    irqs_save(&irq_status);
+    pte_set(addr, 0);
+    invalidate_tlb(addr);
+    bitmap_setbit(&kmap_free, (addr - KMAP_START) / PAGE_SIZE);
+    irqs_restore(irq_status);
+}
+
+// Drop mapping of a page, the last one frees it
+/*
+ * Drop a mapping of the page. Returns the descriptor if the page
+ * became unused, it's off the LRU and KSM lists then and must be
+ * freed by the caller.
+ */
+static pmem_page_t* unref_page(paddr_t page)
+{
+    pmem_page_t* desc = pmem_get_page(page);
+
+    if (!desc)
+        panic("Physical frame 0x%X isn't managed", (uint32_t)(page / PAGE_SIZE));
+
+    --desc->mapcount;
+    if (--desc->count != 0)
+        return NULL;
+
+    if (desc->flags & PMEM_LRU)
+        reclaim_remove_page(desc);
+    if (desc->flags & PMEM_KSM)
+        ksm_remove_page(desc);
+    return desc;
+}
+
+static void put_page(paddr_t page)
+{
+    if (unref_page(page))
+        pmem_free_page(page);
+}
+
 static bool alloc_pgtable(uint32_t addr, int flags)
 {
-    page_t *pgt;
-    uint32_t page;
+    paddr_t page;
      
     ASSERT(is_page_aligned(addr)); 
     
-    page = pmem_alloc_page();
+    // Page table must be cleared
+    page = pmem_alloc_zeroed_page();
     if (page == BAD_PAGE)
         return false;
 
-    // Put table in the directory
-    *get_pde(addr) = page_init(page, flags | PAGE_RW | PAGE_PRESENT);
-    
-    // Clear page table
-    pgt = get_pgtable(addr);
-    invalidate_tlb((uint32_t)pgt);
-    memset(pgt, 0, PAGE_SIZE);
+    pmem_get_page(page)->flags |= PMEM_PGTABLE;
+
+    // Put table in the directory (NX would apply to the whole table)
+    pde_set(addr, page_init(page, (flags & ~PAGE_NX) | PAGE_RW | PAGE_PRESENT));
+    invalidate_tlb(get_pgtable(addr));
 
     return true;
 }
 
+// Make sure that the page table for addr exists
+static bool get_pgtable_alloc(uint32_t addr, int flags)
+{
+    if (page_get_flags(pde_get(addr)) & PAGE_PRESENT)
+        return true;
+    return alloc_pgtable((addr >> pde_shift) << pde_shift, flags);
+}
+
+/*
+ * Release n entries of the page table for addr. The table is freed
+ * if it becomes unused, after its mapping is flushed (with the
+ * batch if any).
+ */
+static void put_pgtable(uint32_t addr, int n, tlb_batch_t* batch)
+{
+    paddr_t pgt_page = get_pgtable_page(addr);
+
+    if (pmem_add(pgt_page, -n) == 0)
+    {
+        pde_set(addr, 0);
+        if (batch)
+        {
+            tlb_batch_add(batch, get_pgtable(addr));
+            list_add(&batch->free_list, &pmem_get_page(pgt_page)->lru);
+        }
+        else
+        {
+            invalidate_tlb(get_pgtable(addr));
+            pmem_free_page(pgt_page);
+        }
+    }
+}
+
+/*
+ * Unmap range and free the physical pages if requested.
+ * The page tables are walked once per 4M span and the TLB
+ * is flushed once at the end, the pages and page tables
+ * are freed after the flush.
+ */
+static void unmap_range(uint32_t start, uint32_t end, bool free)
+{
+    uint32_t addr, last;
+    tlb_batch_t batch;
+    paddr_t page;
+    page_t pte;
+    int i, count;
+
+    tlb_batch_init(&batch);
+    for (addr = start; addr < end; addr = last)
+    {
+        last  = get_span_end(addr, end);
+        count = (last - addr) / PAGE_SIZE;
+
+        // Page table freed?
+        if (~page_get_flags(pde_get(addr)) & PAGE_PRESENT)
+            panic("Page table for virtual address 0x%X already freed", addr);
+
+        for (i = 0; i < count; ++i)
+        {
+            pte = pte_get(addr + i * PAGE_SIZE);
+
+            // Swapped out? Not in the TLB, only the slot is freed
+            if (page_get_flags(pte) & PAGE_SWAPPED)
+            {
+                swap_free(page_get_address(pte) >> _PTE_SHIFT);
+                pte_set(addr + i * PAGE_SIZE, 0);
+                continue;
+            }
+
+            // Is virtual page freed?
+            if (~page_get_flags(pte) & PAGE_PRESENT)
+                panic("Virtual address 0x%X already freed", addr + i * PAGE_SIZE);
+
+            page = page_get_address(pte);
+            pte_set(addr + i * PAGE_SIZE, 0);
+            tlb_batch_add(&batch, addr + i * PAGE_SIZE);
+
+            if (free)
+                tlb_batch_put_page(&batch, page);
+        }
+
+        // Free page table if unused
+        put_pgtable(addr, count, &batch);
+    }
+
+    tlb_batch_flush(&batch);
+}
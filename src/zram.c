@@ -0,0 +1,370 @@
+/*
+ * Compressed RAM disks
+ */
+#include <zram.h>
+#include <zsmalloc.h>
+#include <lz4.h>
+#include <pmem.h>
+#include <thread.h>
+#include <malloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <debug.h>
+#include <math.h>
+#include <asm.h>
+
+enum
+{
+    SECTORS_PER_PAGE = PAGE_SIZE / BLKDEV_SECTOR_SIZE,
+
+    // Pages which don't compress below are stored uncompressed
+    HUGE_SIZE        = PAGE_SIZE * 3 / 4,
+
+    // Entry flags
+    ZRAM_STORED      = 1,
+    ZRAM_SAME        = 2,
+};
+
+/*
+ * Page entry
+ *    - handle is the zsmalloc handle or the fill
+ *      value of same-filled pages
+ *    - size is PAGE_SIZE if the page is stored uncompressed
+ */
+typedef struct zram_entry_s
+{
+    uint32_t handle;
+    uint16_t size;
+    uint16_t flags;
+} zram_entry_t;
+
+typedef struct zram_s
+{
+    blkdev_t      dev;
+    int           pages;
+    zram_entry_t* table;
+    zram_stats_t  stats;
+} zram_t;
+
+/*
+ * Buffers for compression and partial page access
+ *    - One set for all devices, a request holds it
+ *      by a sleeping lock
+ *    - Requests run with irqs enabled, only the table
+ *      and zsmalloc updates disable irqs
+ */
+
+static uint8_t workmem[LZ4_WORKMEM_SIZE];
+static uint8_t compr_buf[HUGE_SIZE];
+static uint8_t page_buf[PAGE_SIZE];
+
+static bool buf_busy = false;
+static waitqueue_t buf_wait = WAITQUEUE_INIT(buf_wait);
+
+static void buf_lock()
+{
+    bool irq_status;
+
+    irqs_save(&irq_status);
+    while (buf_busy)
+        thread_wait(&buf_wait, 0);
+    buf_busy = true;
+    irqs_restore(irq_status);
+}
+
+static void buf_unlock()
+{
+    bool irq_status;
+
+    irqs_save(&irq_status);
+    buf_busy = false;
+    thread_wakeup(&buf_wait);
+    irqs_restore(irq_status);
+}
+
+static bool zram_read(blkdev_t*, uint32_t, int, void*);
+static bool zram_write(blkdev_t*, uint32_t, int, const void*);
+
+void __init zram_init()
+{
+    char sector[BLKDEV_SECTOR_SIZE];
+    blkdev_t* dev;
+
+    zs_init();
+
+    // Header page and half of the memory as slots
+    dev = zram_create("zram0", pmem_get_stats()->total / 2 + 1);
+
+    // Swap signature at the end of the first page
+    memset(sector, 0, sizeof (sector));
+    memcpy(sector + sizeof (sector) - 10, "SWAPSPACE2", 10);
+    blkdev_write(dev, SECTORS_PER_PAGE - 1, 1, sector);
+}
+
+blkdev_t* zram_create(const char* name, int pages)
+{
+    zram_t* zram = calloc(sizeof (zram_t));
+
+    zram->pages = pages;
+    zram->table = calloc(pages * sizeof (zram_entry_t));
+
+    strncpy(zram->dev.name, name, sizeof (zram->dev.name) - 1);
+    zram->dev.sectors = pages * SECTORS_PER_PAGE;
+    zram->dev.read    = zram_read;
+    zram->dev.write   = zram_write;
+    zram->dev.data    = zram;
+    blkdev_register(&zram->dev);
+
+    return &zram->dev;
+}
+
+const zram_stats_t* zram_get_stats(blkdev_t* dev)
+{
+    return &((zram_t*)dev->data)->stats;
+}
+
+// Average cycles, 64 bit division isn't available
+static int avg_cycles(uint64_t cycles, int n)
+{
+    int shift = 0;
+
+    if (n == 0)
+        return 0;
+    while ((cycles >> shift) > 0x7FFFFFFF)
+        ++shift;
+    return ((uint32_t)(cycles >> shift) / n) << shift;
+}
+
+// zram statistics
+void zram_dump_stats(const zram_stats_t* stats)
+{
+    int orig = (stats->pages - stats->same) << 2, compr = stats->compr_size >> 10;
+
+    printf("zram Statistics:\n"
+           " Stored:     %d pages (%d same-filled, %d incompressible)\n"
+           " Data:       %dK compressed to %dK (%d%%)\n"
+           " Memory:     %dK (all devices)\n"
+           " Compress:   %d cycles/page\n"
+           " Decompress: %d cycles/page\n"
+           " Requests:   %d reads, %d writes, %d errors\n",
+           stats->pages, stats->same, stats->huge,
+           orig, compr, orig ? compr * 100 / orig : 0,
+           zs_get_stats()->pages << 2,
+           avg_cycles(stats->compr_cycles, stats->compressed),
+           avg_cycles(stats->decompr_cycles, stats->decompressed),
+           stats->reads, stats->writes, stats->errors);
+}
+
+static void free_entry(zram_t* zram, int index)
+{
+    zram_entry_t* e = zram->table + index;
+
+    if (!e->flags)
+        return;
+
+    if (e->flags & ZRAM_SAME)
+        --zram->stats.same;
+    else
+    {
+        if (e->size == PAGE_SIZE)
+            --zram->stats.huge;
+        zram->stats.compr_size -= e->size;
+        zs_free(e->handle);
+    }
+    --zram->stats.pages;
+
+    e->handle = 0;
+    e->size   = 0;
+    e->flags  = 0;
+}
+
+void zram_reset(blkdev_t* dev)
+{
+    zram_t* zram = (zram_t*)dev->data;
+    bool irq_status;
+    int i;
+
+    buf_lock();
+    irqs_save(&irq_status);
+    for (i = 0; i < zram->pages; ++i)
+        free_entry(zram, i);
+    memset(&zram->stats, 0, sizeof (zram->stats));
+    irqs_restore(irq_status);
+    buf_unlock();
+}
+
+// Page consists of one repeated value?
+static bool same_filled(const uint32_t* page, uint32_t* value)
+{
+    int i;
+    for (i = 1; i < PAGE_SIZE / 4; ++i)
+    {
+        if (page[i] != page[0])
+            return false;
+    }
+    *value = page[0];
+    return true;
+}
+
+static bool read_page(zram_t* zram, int index, void* buf)
+{
+    zram_entry_t* e = zram->table + index;
+    uint64_t start;
+    void* map;
+    int size, i;
+
+    // Never written
+    if (!e->flags)
+    {
+        memset(buf, 0, PAGE_SIZE);
+        return true;
+    }
+
+    if (e->flags & ZRAM_SAME)
+    {
+        for (i = 0; i < PAGE_SIZE / 4; ++i)
+            ((uint32_t*)buf)[i] = e->handle;
+        return true;
+    }
+
+    map = zs_map(e->handle);
+    if (e->size == PAGE_SIZE)
+    {
+        memcpy(buf, map, PAGE_SIZE);
+        zs_unmap(map);
+        return true;
+    }
+
+    start = rdtsc();
+    size = lz4_decompress(map, e->size, buf, PAGE_SIZE);
+    zram->stats.decompr_cycles += rdtsc() - start;
+    ++zram->stats.decompressed;
+    zs_unmap(map);
+
+    return (size == PAGE_SIZE);
+}
+
+static bool write_page(zram_t* zram, int index, const void* buf)
+{
+    zram_entry_t* e = zram->table + index;
+    const void* data = compr_buf;
+    uint32_t handle, value;
+    bool irq_status;
+    uint64_t start;
+    void* map;
+    int size;
+
+    irqs_save(&irq_status);
+    free_entry(zram, index);
+
+    if (same_filled((const uint32_t*)buf, &value))
+    {
+        e->handle = value;
+        e->flags  = ZRAM_SAME;
+        ++zram->stats.same;
+        ++zram->stats.pages;
+        irqs_restore(irq_status);
+        return true;
+    }
+    irqs_restore(irq_status);
+
+    start = rdtsc();
+    size = lz4_compress(buf, PAGE_SIZE, compr_buf, HUGE_SIZE, workmem);
+    zram->stats.compr_cycles += rdtsc() - start;
+    ++zram->stats.compressed;
+
+    if (size == 0)
+    {
+        size = PAGE_SIZE;
+        data = buf;
+    }
+
+    /*
+     * Irqs stay disabled, so the allocator doesn't reclaim
+     * directly. Pageout might write to zram again and
+     * would wait for the buffers held by this request.
+     */
+    irqs_save(&irq_status);
+    handle = zs_malloc(size);
+    irqs_restore(irq_status);
+    if (!handle)
+        return false;
+
+    map = zs_map(handle);
+    memcpy(map, data, size);
+    zs_unmap(map);
+
+    irqs_save(&irq_status);
+    e->handle = handle;
+    e->size   = size;
+    e->flags  = ZRAM_STORED;
+
+    if (size == PAGE_SIZE)
+        ++zram->stats.huge;
+    zram->stats.compr_size += size;
+    ++zram->stats.pages;
+    irqs_restore(irq_status);
+    return true;
+}
+
+/*
+ * Transfer sectors page by page. Partial pages
+ * are read into the page buffer first.
+ */
+static bool zram_transfer(blkdev_t* dev, uint32_t sector, int count, char* buf, bool write)
+{
+    zram_t* zram = (zram_t*)dev->data;
+    int index, offset, n, size;
+    bool ok = true;
+
+    if (sector + count > dev->sectors)
+        return false;
+
+    buf_lock();
+
+    if (write)
+        ++zram->stats.writes;
+    else
+        ++zram->stats.reads;
+
+    while (ok && count > 0)
+    {
+        index  = sector / SECTORS_PER_PAGE;
+        offset = sector % SECTORS_PER_PAGE;
+        n      = min(SECTORS_PER_PAGE - offset, count);
+        size   = n * BLKDEV_SECTOR_SIZE;
+
+        if (n == SECTORS_PER_PAGE)
+            ok = (write ? write_page(zram, index, buf) : read_page(zram, index, buf));
+        else if ((ok = read_page(zram, index, page_buf)))
+        {
+            if (write)
+            {
+                memcpy(page_buf + offset * BLKDEV_SECTOR_SIZE, buf, size);
+                ok = write_page(zram, index, page_buf);
+            }
+            else
+                memcpy(buf, page_buf + offset * BLKDEV_SECTOR_SIZE, size);
+        }
+
+        sector += n;
+        count  -= n;
+        buf    += size;
+    }
+
+    if (!ok)
+        ++zram->stats.errors;
+
+    buf_unlock();
+    return ok;
+}
+
+static bool zram_read(blkdev_t* dev, uint32_t sector, int count, void* buf)
+{
+    return zram_transfer(dev, sector, count, (char*)buf, false);
+}
+
+static bool zram_write(blkdev_t* dev, uint32_t sector, int count, const void* buf)
+{
+    return zram_transfer(dev, sector, count, (char*)buf, true);
+}
@@ -0,0 +1,167 @@
+#include <zsmalloc.h>
+#include <pmem.h>
+#include <vmem.h>
+#include <list.h>
+#include <debug.h>
+#include <asm.h>
+
+enum
+{
+    ZS_CLASSES = ZS_MAX_SIZE / ZS_ALIGN,
+
+    // End of the free object list
+    ZS_END     = 0xFFFF,
+};
+
+/*
+ * Size class
+ *    - Pages with free objects are on the partial list,
+ *      full pages aren't on a list
+ *    - Free objects of a page are linked by their
+ *      first 16 bits (object index of the next one)
+ */
+typedef struct zs_class_s
+{
+    int    size;
+    int    per_page;
+    list_t partial;
+} zs_class_t;
+
+static zs_class_t classes[ZS_CLASSES];
+static zs_stats_t stats;
+
+void __init zs_init()
+{
+    int i;
+    for (i = 0; i < ZS_CLASSES; ++i)
+    {
+        classes[i].size     = (i + 1) * ZS_ALIGN;
+        classes[i].per_page = PAGE_SIZE / classes[i].size;
+        list_init(&classes[i].partial);
+    }
+}
+
+const zs_stats_t* zs_get_stats()
+{
+    return &stats;
+}
+
+// New page with all objects free, NULL if there's no memory
+static pmem_page_t* alloc_page(zs_class_t* class)
+{
+    pmem_page_t* desc;
+    paddr_t page;
+    char* map;
+    int i;
+
+    page = pmem_alloc_page();
+    if (page == BAD_PAGE)
+        return NULL;
+
+    map = (char*)vmem_kmap(page);
+    for (i = 0; i < class->per_page; ++i)
+        *(uint16_t*)(map + i * class->size) = (i + 1 < class->per_page ? i + 1 : ZS_END);
+    vmem_kunmap(map);
+
+    desc = pmem_get_page(page);
+    desc->flags   |= PMEM_LOCKED;
+    desc->owner    = class;
+    desc->mapcount = 0;
+    desc->vaddr    = 0;
+    ++stats.pages;
+
+    return desc;
+}
+
+uint32_t zs_malloc(size_t size)
+{
+    zs_class_t* class;
+    pmem_page_t* desc;
+    bool irq_status;
+    paddr_t obj;
+    char* map;
+
+    ASSERT(size > 0 && size <= ZS_MAX_SIZE);
+    class = classes + (size - 1) / ZS_ALIGN;
+
+    // The page is allocated first, because
+    // the allocator might reclaim pages into zsmalloc
+    desc = NULL;
+    if (list_empty(&class->partial))
+    {
+        desc = alloc_page(class);
+        if (!desc)
+            return 0;
+    }
+
+    irqs_save(&irq_status);
+
+    if (desc)
+        list_add(&class->partial, &desc->lru);
+    desc = LIST_OBJECT(class->partial.next, pmem_page_t, lru);
+
+    // Take the first free object
+    obj = pmem_page_address(desc) + desc->vaddr * class->size;
+    map = (char*)vmem_kmap(pmem_page_address(desc));
+    desc->vaddr = *(uint16_t*)(map + desc->vaddr * class->size);
+    vmem_kunmap(map);
+
+    if (++desc->mapcount == class->per_page)
+        list_delete(&desc->lru);
+
+    ++stats.objects;
+    stats.size += class->size;
+
+    irqs_restore(irq_status);
+
+    return obj >> ZS_ALIGN_SHIFT;
+}
+
+void zs_free(uint32_t handle)
+{
+    paddr_t obj = (paddr_t)handle << ZS_ALIGN_SHIFT;
+    paddr_t page = obj & ~(paddr_t)(PAGE_SIZE - 1);
+    pmem_page_t* desc = pmem_get_page(page);
+    zs_class_t* class = (zs_class_t*)desc->owner;
+    bool irq_status;
+    uint32_t index;
+    char* map;
+
+    ASSERT(handle && class && desc->mapcount > 0);
+
+    irqs_save(&irq_status);
+
+    // Full page gets free object
+    if (desc->mapcount == class->per_page)
+        list_add(&class->partial, &desc->lru);
+
+    index = (uint32_t)(obj - page) / class->size;
+    map = (char*)vmem_kmap(page);
+    *(uint16_t*)(map + index * class->size) = desc->vaddr;
+    vmem_kunmap(map);
+    desc->vaddr = index;
+
+    --stats.objects;
+    stats.size -= class->size;
+
+    if (--desc->mapcount == 0)
+    {
+        list_delete(&desc->lru);
+        desc->flags &= ~PMEM_LOCKED;
+        pmem_free_page(page);
+        --stats.pages;
+    }
+
+    irqs_restore(irq_status);
+}
+
+void* zs_map(uint32_t handle)
+{
+    paddr_t obj = (paddr_t)handle << ZS_ALIGN_SHIFT;
+    return (char*)vmem_kmap(obj & ~(paddr_t)(PAGE_SIZE - 1)) + (obj & (PAGE_SIZE - 1));
+}
+
+void zs_unmap(void* ptr)
+{
+    vmem_kunmap((void*)((uint32_t)ptr & ~(PAGE_SIZE - 1)));
+}